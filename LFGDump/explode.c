@@ -11,11 +11,71 @@
 //  specifications found on the internet.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include "explode.h"
 
+// -- PHASE TIMING --
+
+uint64_t explode_time_ns( void )
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Time taken by a pair of explode_time_ns() calls themselves, taken off
+// each timed sample.
+uint64_t explode_timer_overhead_ns = 0;
+
+pthread_once_t explode_timer_overhead_once = PTHREAD_ONCE_INIT;
+
+void explode_timer_overhead_measure( void )
+{
+    uint64_t least = ~0ULL;
+    
+    for (int i = 0; i < 32; i++)
+    {
+        uint64_t start = explode_time_ns();
+        uint64_t elapsed = explode_time_ns() - start;
+        
+        if (elapsed < least)
+        {
+            least = elapsed;
+        }
+    }
+    
+    explode_timer_overhead_ns = least;
+}
+
+void (*explode_trace_hook)( const char* name,
+                            const char* category,
+                            uint64_t start_ns,
+                            unsigned long bytes_in,
+                            unsigned long bytes_out ) = NULL;
+
+// Pass a span to the trace hook, if there is one.
+void explode_trace( const char* name,
+                    const char* category,
+                    uint64_t start_ns,
+                    unsigned long bytes_in,
+                    unsigned long bytes_out )
+{
+    if (explode_trace_hook)
+    {
+        explode_trace_hook(name, category, start_ns, bytes_in, bytes_out);
+    }
+}
+
 // -- BIT READ ROUTINES --
+#define READ_BLOCK_SIZE      0x4000   // ( 16k)
+
 typedef struct {
 
     // Input file pointer.
@@ -25,91 +85,248 @@ typedef struct {
     // multi-file archives; handler can return a new file pointer
     // but must be at correct point in the data stream.
     FILE* (*eof_reached) ( void );
+    
+    // Input memory. For file input this is the block last read from the
+    // file, and it is refilled when used up.
+    const unsigned char* data;
+    unsigned long data_length;
+    unsigned long data_position;
 
-    // The current byte from input stream that bits are being pulled from.
-    unsigned char current_byte_value;
-
-    // Bit position in current byte. Next bit will come from this position.
-    int current_bit_position;
+    // Bits read ahead from the input, next bit lowest. Up to 64 are held.
+    uint64_t bit_buffer;
+    int bit_count;
 
     // Signals a read error
     int error_flag;
     
+    // Don't report errors (for speculative decoding).
+    bool quiet;
+    
     // Stats. Used to track total number of encoded bytes read.
     unsigned long total_bytes;
     
+    // Time spent reading file input, and in eof_reached(), in ns.
+    uint64_t read_ns;
+    uint64_t switch_ns;
+    
+    // Read memory buffer for file input.
+    unsigned char block[ READ_BLOCK_SIZE ];
+    
 } read_bitstream_type;
 
-read_bitstream_type read_bitstream;
+// Set up to read from memory, starting bit_offset bits in.
+void read_bitstream_init_memory( read_bitstream_type* read_bitstream,
+                                 const unsigned char* data,
+                                 unsigned long data_length,
+                                 unsigned long bit_offset )
+{
+    read_bitstream->file_pointer = NULL;
+    read_bitstream->eof_reached = NULL;
+    read_bitstream->data = data;
+    read_bitstream->data_length = data_length;
+    read_bitstream->data_position = bit_offset / 8;
+    read_bitstream->bit_buffer = 0;
+    read_bitstream->bit_count = 0;
+    read_bitstream->error_flag = 0;
+    read_bitstream->quiet = false;
+    read_bitstream->total_bytes = 0;
+    
+    // A start past the end reads nothing.
+    if (read_bitstream->data_position > data_length)
+    {
+        read_bitstream->data_position = data_length;
+        read_bitstream->error_flag = true;
+    }
+    
+    // Start part way into a byte if needed.
+    if ((bit_offset % 8) &&
+        (read_bitstream->data_position < data_length))
+    {
+        read_bitstream->bit_buffer =
+            data[read_bitstream->data_position++] >> (bit_offset % 8);
+        read_bitstream->bit_count = 8 - (bit_offset % 8);
+        read_bitstream->total_bytes++;
+    }
+}
+
+// Position of the next bit to read from memory, in bits from the start.
+unsigned long read_bitstream_position( read_bitstream_type* read_bitstream )
+{
+    return read_bitstream->data_position * 8 - read_bitstream->bit_count;
+}
+
+// Read the next block of file input. Returns false at the end of the file
+// (and always for memory input, which is all there from the start).
+bool read_bitstream_load_block( read_bitstream_type* read_bitstream )
+{
+    uint64_t start;
+    
+    if (!read_bitstream->file_pointer)
+    {
+        return false;
+    }
+    
+    start = explode_time_ns();
+    
+    read_bitstream->data_length = fread(read_bitstream->block,
+                                        sizeof(read_bitstream->block[0]),
+                                        READ_BLOCK_SIZE,
+                                        read_bitstream->file_pointer);
+    read_bitstream->data_position = 0;
+    
+    read_bitstream->read_ns += explode_time_ns() - start;
+    
+    return read_bitstream->data_length > 0;
+}
+
+// Get the next input byte, EOF if there is none.
+int read_next_byte( read_bitstream_type* read_bitstream )
+{
+    if ((read_bitstream->data_position >= read_bitstream->data_length) &&
+        !read_bitstream_load_block(read_bitstream))
+    {
+        return EOF;
+    }
+    
+    return read_bitstream->data[read_bitstream->data_position++];
+}
+
+// Input bytes that can be read without reaching the end of the current
+// memory or file block.
+unsigned long read_bitstream_margin( read_bitstream_type* read_bitstream )
+{
+    if (read_bitstream->data_position >= read_bitstream->data_length)
+    {
+        return 0;
+    }
+    
+    return read_bitstream->data_length - read_bitstream->data_position;
+}
+
+// Top up the bit buffer with whole bytes, with no check for the end of the
+// input. Only for when read_bitstream_margin() is known to be at least 8.
+void read_bitstream_refill( read_bitstream_type* read_bitstream )
+{
+    while (read_bitstream->bit_count <= 56)
+    {
+        read_bitstream->bit_buffer |=
+            (uint64_t) read_bitstream->data[read_bitstream->data_position++]
+            << read_bitstream->bit_count;
+        read_bitstream->bit_count += 8;
+        read_bitstream->total_bytes++;
+    }
+}
+
+// Top up the bit buffer with whole bytes, as far as the current input goes
+// (the next archive file isn't opened for this). Returns the number of bits
+// held.
+int read_bitstream_fill( read_bitstream_type* read_bitstream )
+{
+    while (read_bitstream->bit_count <= 56)
+    {
+        int ch = read_next_byte(read_bitstream);
+        
+        if (ch == EOF)
+        {
+            break;
+        }
+        
+        read_bitstream->bit_buffer |=
+            (uint64_t) ch << read_bitstream->bit_count;
+        read_bitstream->bit_count += 8;
+        read_bitstream->total_bytes++;
+    }
+    
+    return read_bitstream->bit_count;
+}
 
 // Read bit from bitstream byte.
-unsigned int read_next_bit( void )
+unsigned int read_next_bit( read_bitstream_type* read_bitstream )
 {
-    int ch, value;
+    int ch;
+    unsigned int value;
     
-    // Start of byte, need to load new byte.
-    if (read_bitstream.current_bit_position == 0)
+    // Out of bits, need to load more.
+    if ((read_bitstream->bit_count == 0) &&
+        (read_bitstream_fill(read_bitstream) == 0))
     {
-        ch = fgetc(read_bitstream.file_pointer);
+        ch = EOF;
         
         // Check that end of file wasn't reached.
-        if ((ch==EOF) && (read_bitstream.eof_reached != NULL))
+        if (read_bitstream->eof_reached != NULL)
         {
-            read_bitstream.file_pointer = read_bitstream.eof_reached();
+            uint64_t start = explode_time_ns();
+            
+            read_bitstream->file_pointer = read_bitstream->eof_reached();
+            read_bitstream->switch_ns += explode_time_ns() - start;
             
-            if (read_bitstream.file_pointer)
+            if (read_bitstream->file_pointer)
             {
                 // New file. Now try to get a byte.
-                ch = fgetc(read_bitstream.file_pointer);
+                ch = read_next_byte(read_bitstream);
             } else {
                 // No new file
-                read_bitstream.error_flag = true;
+                read_bitstream->error_flag = true;
             }
         }
         
         // Error if eof still occurs or a different error is reported.
         if (ch < 0)
         {
-            printf("Error: Unexpected end of file or file error.\n");
-            read_bitstream.error_flag = true;
+            if (!read_bitstream->quiet)
+            {
+                printf("Error: Unexpected end of file or file error.\n");
+            }
+            read_bitstream->error_flag = true;
         }
         
-        read_bitstream.current_byte_value = ch;
-        read_bitstream.total_bytes++;
-
+        read_bitstream->bit_buffer = (unsigned char) ch;
+        read_bitstream->bit_count = 8;
+        read_bitstream->total_bytes++;
     }
     
-    value  = (read_bitstream.current_byte_value >>
-              read_bitstream.current_bit_position) & 0x1;
+    value = read_bitstream->bit_buffer & 0x1;
     
-    read_bitstream.current_bit_position++;
-    read_bitstream.current_bit_position%=8;
+    read_bitstream->bit_buffer >>= 1;
+    read_bitstream->bit_count--;
     
-    return (unsigned int) value;
+    return value;
 }
 
 // General function to read bits, and assemble them with MSBs first. Note
 // that bits are always read from the byte stream lsb first. What matters here
 // is how they are reassembled.
-unsigned int read_bits_msb_first( int bit_count )
+unsigned int read_bits_msb_first( read_bitstream_type* read_bitstream,
+                                  int bit_count )
 {
     unsigned int temp = 0;
     
     for (int i=0; i<bit_count;i++)
     {
-        temp = (temp << 1) | read_next_bit();
+        temp = (temp << 1) | read_next_bit(read_bitstream);
     }
     return temp;
 }
 
 // General function to read bits, and assemble them with LSBs first.
-unsigned int read_bits_lsb_first( int bit_count )
+unsigned int read_bits_lsb_first( read_bitstream_type* read_bitstream,
+                                  int bit_count )
 {
     unsigned int temp = 0;
     
+    // Take them all at once when they are in the buffer.
+    if ((read_bitstream->bit_count >= bit_count) ||
+        (read_bitstream_fill(read_bitstream) >= bit_count))
+    {
+        temp = read_bitstream->bit_buffer & ((1u << bit_count) - 1);
+        read_bitstream->bit_buffer >>= bit_count;
+        read_bitstream->bit_count -= bit_count;
+        return temp;
+    }
+    
     for (int i=0; i<bit_count;i++)
     {
-        temp = (read_next_bit() << i) | temp;
+        temp = (read_next_bit(read_bitstream) << i) | temp;
     }
     return temp;
 }
@@ -124,6 +341,17 @@ typedef struct {
     // Output file pointer.
     FILE* file_pointer;
     
+    // Output memory, used instead of the buffer when set. The first
+    // history_length bytes hold earlier output that dictionary lookups may
+    // refer to; new bytes are added after them, up to data_length.
+    unsigned char* data;
+    unsigned long history_length;
+    unsigned long data_length;
+    
+    // If not 0, memory output stops after the token that brings
+    // bytes_written to at least this.
+    unsigned long stop_length;
+    
     // write position in buffer
     unsigned int buffer_position;
     
@@ -133,65 +361,146 @@ typedef struct {
     // Signals a write error
     int error_flag;
     
+    // Time spent writing to the file, in ns.
+    uint64_t write_ns;
+    
     // Write memory buffer
     // Must write out buffer every time the window fills or at file end.
     unsigned char buffer[ WRITE_BUFF_SIZE ];
     
 } write_buffer_type;
 
-write_buffer_type write_buffer;
-
 // Writes output buffer to file
-void write_to_file( void )
+void write_to_file( write_buffer_type* write_buffer )
 {
-    if (write_buffer.file_pointer)
+    if (write_buffer->file_pointer)
     {
-        fwrite(write_buffer.buffer, sizeof(write_buffer.buffer[0]),
-               write_buffer.buffer_position,
-               write_buffer.file_pointer);
+        uint64_t start = explode_time_ns();
+        
+        fwrite(write_buffer->buffer, sizeof(write_buffer->buffer[0]),
+               write_buffer->buffer_position,
+               write_buffer->file_pointer);
     
-        if (ferror(write_buffer.file_pointer))
+        if (ferror(write_buffer->file_pointer))
         {
-            write_buffer.error_flag = true;
+            write_buffer->error_flag = true;
         }
+        
+        write_buffer->write_ns += explode_time_ns() - start;
+        
+        explode_trace("flush", "io", start, 0,
+                      write_buffer->buffer_position);
     }
-    write_buffer.bytes_written += write_buffer.buffer_position;
+    write_buffer->bytes_written += write_buffer->buffer_position;
 }
 
-unsigned long read_buffer_get_bytes_read( void )
+// Write a byte out to the output stream.
+void write_byte( write_buffer_type* write_buffer, unsigned char next_byte )
 {
-    return read_bitstream.total_bytes;
+    if (write_buffer->data)
+    {
+        if (write_buffer->history_length + write_buffer->bytes_written >=
+            write_buffer->data_length)
+        {
+            printf("Error: Output longer than expected.\n");
+            write_buffer->error_flag = true;
+            return;
+        }
+        
+        write_buffer->data[write_buffer->history_length +
+                           write_buffer->bytes_written++] = next_byte;
+        return;
+    }
+    
+    write_buffer->buffer[write_buffer->buffer_position++] = next_byte;
+    
+    if (write_buffer->buffer_position == WRITE_BUFF_SIZE)
+    {
+        write_to_file(write_buffer);
+    }
+    
+    write_buffer->buffer_position %= WRITE_BUFF_SIZE;
+    
 }
 
-unsigned int write_buffer_get_bytes_written( void )
+// Write several bytes out to the output stream.
+void write_bytes( write_buffer_type* write_buffer,
+                  const unsigned char* bytes,
+                  int count )
 {
-    return write_buffer.bytes_written + write_buffer.buffer_position;
+    if (write_buffer->data)
+    {
+        if (write_buffer->history_length + write_buffer->bytes_written +
+            count > write_buffer->data_length)
+        {
+            printf("Error: Output longer than expected.\n");
+            write_buffer->error_flag = true;
+            return;
+        }
+        
+        memcpy(&write_buffer->data[write_buffer->history_length +
+                                   write_buffer->bytes_written],
+               bytes, count);
+        write_buffer->bytes_written += count;
+        return;
+    }
+    
+    // Straight into the buffer if it won't fill up.
+    if (write_buffer->buffer_position + count < WRITE_BUFF_SIZE)
+    {
+        memcpy(&write_buffer->buffer[write_buffer->buffer_position],
+               bytes, count);
+        write_buffer->buffer_position += count;
+        return;
+    }
+    
+    for (int i = 0; i < count; i++)
+    {
+        write_byte(write_buffer, bytes[i]);
+    }
 }
 
-// Write a byte out to the output stream.
-void write_byte( unsigned char next_byte )
+// Bytes that can still be written to memory output (no limit for files).
+unsigned long write_buffer_room( write_buffer_type* write_buffer )
 {
-    write_buffer.buffer[write_buffer.buffer_position++] = next_byte;
-    
-    if (write_buffer.buffer_position == WRITE_BUFF_SIZE)
+    if (!write_buffer->data)
     {
-        write_to_file();
+        return ~0UL;
     }
     
-    write_buffer.buffer_position %= WRITE_BUFF_SIZE;
-    
+    return write_buffer->data_length -
+           (write_buffer->history_length + write_buffer->bytes_written);
 }
 
 // Read byte from the *output* stream
-unsigned char read_byte_from_write_buffer( int offset )
+unsigned char read_byte_from_write_buffer( write_buffer_type* write_buffer,
+                                           int offset )
 {
-    return write_buffer.buffer[(write_buffer.buffer_position-offset)
+    if (write_buffer->data)
+    {
+        unsigned long position = write_buffer->history_length +
+                                 write_buffer->bytes_written;
+        
+        // Lookups can't reach back past the start of the given memory.
+        if (offset > position)
+        {
+            if (!write_buffer->error_flag)
+            {
+                printf("Error: Copy offset before start of data.\n");
+            }
+            write_buffer->error_flag = true;
+            return 0;
+        }
+        return write_buffer->data[position - offset];
+    }
+    
+    return write_buffer->buffer[(write_buffer->buffer_position-offset)
                                   % WRITE_BUFF_SIZE];
 }
 
 // -- EXPLODE IMPLEMENTATION --
 
-struct {
+typedef struct {
     
     // length for copying from dictionary.
     int length;
@@ -210,14 +519,48 @@ struct {
     int max_length;
     int min_length;
     int length_histogram[520];
+    unsigned int offset_histogram[2][EXPLODE_WINDOW_SIZE];
+        // Copies by offset, length 2 copies (with shorter offsets) apart.
+    unsigned int literal_histogram[256];
+    
+    // Phase timing: time spent decoding, and the sample of copies timed to
+    // estimate time spent copying.
+    uint64_t decode_ns;
+    uint64_t copy_sample_ns;
+    unsigned int copy_samples;
     
-} explode;
+} explode_type;
 
 // Header info
-struct {
+typedef struct {
     uint8_t literal_mode;
     uint8_t dictionary_size;
-} header;
+} header_type;
+
+// Everything needed to explode one file. Each explode has its own state, so
+// several can run at once on different threads.
+typedef struct {
+    read_bitstream_type read_bitstream;
+    write_buffer_type write_buffer;
+    explode_type explode;
+    header_type header;
+} explode_state_type;
+
+// State used by extract_and_explode.
+explode_state_type explode_state;
+
+unsigned long read_buffer_get_bytes_read( void )
+{
+    // Whole bytes still in the bit buffer haven't been used yet.
+    return explode_state.read_bitstream.total_bytes -
+           explode_state.read_bitstream.bit_count / 8;
+}
+
+unsigned int write_buffer_get_bytes_written( void )
+{
+    return explode_state.write_buffer.bytes_written +
+           explode_state.write_buffer.buffer_position;
+}
 
 
 // Copy offset table; indexed by bit length
@@ -244,7 +587,34 @@ struct {
     {16, 0x3F, 0x00}
 };
 
-uint8_t literal_table[256] = {
+// Copy length codes, shortest length first: the first length of each code,
+// the bits in the code and the extra bits (lsb first) after it. Used to
+// count where the bits go; read_copy_length() does the decoding.
+struct {
+    unsigned int base_length;
+    unsigned int code_bits;
+    unsigned int extra_bits;
+} length_bits_table[] =
+{
+    {  2, 3, 0},
+    {  3, 2, 0},
+    {  4, 3, 0},
+    {  5, 3, 0},
+    {  6, 4, 0},
+    {  7, 4, 0},
+    {  8, 4, 0},
+    {  9, 5, 0},
+    { 10, 5, 1},
+    { 12, 5, 2},
+    { 16, 5, 3},
+    { 24, 6, 4},
+    { 40, 6, 5},
+    { 72, 6, 6},
+    {136, 7, 7},
+    {264, 7, 8}
+};
+
+uint8_t ascii_literal_table[256] = {
     0x20,                                             // 0
     0x45, 0x61, 0x65, 0x69, 0x6c, 0x6e, 0x6f,   // 1
     0x72, 0x73, 0x74, 0x75,
@@ -319,65 +689,65 @@ struct {
 // Read copy length codes. A fairly brute force method as there is an odd
 // switching of msb first to lsb first in the interpretation and the
 // values 2 and 3 do not follow the natural huffman-like coding.
-int read_copy_length( void )
+int read_copy_length( explode_state_type* state )
 {
     int length = 0;
     
     // First two bits (xx)
-    switch (read_bits_msb_first(2)) {
+    switch (read_bits_msb_first(&state->read_bitstream, 2)) {
         
         case 0:            
             // Next 2 bits (00xx)
-            switch (read_bits_msb_first( 2)) {
+            switch (read_bits_msb_first(&state->read_bitstream, 2)) {
             
                 case 0:                   
                     // Next 2 bits (0000xx)
-                    switch (read_bits_msb_first( 2)) {
+                    switch (read_bits_msb_first(&state->read_bitstream, 2)) {
                     
                         case 0:                        
                             // Next bit (000000x)
-                            if (read_next_bit())
+                            if (read_next_bit(&state->read_bitstream))
                                 // 0000001xxxxxxx
-                                length = 136 + read_bits_lsb_first(7);
+                                length = 136 + read_bits_lsb_first(&state->read_bitstream, 7);
                             else
                                 // 0000000xxxxxxxx
-                                length = 264 + read_bits_lsb_first(8);
+                                length = 264 + read_bits_lsb_first(&state->read_bitstream, 8);
                             break;
                             
                         case 1:
                             // 000001xxxxxx
-                            length = 72 + read_bits_lsb_first(6);
+                            length = 72 + read_bits_lsb_first(&state->read_bitstream, 6);
                             break;
                             
                         case 2:
                             // 000010xxxxx
-                            length = 40 + read_bits_lsb_first(5);
+                            length = 40 + read_bits_lsb_first(&state->read_bitstream, 5);
                             break;
                             
                         case 3:
                             // 0000
-                            length = 24 + read_bits_lsb_first(4);
+                            length = 24 + read_bits_lsb_first(&state->read_bitstream, 4);
                     }
                     break;
                     
                 case 1:
                 	// Next bit (0001x)
-                    if (read_next_bit())
+                    if (read_next_bit(&state->read_bitstream))
                         // 00011xx
-                        length = 12 + read_bits_lsb_first(2);
+                        length = 12 + read_bits_lsb_first(&state->read_bitstream, 2);
                     else
                         // 00010xxx
-                        length = 16 + read_bits_lsb_first(3);
+                        length = 16 + read_bits_lsb_first(&state->read_bitstream, 3);
                     break;
                     
                 case 2:
                 	// Next bit (0010x)
-                    if (read_next_bit()) {
+                    if (read_next_bit(&state->read_bitstream)) {
                         // 00101
                         length = 9;
                     } else {
                         // 00100x
-                        length = 10 + read_next_bit();
+                        length = 10 + read_next_bit(&state->read_bitstream);
                     }
                     break;
                     
@@ -389,12 +759,12 @@ int read_copy_length( void )
            
         case 1:
 			// Next bit (01x)
-            if (read_next_bit()) {
+            if (read_next_bit(&state->read_bitstream)) {
                 // 011
                 length = 5;
             } else {
             	// Next bit (010x)
-                if (read_next_bit()) {
+                if (read_next_bit(&state->read_bitstream)) {
                     // 0101
                     length = 6;
                 } else {
@@ -406,7 +776,7 @@ int read_copy_length( void )
             
         case 2:
         	// Next bit (10x)
-            if (read_next_bit()) {
+            if (read_next_bit(&state->read_bitstream)) {
                 // 101
                 length = 2;
             } else {
@@ -427,7 +797,7 @@ int read_copy_length( void )
 }
 
 // Read the offset part of a length/offset reference
-int read_copy_offset( void )
+int read_copy_offset( explode_state_type* state )
 {
     int offset = 0;         // The offset value we are looking for.
     int offset_bits = 0;    // Input bits for offset.
@@ -436,7 +806,7 @@ int read_copy_offset( void )
     int length;             //
     
     // Get 6 MS bits of the resulting offset
-    offset_bits = read_bits_msb_first(2);
+    offset_bits = read_bits_msb_first(&state->read_bitstream, 2);
     
     // Go through table by length to see if there is a match.
     for (length = 2; length<9; length++) {
@@ -450,35 +820,35 @@ int read_copy_offset( void )
             break;
         }
         
-        offset_bits = (offset_bits << 1) | read_next_bit();
+        offset_bits = (offset_bits << 1) | read_next_bit(&state->read_bitstream);
     }
     
     if (length == 9) printf("\nError: Copy offset value not found.\n");
 
     // Now get low order bits and append. Length 2 is a special case.
-    if (explode.length == 2)
+    if (state->explode.length == 2)
         num_lsbs = 2;
     else
-        num_lsbs = header.dictionary_size;
+        num_lsbs = state->header.dictionary_size;
     
-    offset = (offset << num_lsbs) | read_bits_lsb_first(num_lsbs);
+    offset = (offset << num_lsbs) | read_bits_lsb_first(&state->read_bitstream, num_lsbs);
     
     return offset;
 }
 
 // Read a literal
-unsigned char read_literal( void )
+unsigned char read_literal( explode_state_type* state )
 {
     int literal = 0;        // The offset value we are looking for.
     int literal_bits = 0;   // Input bits for offset.
     int diff;               // Difference used in calulating with table.
     int length;             // Bit length
     
-    if (header.literal_mode == 0x1)
+    if (state->header.literal_mode == 0x1)
     {
     
     // Get 4
-    literal_bits = read_bits_msb_first(4);
+    literal_bits = read_bits_msb_first(&state->read_bitstream, 4);
     
     // Go through table by length to see if there is a match.
     for (length = 4; length<14; length++) {
@@ -492,170 +862,2539 @@ unsigned char read_literal( void )
             break;
         }
         
-        literal_bits = (literal_bits << 1) | read_next_bit();
+        literal_bits = (literal_bits << 1) | read_next_bit(&state->read_bitstream);
     }
         
-    return literal_table[literal];
+    return ascii_literal_table[literal];
     
     }
     else
     {
-      return read_bits_lsb_first(8);
+      return read_bits_lsb_first(&state->read_bitstream, 8);
     }
     
 }
 
-void write_dict_data( void )
+void write_dict_data( explode_state_type* state )
 {
-    int offset = explode.offset+1;   // +1 since zero should reference the
+    int offset = state->explode.offset+1;   // +1 since zero should reference the
                                      // previous byte.
+    int length = state->explode.length;
+    write_buffer_type* write_buffer = &state->write_buffer;
+    
+    // Copy straight within the output when the whole copy is in range.
+    // Bytes are copied one at a time in order, as the source may overlap
+    // what is being written.
+    if (write_buffer->data)
+    {
+        unsigned long position = write_buffer->history_length +
+                                 write_buffer->bytes_written;
+        
+        if ((offset <= position) &&
+            (position + length <= write_buffer->data_length))
+        {
+            unsigned char* out = &write_buffer->data[position];
+            
+            for (int i = 0; i < length; i++)
+            {
+                out[i] = out[i - offset];
+            }
+            write_buffer->bytes_written += length;
+            return;
+        }
+    }
+    else if ((write_buffer->buffer_position >= offset) &&
+             (write_buffer->buffer_position + length < WRITE_BUFF_SIZE))
+    {
+        unsigned char* out =
+            &write_buffer->buffer[write_buffer->buffer_position];
+        
+        for (int i = 0; i < length; i++)
+        {
+            out[i] = out[i - offset];
+        }
+        write_buffer->buffer_position += length;
+        return;
+    }
     
     // Do this length times. Offset does not change since one byte is
     // added each iteration and we are counting from the end.
-    for (int i = 0; i < explode.length; i++) {
-        write_byte( read_byte_from_write_buffer(offset) );
+    for (int i = 0; i < length; i++) {
+        write_byte(write_buffer,
+                   read_byte_from_write_buffer(write_buffer, offset));
     }
 }
 
-/* Extract a file from an archive file and explode it.
-   in_fp:           Pointer to imploded data start in archive file.
-   out_filename:    Output filename [consider making this fp_out].
-   expected_length: Expected length of file (0 if not provided).
-   eof_reached():   Callback that indicates archive EOF is reached.
-                    Callback should return new file pointer with 
-                    the continued data for the imploded file.
- */
-int extract_and_explode( FILE* in_fp,
-                         FILE* out_fp,
-                         int expected_length,
-                         explode_stats_type* explode_stats,
-                         FILE* (*eof_reached)(void))
-{
-    // Set up read parameters. [Consider making this a function.]
-    read_bitstream.file_pointer = in_fp;
-    read_bitstream.eof_reached = eof_reached;
-    read_bitstream.current_bit_position = 0;
-    read_bitstream.error_flag = 0;
-    read_bitstream.total_bytes = 0;
+#define COPY_SAMPLE_BITS      6
+    // One copy in 2^this is timed, to estimate the time spent copying.
+    // Which ones is scattered by hashing the copy count, so the sample
+    // doesn't fall in step with the data.
 
-    // Reset write parameters. [ Consider making this a function. ]
-    write_buffer.bytes_written = 0;
-    write_buffer.error_flag = 0;
-    write_buffer.buffer_position = 0;
-    write_buffer.file_pointer=out_fp;
+#define SAMPLE_HASH           0x9E3779B9u
+    // Multiplier for the hash (2^32 divided by the golden ratio).
+
+// Write out a copy once its length and offset are read, and update the
+// statistics.
+void explode_copy( explode_state_type* state )
+{
+    // Use copy length and offset to copy data from dictionary. A sample of
+    // copies are timed; any write to the file during one counts as writing.
+    if (((uint32_t)(state->explode.dictionary_count * SAMPLE_HASH) >>
+         (32 - COPY_SAMPLE_BITS)) == 0)
+    {
+        uint64_t write_ns = state->write_buffer.write_ns;
+        uint64_t start = explode_time_ns();
+        uint64_t elapsed;
+        
+        write_dict_data(state);
+        
+        elapsed = explode_time_ns() - start -
+                  (state->write_buffer.write_ns - write_ns);
+        
+        if (elapsed > explode_timer_overhead_ns)
+        {
+            state->explode.copy_sample_ns +=
+                elapsed - explode_timer_overhead_ns;
+        }
+        state->explode.copy_samples++;
+    }
+    else
+    {
+        write_dict_data(state);
+    }
+    
+    // Statistics update
+    state->explode.dictionary_count++;
+    state->explode.length_histogram[state->explode.length]++;
+    state->explode.offset_histogram[state->explode.length == 2]
+                                   [state->explode.offset]++;
     
+    if (state->explode.length > state->explode.max_length)
+        state->explode.max_length = state->explode.length;
+    if (state->explode.length < state->explode.min_length)
+        state->explode.min_length = state->explode.length;
+    if (state->explode.offset > state->explode.max_offset)
+        state->explode.max_offset = state->explode.offset;
+    if (state->explode.offset < state->explode.min_offset)
+        state->explode.min_offset = state->explode.offset;
+}
+
+// Reset counters, markers and statistics for a new explode.
+void explode_reset( explode_state_type* state )
+{
     // Reset counters/markers.
-    explode.end_marker = false;
-    explode.length = 0;
-    explode.offset = 0;
+    state->explode.end_marker = false;
+    state->explode.length = 0;
+    state->explode.offset = 0;
     
     // Initialize statistics.
-    explode.literal_count = 0;
-    explode.dictionary_count = 0;
-    explode.max_offset = 0;
-    explode.min_offset = 0x8000;
-    explode.max_length = 0;
-    explode.min_length = 0x8000;
-    memset(explode.length_histogram, 0, sizeof(explode.length_histogram));
-    
-    // Read two header bytes.
-    if ( fread( (uint8_t*) &header, sizeof (uint8_t), 2, in_fp ) != 2 ) {
-        printf("Error: Unable to read header info.\n");
-        return -1;
-    }
+    state->explode.literal_count = 0;
+    state->explode.dictionary_count = 0;
+    state->explode.max_offset = 0;
+    state->explode.min_offset = 0x8000;
+    state->explode.max_length = 0;
+    state->explode.min_length = 0x8000;
+    memset(state->explode.length_histogram, 0,
+           sizeof(state->explode.length_histogram));
+    memset(state->explode.offset_histogram, 0,
+           sizeof(state->explode.offset_histogram));
+    memset(state->explode.literal_histogram, 0,
+           sizeof(state->explode.literal_histogram));
     
+    // Phase timing.
+    state->explode.decode_ns = 0;
+    state->explode.copy_sample_ns = 0;
+    state->explode.copy_samples = 0;
+    state->read_bitstream.read_ns = 0;
+    state->read_bitstream.switch_ns = 0;
+    state->write_buffer.write_ns = 0;
+}
+
+// Check the two header bytes. Returns false if they aren't supported.
+bool explode_check_header( header_type* header )
+{
     // Check literal mode value. Only 0 currently supported (1 is also defined)
-    if (header.literal_mode > 0x1) {
-        printf("Error: Literal mode %d not supported.\n", header.literal_mode);
-        return -1;
+    if (header->literal_mode > 0x1) {
+        printf("Error: Literal mode %d not supported.\n", header->literal_mode);
+        return false;
     }
 
     // Check dictionary size value. Supports values of 4 through 6.
     // Dictionary size is 1 << (6 + val) (or 2^(6+val) ): 1024, 2048, or 4096
-    if ((header.dictionary_size < 4) || (header.dictionary_size > 6)) {
+    if ((header->dictionary_size < 4) || (header->dictionary_size > 6)) {
         printf("Error: Bad dictionary size value (%d) in header.\n",
-               header.dictionary_size);
-        return -1;
+               header->dictionary_size);
+        return false;
     }
     
-    // Read until EOF is detected.
-    do
-    {
-        // Next bit indicates a literal or dictionary lookup.
-        if (read_next_bit() == 0)
-        {
-            // -- Literal --
-            unsigned char value;
-            
-            value = read_literal();
-            write_byte( value );
-            
-            // Stats update
-            explode.literal_count++;
-        }
-        else
-        {
-            // -- Dictionary Look Up --
-            
-            // Dictionary look up.  Find length and offset.
-            explode.length = read_copy_length();
-            
-            // Length of 519 indicates end of file.
-            if (explode.length == 519)
-            {
-                explode.end_marker = true;
-            }
-            else // otherwise,
-            {                
-                // Find offset.
-                explode.offset = read_copy_offset();
-               
-                // Use copy length and offset to copy data from dictionary.
-                write_dict_data();
-                
-                // Statistics update
-                explode.dictionary_count++;
-                explode.length_histogram[explode.length]++;
-                
-                if (explode.length > explode.max_length)
-                    explode.max_length = explode.length;
-                if (explode.length < explode.min_length)
-                    explode.min_length = explode.length;
-                if (explode.offset > explode.max_offset)
-                    explode.max_offset = explode.offset;
-                if (explode.offset < explode.min_offset)
-                    explode.min_offset = explode.offset;
+    return true;
+}
 
-            }
-        }
-    } while ( !explode.end_marker &&
-              !read_bitstream.error_flag && !write_buffer.error_flag );
-    
-    write_to_file();
-    
-    // If expected length was passed in, check it.
-    if ((expected_length) &&
-        (write_buffer.bytes_written != expected_length))
+// True once memory output has been filled (or reached its stop length).
+bool explode_output_full( write_buffer_type* write_buffer )
+{
+    if (!write_buffer->data)
     {
-        printf( "\nWarning: Number of bytes written (%d) doesn't match expected value (%d).\n",
-                write_buffer.bytes_written, expected_length);
+        return false;
     }
     
-    if (explode_stats != NULL)
+    if (write_buffer->stop_length)
     {
-        explode_stats->dictionary_size = header.dictionary_size;
-        explode_stats->literal_mode = header.literal_mode;
-        explode_stats->dictionary_count = explode.dictionary_count;
-        explode_stats->literal_count = explode.literal_count;
-        explode_stats->max_length = explode.max_length;
-        explode_stats->min_length = explode.min_length;
-        explode_stats->max_offset = explode.max_offset;
-        explode_stats->min_offset = explode.min_offset;
+        return write_buffer->bytes_written >= write_buffer->stop_length;
     }
     
-    return write_buffer.bytes_written;
+    return write_buffer->history_length + write_buffer->bytes_written >=
+           write_buffer->data_length;
 }
 
+#define LITERAL_RUN_LENGTH  6
+    // Binary mode literals taken at once by the fast path (9 bits each,
+    // so 54 bits of the bit buffer).
+
+#define LITERAL_RUN_FLAGS   0x0000201008040201ULL
+    // Flag bits of those literals (bits 0, 9, 18, 27, 36 and 45).
 
+#define ASCII_TABLE_BITS    14
+    // Bits looked up at once for ASCII mode literals. Common characters
+    // take 5-8 bits with their flag, so two usually fit.
 
+#define ASCII_TABLE_MAX     2
+    // Most literals one lookup can give.
+
+// What the next ASCII_TABLE_BITS bits of the input hold: count whole
+// literal tokens (flag bits included) taking bits bits. A count of 0
+// means the next token has to be read the normal way.
+typedef struct {
+    uint8_t count;
+    uint8_t bits;
+    uint8_t literals[ASCII_TABLE_MAX];
+} ascii_table_entry_type;
+
+ascii_table_entry_type ascii_table[1 << ASCII_TABLE_BITS];
+
+// Bits each byte takes as an ASCII mode literal token, flag included.
+uint8_t ascii_literal_bits[256];
+
+pthread_once_t ascii_table_once = PTHREAD_ONCE_INIT;
+
+// Decode the ASCII literal code starting at bit position of bits (input
+// order, first bit lowest), as read_literal() would. Returns the code's
+// length, or 0 if it runs past bit_count bits.
+int decode_ascii_code( unsigned int bits,
+                       int position,
+                       int bit_count,
+                       unsigned char* literal )
+{
+    int literal_bits = 0;
+    
+    for (int length = 1; (length < 14) && (position + length <= bit_count);
+         length++)
+    {
+        int diff;
+        
+        literal_bits = (literal_bits << 1) |
+                       ((bits >> (position + length - 1)) & 0x1);
+        
+        if (length < 4)
+        {
+            continue;
+        }
+        
+        diff = literal_bits - literal_bits_to_index_table[length].base_bits;
+        
+        if ((diff >= 0) && (diff < literal_bits_to_index_table[length].count))
+        {
+            *literal = ascii_literal_table[
+                literal_bits_to_index_table[length].base_value - diff];
+            return length;
+        }
+    }
+    
+    return 0;
+}
 
+void ascii_table_build( void )
+{
+    for (unsigned int bits = 0; bits < (1 << ASCII_TABLE_BITS); bits++)
+    {
+        ascii_table_entry_type* entry = &ascii_table[bits];
+        int position = 0;
+        
+        entry->count = 0;
+        
+        // Literal tokens start with a zero flag bit.
+        while ((entry->count < ASCII_TABLE_MAX) &&
+               (position < ASCII_TABLE_BITS) &&
+               !((bits >> position) & 0x1))
+        {
+            int length = decode_ascii_code(bits, position + 1,
+                                           ASCII_TABLE_BITS,
+                                           &entry->literals[entry->count]);
+            
+            if (length == 0)
+            {
+                break;
+            }
+            
+            ascii_literal_bits[entry->literals[entry->count]] = 1 + length;
+            entry->count++;
+            position += 1 + length;
+        }
+        
+        entry->bits = position;
+    }
+}
+
+// Literal fast paths. Decodes several literal tokens at once when the next
+// bits allow it; returns false (having read nothing) when they don't.
+bool explode_literals( explode_state_type* state )
+{
+    read_bitstream_type* read_bitstream = &state->read_bitstream;
+    
+    // In binary mode a literal is a zero flag bit and the byte itself.
+    // Audio and bitmaps are mostly long runs of them, so when the next
+    // few tokens are all literals their bytes are taken in one step.
+    if ((state->header.literal_mode == 0) &&
+        (write_buffer_room(&state->write_buffer) >= LITERAL_RUN_LENGTH) &&
+        ((read_bitstream->bit_count >= 9 * LITERAL_RUN_LENGTH) ||
+         (read_bitstream_fill(read_bitstream) >= 9 * LITERAL_RUN_LENGTH)) &&
+        !(read_bitstream->bit_buffer & LITERAL_RUN_FLAGS))
+    {
+        unsigned char bytes[LITERAL_RUN_LENGTH];
+        uint64_t bits = read_bitstream->bit_buffer;
+        
+        for (int i = 0; i < LITERAL_RUN_LENGTH; i++)
+        {
+            bytes[i] = (unsigned char)(bits >> (9 * i + 1));
+        }
+        
+        read_bitstream->bit_buffer >>= 9 * LITERAL_RUN_LENGTH;
+        read_bitstream->bit_count -= 9 * LITERAL_RUN_LENGTH;
+        
+        write_bytes(&state->write_buffer, bytes, LITERAL_RUN_LENGTH);
+        
+        // Stats update
+        state->explode.literal_count += LITERAL_RUN_LENGTH;
+        for (int i = 0; i < LITERAL_RUN_LENGTH; i++)
+        {
+            state->explode.literal_histogram[bytes[i]]++;
+        }
+        return true;
+    }
+    
+    // In ASCII mode, look the next bits up to get up to two literals.
+    if ((state->header.literal_mode == 1) &&
+        (write_buffer_room(&state->write_buffer) >= ASCII_TABLE_MAX) &&
+        ((read_bitstream->bit_count >= ASCII_TABLE_BITS) ||
+         (read_bitstream_fill(read_bitstream) >= ASCII_TABLE_BITS)))
+    {
+        const ascii_table_entry_type* entry =
+            &ascii_table[read_bitstream->bit_buffer &
+                         ((1 << ASCII_TABLE_BITS) - 1)];
+        
+        if (entry->count)
+        {
+            read_bitstream->bit_buffer >>= entry->bits;
+            read_bitstream->bit_count -= entry->bits;
+            
+            write_bytes(&state->write_buffer, entry->literals, entry->count);
+            
+            // Stats update
+            state->explode.literal_count += entry->count;
+            for (int i = 0; i < entry->count; i++)
+            {
+                state->explode.literal_histogram[entry->literals[i]]++;
+            }
+            return true;
+        }
+    }
+    
+    // A single binary mode literal.
+    if ((state->header.literal_mode == 0) &&
+        (read_bitstream->bit_count >= 9) &&
+        !(read_bitstream->bit_buffer & 0x1))
+    {
+        unsigned char value = (unsigned char)(read_bitstream->bit_buffer >> 1);
+        
+        write_byte(&state->write_buffer, value);
+        
+        read_bitstream->bit_buffer >>= 9;
+        read_bitstream->bit_count -= 9;
+        
+        // Stats update
+        state->explode.literal_count++;
+        state->explode.literal_histogram[value]++;
+        return true;
+    }
+    
+    return false;
+}
+
+#define COPY_TABLE_BITS     16
+    // Bits looked up at once for copy tokens. The flag and length code
+    // always fit; the offset code often does too.
+
+#define COPY_NO_OFFSET      0xFF
+    // Offset code value for entries where it didn't fit.
+
+#define MAX_TOKEN_BITS      30
+    // Longest token: flag, 15 bits of length, 8 of offset code and 6 low
+    // offset bits.
+
+#define EXPLODE_MAX_COPY_LENGTH      518
+    // Longest copy. Output can run this far past a stop length.
+
+// What the next COPY_TABLE_BITS bits of the input hold when they start
+// with a copy: its length, and the high bits of its offset (the offset
+// code) unless they run past the table bits. bits is the number of bits
+// used by the flag, length and (if there) offset code. A length of 0
+// means the next token is a literal.
+typedef struct {
+    uint16_t length;
+    uint8_t bits;
+    uint8_t offset_code;
+} copy_table_entry_type;
+
+copy_table_entry_type copy_table[1 << COPY_TABLE_BITS];
+
+pthread_once_t copy_table_once = PTHREAD_ONCE_INIT;
+
+// Fill the copy table by running read_copy_length() and read_copy_offset()
+// over every bit pattern, so it always agrees with them.
+void copy_table_build( void )
+{
+    explode_state_type* state = malloc(sizeof(explode_state_type));
+    
+    if (!state)
+    {
+        // Leave the table empty; every token takes the normal path.
+        return;
+    }
+    
+    for (unsigned int bits = 0; bits < (1 << COPY_TABLE_BITS); bits++)
+    {
+        copy_table_entry_type* entry = &copy_table[bits];
+        
+        // Zero padding after the table bits.
+        unsigned char data[4] = { bits & 0xFF, bits >> 8, 0, 0 };
+        unsigned long length_end, offset_end;
+        int offset;
+        
+        entry->length = 0;
+        
+        if (!(bits & 0x1))
+        {
+            continue;
+        }
+        
+        read_bitstream_init_memory(&state->read_bitstream, data, 4, 1);
+        state->read_bitstream.quiet = true;
+        
+        entry->length = read_copy_length(state);
+        length_end = read_bitstream_position(&state->read_bitstream);
+        
+        entry->bits = length_end;
+        entry->offset_code = COPY_NO_OFFSET;
+        
+        if (entry->length == 519)
+        {
+            continue;
+        }
+        
+        // Low bits are read too (2 of them, as for length 2) but only the
+        // code before them is kept.
+        state->explode.length = 2;
+        offset = read_copy_offset(state);
+        offset_end = read_bitstream_position(&state->read_bitstream) - 2;
+        
+        if (offset_end <= COPY_TABLE_BITS)
+        {
+            entry->bits = offset_end;
+            entry->offset_code = offset >> 2;
+        }
+    }
+    
+    free(state);
+}
+
+// Copy token fast path. Reads the next token's length and offset with one
+// table lookup if it is a copy (or the end marker) and all of it is in the
+// bit buffer; returns false (having read nothing) otherwise.
+bool read_copy_from_table( explode_state_type* state )
+{
+    read_bitstream_type* read_bitstream = &state->read_bitstream;
+    const copy_table_entry_type* entry;
+    
+    if ((read_bitstream->bit_count < MAX_TOKEN_BITS) &&
+        (read_bitstream_fill(read_bitstream) < MAX_TOKEN_BITS))
+    {
+        return false;
+    }
+    
+    entry = &copy_table[read_bitstream->bit_buffer &
+                        ((1 << COPY_TABLE_BITS) - 1)];
+    
+    if (entry->length == 0)
+    {
+        return false;
+    }
+    
+    read_bitstream->bit_buffer >>= entry->bits;
+    read_bitstream->bit_count -= entry->bits;
+    
+    state->explode.length = entry->length;
+    
+    // Length of 519 indicates end of file.
+    if (entry->length == 519)
+    {
+        state->explode.end_marker = true;
+        return true;
+    }
+    
+    if (entry->offset_code == COPY_NO_OFFSET)
+    {
+        state->explode.offset = read_copy_offset(state);
+    }
+    else
+    {
+        // Low bits: 2 for length 2, otherwise as many as the dictionary
+        // size value.
+        int low_bits = (entry->length == 2) ?
+                       2 : state->header.dictionary_size;
+        
+        state->explode.offset =
+            (entry->offset_code << low_bits) |
+            (int)(read_bitstream->bit_buffer & ((1 << low_bits) - 1));
+        
+        read_bitstream->bit_buffer >>= low_bits;
+        read_bitstream->bit_count -= low_bits;
+    }
+    
+    return true;
+}
+
+// Build the lookup tables used by the fast paths, once.
+void explode_tables_init( void )
+{
+    pthread_once(&ascii_table_once, ascii_table_build);
+    pthread_once(&copy_table_once, copy_table_build);
+    pthread_once(&explode_timer_overhead_once,
+                 explode_timer_overhead_measure);
+}
+
+// Explode the next token (or, on the literal fast paths, a few).
+void explode_token( explode_state_type* state )
+{
+    read_bitstream_type* read_bitstream = &state->read_bitstream;
+    
+    if (explode_literals(state))
+    {
+        // Done by a fast path.
+    }
+    else if (read_copy_from_table(state))
+    {
+        if (!state->explode.end_marker)
+        {
+            explode_copy(state);
+        }
+    }
+    // Next bit indicates a literal or dictionary lookup.
+    else if (read_next_bit(read_bitstream) == 0)
+    {
+        // -- Literal --
+        unsigned char value;
+        
+        value = read_literal(state);
+        write_byte(&state->write_buffer, value );
+        
+        // Stats update
+        state->explode.literal_count++;
+        state->explode.literal_histogram[value]++;
+    }
+    else
+    {
+        // -- Dictionary Look Up --
+        
+        // Dictionary look up.  Find length and offset.
+        state->explode.length = read_copy_length(state);
+        
+        // Length of 519 indicates end of file.
+        if (state->explode.length == 519)
+        {
+            state->explode.end_marker = true;
+        }
+        else // otherwise,
+        {                
+            // Find offset.
+            state->explode.offset = read_copy_offset(state);
+           
+            explode_copy(state);
+        }
+    }
+}
+
+#define TOKEN_BATCH         16
+    // Tokens exploded between checks for the end of the input and output.
+
+#define TOKEN_BATCH_INPUT   ((TOKEN_BATCH + 1) * 8)
+    // Input bytes needed for a batch. Each token takes no more than the
+    // bit buffer holds after a refill (the longest, a run of binary
+    // literals, takes 54 bits), and each refill reads up to 8 bytes.
+
+// Explode the next token when the bit buffer has been refilled and there
+// is room for its output, so the fast paths can skip checking for either.
+void explode_token_in_batch( explode_state_type* state )
+{
+    read_bitstream_type* read_bitstream = &state->read_bitstream;
+    uint64_t bits = read_bitstream->bit_buffer;
+    const copy_table_entry_type* entry;
+    
+    if (state->header.literal_mode == 0)
+    {
+        if (!(bits & LITERAL_RUN_FLAGS))
+        {
+            unsigned char bytes[LITERAL_RUN_LENGTH];
+            
+            for (int i = 0; i < LITERAL_RUN_LENGTH; i++)
+            {
+                bytes[i] = (unsigned char)(bits >> (9 * i + 1));
+            }
+            
+            read_bitstream->bit_buffer >>= 9 * LITERAL_RUN_LENGTH;
+            read_bitstream->bit_count -= 9 * LITERAL_RUN_LENGTH;
+            
+            write_bytes(&state->write_buffer, bytes, LITERAL_RUN_LENGTH);
+            state->explode.literal_count += LITERAL_RUN_LENGTH;
+            for (int i = 0; i < LITERAL_RUN_LENGTH; i++)
+            {
+                state->explode.literal_histogram[bytes[i]]++;
+            }
+            return;
+        }
+        
+        if (!(bits & 0x1))
+        {
+            write_byte(&state->write_buffer, (unsigned char)(bits >> 1));
+            
+            read_bitstream->bit_buffer >>= 9;
+            read_bitstream->bit_count -= 9;
+            
+            state->explode.literal_count++;
+            state->explode.literal_histogram[(unsigned char)(bits >> 1)]++;
+            return;
+        }
+    }
+    else if (!(bits & 0x1))
+    {
+        const ascii_table_entry_type* ascii_entry =
+            &ascii_table[bits & ((1 << ASCII_TABLE_BITS) - 1)];
+        
+        if (ascii_entry->count)
+        {
+            read_bitstream->bit_buffer >>= ascii_entry->bits;
+            read_bitstream->bit_count -= ascii_entry->bits;
+            
+            write_bytes(&state->write_buffer, ascii_entry->literals,
+                        ascii_entry->count);
+            state->explode.literal_count += ascii_entry->count;
+            for (int i = 0; i < ascii_entry->count; i++)
+            {
+                state->explode.literal_histogram[ascii_entry->literals[i]]++;
+            }
+            return;
+        }
+    }
+    
+    entry = &copy_table[bits & ((1 << COPY_TABLE_BITS) - 1)];
+    
+    if ((entry->length == 0) || (entry->length == 519) ||
+        (entry->offset_code == COPY_NO_OFFSET))
+    {
+        // Long literal codes, offsets past the table, and the end marker.
+        explode_token(state);
+        return;
+    }
+    else
+    {
+        int low_bits = (entry->length == 2) ?
+                       2 : state->header.dictionary_size;
+        
+        bits >>= entry->bits;
+        
+        state->explode.length = entry->length;
+        state->explode.offset = (entry->offset_code << low_bits) |
+                                (int)(bits & ((1 << low_bits) - 1));
+        
+        read_bitstream->bit_buffer = bits >> low_bits;
+        read_bitstream->bit_count -= entry->bits + low_bits;
+        
+        explode_copy(state);
+    }
+}
+
+// Estimated time spent copying from the dictionary, in ns.
+uint64_t explode_copy_time( explode_state_type* state )
+{
+    if (state->explode.copy_samples == 0)
+    {
+        return 0;
+    }
+    
+    return (uint64_t)((double) state->explode.copy_sample_ns *
+                      state->explode.dictionary_count /
+                      state->explode.copy_samples);
+}
+
+// Output bytes that can be written before memory output is full (or
+// reaches its stop length). No limit for files.
+unsigned long explode_output_room( write_buffer_type* write_buffer )
+{
+    unsigned long room = write_buffer_room(write_buffer);
+    
+    if (write_buffer->data && write_buffer->stop_length &&
+        (write_buffer->stop_length - write_buffer->bytes_written < room))
+    {
+        room = write_buffer->stop_length - write_buffer->bytes_written;
+    }
+    
+    return room;
+}
+
+// Explode tokens until the end marker, an error, or (for memory output)
+// the output is full.
+void explode_run( explode_state_type* state )
+{
+    read_bitstream_type* read_bitstream = &state->read_bitstream;
+    uint64_t start, elapsed, other_ns;
+    
+    explode_tables_init();
+    
+    start = explode_time_ns();
+    other_ns = read_bitstream->read_ns + read_bitstream->switch_ns +
+               state->write_buffer.write_ns;
+    
+    // Read until EOF is detected.
+    do
+    {
+        // Away from the end of the input and output, explode a batch of
+        // tokens with no checks for either running out. The bit buffer is
+        // refilled before each token, so none of them can need more input
+        // than it holds. Nearer the end, go token by token, and the reads
+        // check as they go.
+        if ((read_bitstream_margin(read_bitstream) >= TOKEN_BATCH_INPUT) &&
+            (explode_output_room(&state->write_buffer) >=
+             TOKEN_BATCH * EXPLODE_MAX_COPY_LENGTH))
+        {
+            for (int i = 0; (i < TOKEN_BATCH) && !state->explode.end_marker;
+                 i++)
+            {
+                read_bitstream_refill(read_bitstream);
+                explode_token_in_batch(state);
+            }
+        }
+        else
+        {
+            explode_token(state);
+        }
+    } while ( !state->explode.end_marker &&
+              !state->read_bitstream.error_flag &&
+              !state->write_buffer.error_flag &&
+              !explode_output_full(&state->write_buffer) );
+    
+    // Decoding is what is left once input, output, switching files and
+    // copies are taken out.
+    elapsed = explode_time_ns() - start;
+    other_ns = read_bitstream->read_ns + read_bitstream->switch_ns +
+               state->write_buffer.write_ns - other_ns +
+               explode_copy_time(state);
+    
+    state->explode.decode_ns += (elapsed > other_ns) ? elapsed - other_ns : 0;
+}
+
+// Fill in the histograms and token counts, and work out from them where
+// the bits went: every code has a fixed length, given the header.
+void explode_count_bits( explode_state_type* state,
+                         explode_stats_type* explode_stats )
+{
+    const explode_type* explode = &state->explode;
+    uint64_t* bits = explode_stats->bits;
+    unsigned int code = 0;
+    
+    memset(bits, 0, sizeof(explode_stats->bits));
+    
+    for (int length = 0; length < 520; length++)
+    {
+        explode_stats->length_histogram[length] =
+            explode->length_histogram[length];
+    }
+    explode_stats->length_histogram[519] = explode->end_marker ? 1 : 0;
+    
+    for (int length = 2; length < 520; length++)
+    {
+        unsigned int count = explode_stats->length_histogram[length];
+        
+        while ((code < 15) &&
+               (length >= length_bits_table[code + 1].base_length))
+        {
+            code++;
+        }
+        
+        bits[EXPLODE_BITS_LENGTH_CODES] +=
+            (uint64_t) count * length_bits_table[code].code_bits;
+        bits[EXPLODE_BITS_LENGTH_EXTRA] +=
+            (uint64_t) count * length_bits_table[code].extra_bits;
+    }
+    
+    // Offsets are a code for the high bits, then the low bits: two for
+    // length 2 copies, otherwise as many as the dictionary size.
+    for (int short_copy = 0; short_copy < 2; short_copy++)
+    {
+        int low_bits = short_copy ? 2 : state->header.dictionary_size;
+        
+        for (int offset = 0; offset < EXPLODE_WINDOW_SIZE; offset++)
+        {
+            unsigned int count = explode->offset_histogram[short_copy][offset];
+            unsigned int high = offset >> low_bits;
+            int length = 2;
+            
+            if (!count)
+            {
+                continue;
+            }
+            
+            // Codes of each length cover the count high values counting
+            // down from base_value.
+            while ((length < 8) &&
+                   ((high > offset_bits_to_value_table[length].base_value) ||
+                    (high + offset_bits_to_value_table[length].count <=
+                     offset_bits_to_value_table[length].base_value)))
+            {
+                length++;
+            }
+            
+            bits[EXPLODE_BITS_OFFSETS] += (uint64_t) count *
+                                          (length + low_bits);
+        }
+    }
+    
+    for (int offset = 0; offset < EXPLODE_WINDOW_SIZE; offset++)
+    {
+        explode_stats->offset_histogram[offset] =
+            explode->offset_histogram[0][offset] +
+            explode->offset_histogram[1][offset];
+    }
+    
+    // Binary literals are the byte itself; ASCII ones a code of its own.
+    for (int value = 0; value < 256; value++)
+    {
+        unsigned int count = explode->literal_histogram[value];
+        
+        explode_stats->literal_histogram[value] = count;
+        bits[EXPLODE_BITS_LITERALS] += (uint64_t) count *
+            (state->header.literal_mode ? ascii_literal_bits[value] - 1 : 8);
+    }
+    
+    explode_stats->token_count[EXPLODE_TOKEN_LITERAL] = explode->literal_count;
+    explode_stats->token_count[EXPLODE_TOKEN_COPY] = explode->dictionary_count;
+    explode_stats->token_count[EXPLODE_TOKEN_END] = explode->end_marker ? 1 : 0;
+    
+    for (int kind = 0; kind < EXPLODE_TOKEN_COUNT; kind++)
+    {
+        bits[EXPLODE_BITS_FLAGS] += explode_stats->token_count[kind];
+    }
+}
+
+void explode_get_stats( explode_state_type* state,
+                        explode_stats_type* explode_stats )
+{
+    explode_stats->dictionary_size = state->header.dictionary_size;
+    explode_stats->literal_mode = state->header.literal_mode;
+    explode_stats->dictionary_count = state->explode.dictionary_count;
+    explode_stats->literal_count = state->explode.literal_count;
+    explode_stats->max_length = state->explode.max_length;
+    explode_stats->min_length = state->explode.min_length;
+    explode_stats->max_offset = state->explode.max_offset;
+    explode_stats->min_offset = state->explode.min_offset;
+    
+    explode_count_bits(state, explode_stats);
+    
+    memset(explode_stats->phase_ns, 0, sizeof(explode_stats->phase_ns));
+    explode_stats->phase_ns[EXPLODE_PHASE_READ] =
+        state->read_bitstream.read_ns;
+    explode_stats->phase_ns[EXPLODE_PHASE_DECODE] = state->explode.decode_ns;
+    explode_stats->phase_ns[EXPLODE_PHASE_COPY] = explode_copy_time(state);
+    explode_stats->phase_ns[EXPLODE_PHASE_WRITE] =
+        state->write_buffer.write_ns;
+    explode_stats->phase_ns[EXPLODE_PHASE_SWITCH] =
+        state->read_bitstream.switch_ns;
+}
+
+// Add the statistics of a later part of the same file.
+void explode_add_stats( explode_stats_type* explode_stats,
+                        const explode_stats_type* part_stats )
+{
+    explode_stats->literal_count += part_stats->literal_count;
+    explode_stats->dictionary_count += part_stats->dictionary_count;
+    if (part_stats->max_offset > explode_stats->max_offset)
+        explode_stats->max_offset = part_stats->max_offset;
+    if (part_stats->min_offset < explode_stats->min_offset)
+        explode_stats->min_offset = part_stats->min_offset;
+    if (part_stats->max_length > explode_stats->max_length)
+        explode_stats->max_length = part_stats->max_length;
+    if (part_stats->min_length < explode_stats->min_length)
+        explode_stats->min_length = part_stats->min_length;
+    
+    for (int i = 0; i < 520; i++)
+    {
+        explode_stats->length_histogram[i] += part_stats->length_histogram[i];
+    }
+    for (int i = 0; i < EXPLODE_WINDOW_SIZE; i++)
+    {
+        explode_stats->offset_histogram[i] += part_stats->offset_histogram[i];
+    }
+    for (int i = 0; i < 256; i++)
+    {
+        explode_stats->literal_histogram[i] +=
+            part_stats->literal_histogram[i];
+    }
+    for (int i = 0; i < EXPLODE_TOKEN_COUNT; i++)
+    {
+        explode_stats->token_count[i] += part_stats->token_count[i];
+    }
+    for (int i = 0; i < EXPLODE_BITS_COUNT; i++)
+    {
+        explode_stats->bits[i] += part_stats->bits[i];
+    }
+    
+    for (int i = 0; i < EXPLODE_PHASE_COUNT; i++)
+    {
+        explode_stats->phase_ns[i] += part_stats->phase_ns[i];
+    }
+}
+
+// Explode to a file once the input and header are set up.
+int explode_to_file( explode_state_type* state,
+                     FILE* out_fp,
+                     int expected_length,
+                     explode_stats_type* explode_stats )
+{
+    // Reset write parameters. [ Consider making this a function. ]
+    state->write_buffer.bytes_written = 0;
+    state->write_buffer.error_flag = 0;
+    state->write_buffer.buffer_position = 0;
+    state->write_buffer.file_pointer=out_fp;
+    state->write_buffer.data = NULL;
+    
+    explode_reset(state);
+    
+    if (!explode_check_header(&state->header))
+    {
+        return -1;
+    }
+    
+    explode_run(state);
+    
+    write_to_file(&state->write_buffer);
+    
+    // If expected length was passed in, check it.
+    if ((expected_length) &&
+        (state->write_buffer.bytes_written != expected_length))
+    {
+        printf( "\nWarning: Number of bytes written (%d) doesn't match expected value (%d).\n",
+                state->write_buffer.bytes_written, expected_length);
+    }
+    
+    if (explode_stats != NULL)
+    {
+        explode_get_stats(state, explode_stats);
+    }
+    
+    return state->write_buffer.bytes_written;
+}
+
+/* Extract a file from an archive file and explode it.
+   in_fp:           Pointer to imploded data start in archive file.
+   out_filename:    Output filename [consider making this fp_out].
+   expected_length: Expected length of file (0 if not provided).
+   eof_reached():   Callback that indicates archive EOF is reached.
+                    Callback should return new file pointer with 
+                    the continued data for the imploded file.
+ */
+int extract_and_explode( FILE* in_fp,
+                         FILE* out_fp,
+                         int expected_length,
+                         explode_stats_type* explode_stats,
+                         FILE* (*eof_reached)(void))
+{
+    explode_state_type* state = &explode_state;
+    uint64_t header_ns;
+    int result;
+    
+    // Set up read parameters. [Consider making this a function.]
+    state->read_bitstream.file_pointer = in_fp;
+    state->read_bitstream.eof_reached = eof_reached;
+    state->read_bitstream.data = state->read_bitstream.block;
+    state->read_bitstream.data_length = 0;
+    state->read_bitstream.data_position = 0;
+    state->read_bitstream.quiet = false;
+    state->read_bitstream.bit_buffer = 0;
+    state->read_bitstream.bit_count = 0;
+    state->read_bitstream.error_flag = 0;
+    state->read_bitstream.total_bytes = 0;
+    
+    // Read two header bytes.
+    header_ns = explode_time_ns();
+    
+    if ( fread( (uint8_t*) &state->header, sizeof (uint8_t), 2, in_fp ) != 2 ) {
+        printf("Error: Unable to read header info.\n");
+        return -1;
+    }
+    
+    header_ns = explode_time_ns() - header_ns;
+    
+    result = explode_to_file(state, out_fp, expected_length, explode_stats);
+    
+    if ((result >= 0) && (explode_stats != NULL))
+    {
+        explode_stats->phase_ns[EXPLODE_PHASE_HEADER] = header_ns;
+    }
+    
+    return result;
+}
+
+int extract_and_explode_memory( const unsigned char* in_data,
+                                unsigned long in_length,
+                                FILE* out_fp,
+                                int expected_length,
+                                explode_stats_type* explode_stats )
+{
+    explode_state_type* state = &explode_state;
+    
+    if (in_length < 2)
+    {
+        printf("Error: Unable to read header info.\n");
+        return -1;
+    }
+    
+    read_bitstream_init_memory(&state->read_bitstream, in_data, in_length, 16);
+    state->header.literal_mode = in_data[0];
+    state->header.dictionary_size = in_data[1];
+    
+    return explode_to_file(state, out_fp, expected_length, explode_stats);
+}
+
+// Explode from memory to memory using the given state. If stop_length
+// isn't 0, decoding ends after the token that brings the output to at
+// least stop_length bytes; out_length must leave room for the rest of that
+// token.
+long explode_memory_state( explode_state_type* state,
+                           const unsigned char* in_data,
+                           unsigned long in_length,
+                           unsigned long bit_offset,
+                           unsigned char* out_data,
+                           unsigned long history_length,
+                           unsigned long out_length,
+                           unsigned long stop_length,
+                           explode_stats_type* explode_stats )
+{
+    if (in_length < 2)
+    {
+        printf("Error: Unable to read header info.\n");
+        return -1;
+    }
+    
+    state->header.literal_mode = in_data[0];
+    state->header.dictionary_size = in_data[1];
+    
+    if (!explode_check_header(&state->header))
+    {
+        return -1;
+    }
+    
+    if (bit_offset < 16)
+    {
+        bit_offset = 16;
+    }
+    
+    // Block indexes and checkpoints come from files, so may be corrupt.
+    if (bit_offset / 8 > in_length)
+    {
+        return -1;
+    }
+    
+    read_bitstream_init_memory(&state->read_bitstream, in_data, in_length,
+                               bit_offset);
+    
+    state->write_buffer.file_pointer = NULL;
+    state->write_buffer.data = out_data;
+    state->write_buffer.history_length = history_length;
+    state->write_buffer.data_length = history_length + out_length;
+    state->write_buffer.stop_length = stop_length;
+    state->write_buffer.bytes_written = 0;
+    state->write_buffer.buffer_position = 0;
+    state->write_buffer.error_flag = 0;
+    
+    explode_reset(state);
+    
+    if (out_length)
+    {
+        explode_run(state);
+    }
+    
+    if (explode_stats != NULL)
+    {
+        explode_get_stats(state, explode_stats);
+    }
+    
+    if (state->read_bitstream.error_flag || state->write_buffer.error_flag)
+    {
+        return -1;
+    }
+    
+    return state->write_buffer.bytes_written;
+}
+
+long explode_memory( const unsigned char* in_data,
+                     unsigned long in_length,
+                     unsigned long bit_offset,
+                     unsigned char* out_data,
+                     unsigned long history_length,
+                     unsigned long out_length,
+                     explode_stats_type* explode_stats )
+{
+    explode_state_type* state;
+    long result;
+    
+    state = malloc(sizeof(explode_state_type));
+    
+    if (!state)
+    {
+        printf("Error: out of memory.\n");
+        return -1;
+    }
+    
+    result = explode_memory_state(state, in_data, in_length, bit_offset,
+                                  out_data, history_length, out_length, 0,
+                                  explode_stats);
+    
+    free(state);
+    
+    return result;
+}
+
+// Blocks of one explode_blocks operation, shared by its threads.
+typedef struct
+{
+    const unsigned char* in_data;
+    unsigned long in_length;
+    const unsigned long* bit_offset;
+    const unsigned long* output_offset;
+    unsigned long block_count;
+    unsigned char* out_data;
+    unsigned long out_length;
+    
+    explode_stats_type* block_stats;
+    long* block_result;
+    
+    unsigned long first;       // Blocks first, first+step, first+2*step...
+    unsigned long step;
+} explode_blocks_job_type;
+
+void* explode_blocks_thread( void* job_ptr )
+{
+    explode_blocks_job_type* job = job_ptr;
+    uint64_t thread_start = explode_time_ns();
+    unsigned long bytes_in = 0;
+    unsigned long bytes_out = 0;
+    
+    for (unsigned long i = job->first; i < job->block_count; i += job->step)
+    {
+        unsigned long start = job->output_offset[i];
+        unsigned long end = (i + 1 < job->block_count) ?
+                            job->output_offset[i + 1] : job->out_length;
+        
+        if ((start > end) || (end > job->out_length))
+        {
+            job->block_result[i] = -1;
+            continue;
+        }
+        
+        // No history: lookups may not reach into another block.
+        job->block_result[i] = explode_memory(job->in_data,
+                                              job->in_length,
+                                              job->bit_offset[i],
+                                              &job->out_data[start],
+                                              0,
+                                              end - start,
+                                              &job->block_stats[i]);
+        
+        if (job->block_result[i] != end - start)
+        {
+            job->block_result[i] = -1;
+        }
+        
+        // Compressed bytes run up to the next block's bit offset.
+        bytes_in += (((i + 1 < job->block_count) ?
+                      job->bit_offset[i + 1] : job->in_length * 8) -
+                     job->bit_offset[i]) / 8;
+        bytes_out += end - start;
+    }
+    
+    explode_trace("explode blocks", "worker", thread_start, bytes_in,
+                  bytes_out);
+    
+    return NULL;
+}
+
+#define MAX_EXPLODE_THREADS  64
+
+long explode_blocks( const unsigned char* in_data,
+                     unsigned long in_length,
+                     const unsigned long* bit_offset,
+                     const unsigned long* output_offset,
+                     unsigned long block_count,
+                     unsigned char* out_data,
+                     unsigned long out_length,
+                     unsigned int thread_count,
+                     explode_stats_type* explode_stats )
+{
+    explode_blocks_job_type jobs[MAX_EXPLODE_THREADS];
+    pthread_t threads[MAX_EXPLODE_THREADS];
+    bool thread_started[MAX_EXPLODE_THREADS] = {0};
+    explode_stats_type* block_stats;
+    long* block_result;
+    long result = (long) out_length;
+    unsigned long i;
+    
+    // Statistics count ASCII literal bits from the tables.
+    explode_tables_init();
+    
+    if ((block_count == 0) || (output_offset[0] != 0))
+    {
+        printf("Error: Bad block index.\n");
+        return -1;
+    }
+    
+    // Blocks must go forward through the input and output, and start
+    // inside both.
+    for (i = 0; i < block_count; i++)
+    {
+        if ((bit_offset[i] >= in_length * 8) ||
+            (output_offset[i] > out_length) ||
+            ((i > 0) && ((bit_offset[i] <= bit_offset[i - 1]) ||
+                         (output_offset[i] <= output_offset[i - 1]))))
+        {
+            printf("Error: Bad block index.\n");
+            return -1;
+        }
+    }
+    
+    block_stats = calloc(block_count, sizeof(explode_stats_type));
+    block_result = calloc(block_count, sizeof(long));
+    
+    if (!block_stats || !block_result)
+    {
+        printf("Error: out of memory.\n");
+        free(block_stats);
+        free(block_result);
+        return -1;
+    }
+    
+    if (thread_count < 1)
+    {
+        thread_count = 1;
+    }
+    if (thread_count > MAX_EXPLODE_THREADS)
+    {
+        thread_count = MAX_EXPLODE_THREADS;
+    }
+    if (thread_count > block_count)
+    {
+        thread_count = (unsigned int) block_count;
+    }
+    
+    for (i = 0; i < thread_count; i++)
+    {
+        jobs[i].in_data = in_data;
+        jobs[i].in_length = in_length;
+        jobs[i].bit_offset = bit_offset;
+        jobs[i].output_offset = output_offset;
+        jobs[i].block_count = block_count;
+        jobs[i].out_data = out_data;
+        jobs[i].out_length = out_length;
+        jobs[i].block_stats = block_stats;
+        jobs[i].block_result = block_result;
+        jobs[i].first = i;
+        jobs[i].step = thread_count;
+        
+        if (i > 0)
+        {
+            thread_started[i] = (pthread_create(&threads[i], NULL,
+                                                explode_blocks_thread,
+                                                &jobs[i]) == 0);
+        }
+    }
+    
+    for (i = 0; i < thread_count; i++)
+    {
+        if (!thread_started[i])
+        {
+            explode_blocks_thread(&jobs[i]);
+        }
+    }
+    
+    for (i = 1; i < thread_count; i++)
+    {
+        if (thread_started[i])
+        {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    
+    // Combine the statistics of all blocks.
+    if (explode_stats != NULL)
+    {
+        *explode_stats = block_stats[0];
+    }
+    
+    for (i = 0; i < block_count; i++)
+    {
+        if (block_result[i] < 0)
+        {
+            result = -1;
+        }
+        
+        if ((explode_stats != NULL) && (i > 0))
+        {
+            explode_add_stats(explode_stats, &block_stats[i]);
+        }
+    }
+    
+    free(block_stats);
+    free(block_result);
+    
+    return result;
+}
+
+// -- SPECULATIVE PARALLEL EXPLODE --
+
+// A member is split into parts that are exploded at the same time. Each part
+// after the first starts at a guessed bit offset, which is moved forward to
+// a point where decoding is certain to be in step with the real token
+// boundaries (sync point). Output bytes that come from before a part's sync
+// point aren't known yet, so copies of them are kept as placeholder symbols
+// and filled in once the earlier parts are done.
+
+#define EXPLODE_SYNC_CANDIDATES  30
+    // A token is at most 30 bits, so one of this many consecutive bit
+    // offsets is a real token start.
+
+#define EXPLODE_SYNC_TOKENS      4096
+    // Tokens decoded from the first candidate while looking for a sync
+    // point.
+
+#define EXPLODE_MIN_PART_SIZE    0x10000
+    // Smallest part (in compressed bytes) worth a thread of its own.
+
+// Output symbols of a part. Values below 256 are bytes; 256 + n stands for
+// byte n of the 4K window before the part's first output byte.
+typedef struct
+{
+    uint16_t* symbols;
+    unsigned long length;
+    unsigned long size;
+} symbol_buffer_type;
+
+bool append_symbol( symbol_buffer_type* buffer, uint16_t symbol )
+{
+    if (buffer->length == buffer->size)
+    {
+        unsigned long new_size = buffer->size ? buffer->size * 2 : 0x10000;
+        uint16_t* new_symbols = realloc(buffer->symbols,
+                                        new_size * sizeof(uint16_t));
+        
+        if (!new_symbols)
+        {
+            return false;
+        }
+        
+        buffer->symbols = new_symbols;
+        buffer->size = new_size;
+    }
+    
+    buffer->symbols[buffer->length++] = symbol;
+    return true;
+}
+
+// Set up a quiet state for reading tokens from bit_offset.
+void explode_speculative_init( explode_state_type* state,
+                               const unsigned char* in_data,
+                               unsigned long in_length,
+                               unsigned long bit_offset )
+{
+    state->header.literal_mode = in_data[0];
+    state->header.dictionary_size = in_data[1];
+    read_bitstream_init_memory(&state->read_bitstream, in_data, in_length,
+                               bit_offset);
+    state->read_bitstream.quiet = true;
+    explode_reset(state);
+}
+
+// Read one token without producing output. Returns false at the end marker
+// or on a read error.
+bool skip_token( explode_state_type* state )
+{
+    if (read_next_bit(&state->read_bitstream) == 0)
+    {
+        (void) read_literal(state);
+    }
+    else
+    {
+        state->explode.length = read_copy_length(state);
+        
+        if (state->explode.length == 519)
+        {
+            return false;
+        }
+        
+        (void) read_copy_offset(state);
+    }
+    
+    return !state->read_bitstream.error_flag;
+}
+
+// Find a sync point at or after guess. Decoding from each of the candidate
+// offsets guess, guess+1, ... must reach the same token boundary; as one of
+// them is a real token start, so is that boundary. Returns 0 if there
+// isn't one within reach.
+unsigned long find_sync_point( explode_state_type* state,
+                               const unsigned char* in_data,
+                               unsigned long in_length,
+                               unsigned long guess )
+{
+    unsigned long boundaries[EXPLODE_SYNC_TOKENS];
+    int boundary_count = 0;
+    int sync_index = 0;
+    
+    // Token boundaries from the first candidate.
+    explode_speculative_init(state, in_data, in_length, guess);
+    
+    while (boundary_count < EXPLODE_SYNC_TOKENS)
+    {
+        if (!skip_token(state))
+        {
+            break;
+        }
+        boundaries[boundary_count++] =
+            read_bitstream_position(&state->read_bitstream);
+    }
+    
+    if (boundary_count == 0)
+    {
+        return 0;
+    }
+    
+    // Every other candidate has to run into one of those boundaries. The
+    // sync point is the last boundary any of them needed to get in step.
+    for (unsigned long candidate = guess + 1;
+         candidate < guess + EXPLODE_SYNC_CANDIDATES; candidate++)
+    {
+        unsigned long position = candidate;
+        int index = 0;
+        
+        explode_speculative_init(state, in_data, in_length, candidate);
+        
+        while (1)
+        {
+            // Catch up with the first candidate's boundaries.
+            while ((index < boundary_count) && (boundaries[index] < position))
+            {
+                index++;
+            }
+            
+            if (index == boundary_count)
+            {
+                return 0;
+            }
+            
+            if (boundaries[index] == position)
+            {
+                break;
+            }
+            
+            // Ran into the end without getting in step. Can't be the real
+            // stream, so ignore this candidate.
+            if (!skip_token(state))
+            {
+                index = -1;
+                break;
+            }
+            
+            position = read_bitstream_position(&state->read_bitstream);
+        }
+        
+        if (index > sync_index)
+        {
+            sync_index = index;
+        }
+    }
+    
+    return boundaries[sync_index];
+}
+
+// One part of a speculative explode.
+typedef struct
+{
+    const unsigned char* in_data;
+    unsigned long in_length;
+    
+    unsigned long guess;       // Guessed start
+    unsigned long start;       // Sync point (bits)
+    unsigned long end;         // Next part's sync point, 0 for the last part
+    
+    symbol_buffer_type output;
+    explode_stats_type stats;
+    bool error;
+} explode_part_type;
+
+void* find_sync_thread( void* part_ptr )
+{
+    explode_part_type* part = part_ptr;
+    explode_state_type* state = malloc(sizeof(explode_state_type));
+    uint64_t thread_start = explode_time_ns();
+    
+    if (!state)
+    {
+        part->error = true;
+        return NULL;
+    }
+    
+    part->start = find_sync_point(state, part->in_data, part->in_length,
+                                  part->guess);
+    part->error = (part->start == 0);
+    
+    explode_trace("find sync point", "worker", thread_start, 0, 0);
+    
+    free(state);
+    return NULL;
+}
+
+// Explode a part into symbols. It has to end exactly on the next part's
+// sync point, or at the end marker if it is the last part.
+void* explode_part_thread( void* part_ptr )
+{
+    explode_part_type* part = part_ptr;
+    explode_state_type* state = malloc(sizeof(explode_state_type));
+    symbol_buffer_type* output = &part->output;
+    bool end_found = false;
+    uint64_t thread_start = explode_time_ns();
+    
+    if (!state)
+    {
+        part->error = true;
+        return NULL;
+    }
+    
+    explode_speculative_init(state, part->in_data, part->in_length,
+                             part->start);
+    
+    while (!part->error &&
+           ((part->end == 0) ||
+            (read_bitstream_position(&state->read_bitstream) < part->end)))
+    {
+        if (read_next_bit(&state->read_bitstream) == 0)
+        {
+            unsigned char value = read_literal(state);
+            
+            part->error |= !append_symbol(output, value);
+            state->explode.literal_count++;
+            state->explode.literal_histogram[value]++;
+        }
+        else
+        {
+            state->explode.length = read_copy_length(state);
+            
+            if (state->explode.length == 519)
+            {
+                end_found = true;
+                state->explode.end_marker = true;
+                break;
+            }
+            
+            state->explode.offset = read_copy_offset(state);
+            
+            // Copy symbols; anything from before the part's start becomes a
+            // placeholder for that window byte.
+            for (int i = 0; i < state->explode.length; i++)
+            {
+                unsigned long distance = state->explode.offset + 1;
+                uint16_t symbol;
+                
+                if (distance <= output->length)
+                {
+                    symbol = output->symbols[output->length - distance];
+                }
+                else
+                {
+                    symbol = 256 + EXPLODE_WINDOW_SIZE -
+                             (distance - output->length);
+                }
+                
+                if (!append_symbol(output, symbol))
+                {
+                    part->error = true;
+                    break;
+                }
+            }
+            
+            state->explode.dictionary_count++;
+            state->explode.length_histogram[state->explode.length]++;
+            state->explode.offset_histogram[state->explode.length == 2]
+                                           [state->explode.offset]++;
+            
+            if (state->explode.length > state->explode.max_length)
+                state->explode.max_length = state->explode.length;
+            if (state->explode.length < state->explode.min_length)
+                state->explode.min_length = state->explode.length;
+            if (state->explode.offset > state->explode.max_offset)
+                state->explode.max_offset = state->explode.offset;
+            if (state->explode.offset < state->explode.min_offset)
+                state->explode.min_offset = state->explode.offset;
+        }
+        
+        part->error |= state->read_bitstream.error_flag;
+    }
+    
+    // Check this part finishes where the next one was found to start.
+    if (part->end == 0)
+    {
+        part->error |= !end_found;
+    }
+    else
+    {
+        part->error |= end_found ||
+            (read_bitstream_position(&state->read_bitstream) != part->end);
+    }
+    
+    explode_get_stats(state, &part->stats);
+    
+    explode_trace("explode part", "worker", thread_start,
+                  (read_bitstream_position(&state->read_bitstream) -
+                   part->start) / 8,
+                  output->length);
+    
+    free(state);
+    return NULL;
+}
+
+// Run one of the thread functions on all parts.
+void run_parts( explode_part_type* parts,
+                int part_count,
+                void* (*part_thread)(void*) )
+{
+    pthread_t threads[MAX_EXPLODE_THREADS];
+    bool thread_started[MAX_EXPLODE_THREADS] = {0};
+    int i;
+    
+    for (i = 1; i < part_count; i++)
+    {
+        thread_started[i] = (pthread_create(&threads[i], NULL,
+                                            part_thread, &parts[i]) == 0);
+    }
+    
+    for (i = 0; i < part_count; i++)
+    {
+        if (!thread_started[i])
+        {
+            part_thread(&parts[i]);
+        }
+    }
+    
+    for (i = 1; i < part_count; i++)
+    {
+        if (thread_started[i])
+        {
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
+
+long explode_parallel( const unsigned char* in_data,
+                       unsigned long in_length,
+                       unsigned char* out_data,
+                       unsigned long out_length,
+                       unsigned int thread_count,
+                       explode_stats_type* explode_stats )
+{
+    explode_part_type* parts;
+    header_type header;
+    unsigned long total_bits;
+    unsigned long position = 0;
+    int part_count;
+    bool error = false;
+    int i;
+    
+    if (in_length < 2)
+    {
+        return -1;
+    }
+    
+    // The parts decode without the fast paths, but their statistics count
+    // ASCII literal bits from the tables.
+    explode_tables_init();
+    
+    header.literal_mode = in_data[0];
+    header.dictionary_size = in_data[1];
+    
+    if (!explode_check_header(&header))
+    {
+        return -1;
+    }
+    
+    // Not worth splitting up, or not possible.
+    part_count = (thread_count < MAX_EXPLODE_THREADS) ?
+                 (int) thread_count : MAX_EXPLODE_THREADS;
+    
+    if (part_count > in_length / EXPLODE_MIN_PART_SIZE)
+    {
+        part_count = (int) (in_length / EXPLODE_MIN_PART_SIZE);
+    }
+    
+    if (part_count < 2)
+    {
+        long result = explode_memory(in_data, in_length, 16, out_data, 0,
+                                     out_length, explode_stats);
+        
+        return (result == (long) out_length) ? result : -1;
+    }
+    
+    // On the heap, as each part's statistics carry its histograms.
+    parts = calloc(part_count, sizeof(explode_part_type));
+    
+    if (!parts)
+    {
+        return -1;
+    }
+    
+    // Guess evenly spaced starting points, then find where each part can
+    // really start.
+    total_bits = (in_length - 2) * 8;
+    
+    for (i = 0; i < part_count; i++)
+    {
+        parts[i].in_data = in_data;
+        parts[i].in_length = in_length;
+        parts[i].guess = 16 + total_bits * i / part_count;
+    }
+    
+    parts[0].start = 16;
+    run_parts(&parts[1], part_count - 1, find_sync_thread);
+    
+    for (i = 0; i < part_count; i++)
+    {
+        parts[i].end = (i + 1 < part_count) ? parts[i + 1].start : 0;
+        
+        if ((i > 0) && (parts[i].error || (parts[i].start <= parts[i-1].start)))
+        {
+            error = true;
+        }
+    }
+    
+    if (!error)
+    {
+        run_parts(parts, part_count, explode_part_thread);
+    }
+    
+    // Put the parts together in order, filling in placeholders from the
+    // output before each part.
+    for (i = 0; (i < part_count) && !error; i++)
+    {
+        symbol_buffer_type* output = &parts[i].output;
+        
+        if (parts[i].error || (output->length > out_length - position))
+        {
+            error = true;
+            break;
+        }
+        
+        for (unsigned long j = 0; j < output->length; j++)
+        {
+            uint16_t symbol = output->symbols[j];
+            
+            if (symbol < 256)
+            {
+                out_data[position + j] = (unsigned char) symbol;
+            }
+            else
+            {
+                // Counted back from the start of the part.
+                unsigned long back = EXPLODE_WINDOW_SIZE - (symbol - 256);
+                
+                if (back > position)
+                {
+                    error = true;
+                    break;
+                }
+                
+                out_data[position + j] = out_data[position - back];
+            }
+        }
+        
+        position += output->length;
+    }
+    
+    if (!error && explode_stats)
+    {
+        *explode_stats = parts[0].stats;
+        
+        for (i = 1; i < part_count; i++)
+        {
+            explode_add_stats(explode_stats, &parts[i].stats);
+        }
+    }
+    
+    for (i = 0; i < part_count; i++)
+    {
+        free(parts[i].output.symbols);
+    }
+    free(parts);
+    
+    if (error || (position != out_length))
+    {
+        return -1;
+    }
+    
+    return (long) position;
+}
+
+// -- CHECKPOINTS AND RANGE READS --
+
+#define EXPLODE_CHECKPOINT_INTERVAL  0x10000
+    // Default spacing of checkpoints, in output bytes.
+
+long explode_build_checkpoints( const unsigned char* in_data,
+                                unsigned long in_length,
+                                unsigned long interval,
+                                explode_checkpoints_type* checkpoints )
+{
+    explode_state_type* state;
+    unsigned char* buffer;
+    unsigned long bit_offset = 16;
+    unsigned long history_length = 0;
+    unsigned long total = 0;
+    unsigned long size = 0;
+    bool error = false;
+    
+    if (interval == 0)
+    {
+        interval = EXPLODE_CHECKPOINT_INTERVAL;
+    }
+    
+    checkpoints->length = 0;
+    checkpoints->interval = interval;
+    checkpoints->count = 0;
+    checkpoints->checkpoints = NULL;
+    
+    state = malloc(sizeof(explode_state_type));
+    buffer = malloc(EXPLODE_WINDOW_SIZE + interval + EXPLODE_MAX_COPY_LENGTH);
+    
+    if (!state || !buffer)
+    {
+        printf("Error: out of memory.\n");
+        free(state);
+        free(buffer);
+        return -1;
+    }
+    
+    // Explode interval bytes (plus the rest of the last token) at a time,
+    // keeping the last 4K as history for the next round.
+    while (!error)
+    {
+        explode_checkpoint_type* checkpoint;
+        long produced;
+        unsigned long keep;
+        
+        produced = explode_memory_state(state, in_data, in_length, bit_offset,
+                                        buffer, history_length,
+                                        interval + EXPLODE_MAX_COPY_LENGTH,
+                                        interval, NULL);
+        
+        if (produced < 0)
+        {
+            error = true;
+            break;
+        }
+        
+        total += produced;
+        
+        if (state->explode.end_marker)
+        {
+            break;
+        }
+        
+        if (checkpoints->count == size)
+        {
+            unsigned long new_size = size ? size * 2 : 16;
+            explode_checkpoint_type* new_checkpoints =
+                realloc(checkpoints->checkpoints,
+                        new_size * sizeof(explode_checkpoint_type));
+            
+            if (!new_checkpoints)
+            {
+                printf("Error: out of memory.\n");
+                error = true;
+                break;
+            }
+            
+            checkpoints->checkpoints = new_checkpoints;
+            size = new_size;
+        }
+        
+        // Stopped at a token boundary, so decoding can restart here.
+        keep = history_length + produced;
+        if (keep > EXPLODE_WINDOW_SIZE)
+        {
+            keep = EXPLODE_WINDOW_SIZE;
+        }
+        memmove(buffer, &buffer[history_length + produced - keep], keep);
+        history_length = keep;
+        
+        checkpoint = &checkpoints->checkpoints[checkpoints->count++];
+        checkpoint->bit_offset =
+            read_bitstream_position(&state->read_bitstream);
+        checkpoint->output_offset = total;
+        memset(checkpoint->window, 0, EXPLODE_WINDOW_SIZE - keep);
+        memcpy(&checkpoint->window[EXPLODE_WINDOW_SIZE - keep], buffer, keep);
+        
+        bit_offset = checkpoint->bit_offset;
+    }
+    
+    free(buffer);
+    free(state);
+    
+    if (error)
+    {
+        explode_checkpoints_free(checkpoints);
+        return -1;
+    }
+    
+    checkpoints->length = total;
+    
+    return total;
+}
+
+long explode_read_range( const unsigned char* in_data,
+                         unsigned long in_length,
+                         const explode_checkpoints_type* checkpoints,
+                         unsigned long offset,
+                         unsigned long length,
+                         unsigned char* out_data )
+{
+    const explode_checkpoint_type* checkpoint = NULL;
+    explode_state_type* state;
+    unsigned char* buffer;
+    unsigned long bit_offset = 16;
+    unsigned long start = 0;
+    unsigned long history_length = 0;
+    unsigned long skip;
+    unsigned long low = 0;
+    unsigned long high = checkpoints->count;
+    long result;
+    
+    if (offset >= checkpoints->length)
+    {
+        return 0;
+    }
+    
+    if (length > checkpoints->length - offset)
+    {
+        length = checkpoints->length - offset;
+    }
+    
+    // Last checkpoint at or before offset, if any.
+    while (low < high)
+    {
+        unsigned long middle = (low + high) / 2;
+        
+        if (checkpoints->checkpoints[middle].output_offset <= offset)
+        {
+            checkpoint = &checkpoints->checkpoints[middle];
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    
+    if (checkpoint)
+    {
+        bit_offset = checkpoint->bit_offset;
+        start = checkpoint->output_offset;
+        history_length = start < EXPLODE_WINDOW_SIZE ?
+                         start : EXPLODE_WINDOW_SIZE;
+    }
+    
+    skip = offset - start;
+    
+    state = malloc(sizeof(explode_state_type));
+    buffer = malloc(history_length + skip + length + EXPLODE_MAX_COPY_LENGTH);
+    
+    if (!state || !buffer)
+    {
+        printf("Error: out of memory.\n");
+        free(state);
+        free(buffer);
+        return -1;
+    }
+    
+    if (checkpoint)
+    {
+        memcpy(buffer,
+               &checkpoint->window[EXPLODE_WINDOW_SIZE - history_length],
+               history_length);
+    }
+    
+    result = explode_memory_state(state, in_data, in_length, bit_offset,
+                                  buffer, history_length,
+                                  skip + length + EXPLODE_MAX_COPY_LENGTH,
+                                  skip + length, NULL);
+    
+    if (result >= 0 && result < skip + length)
+    {
+        printf("Error: Member ended before the requested range.\n");
+        result = -1;
+    }
+    
+    if (result >= 0)
+    {
+        memcpy(out_data, &buffer[history_length + skip], length);
+        result = length;
+    }
+    
+    free(buffer);
+    free(state);
+    
+    return result;
+}
+
+void explode_checkpoints_free( explode_checkpoints_type* checkpoints )
+{
+    free(checkpoints->checkpoints);
+    checkpoints->checkpoints = NULL;
+    checkpoints->count = 0;
+}
+
+// Write a value with least significant byte first.
+bool write_checkpoint_value( FILE* fp, uint32_t value )
+{
+    unsigned char buffer[4];
+    
+    buffer[0] = value & 0xFF;
+    buffer[1] = (value >> 8) & 0xFF;
+    buffer[2] = (value >> 16) & 0xFF;
+    buffer[3] = (value >> 24) & 0xFF;
+    
+    return fwrite(buffer, sizeof buffer[0], 4, fp) == 4;
+}
+
+// Read a value stored with least significant byte first.
+bool read_checkpoint_value( FILE* fp, unsigned long* value )
+{
+    unsigned char buffer[4];
+    
+    if (fread(buffer, sizeof buffer[0], 4, fp) != 4)
+    {
+        return false;
+    }
+    
+    *value = ((unsigned long) buffer[3] << 24) | (buffer[2] << 16) |
+             (buffer[1] << 8) | buffer[0];
+    return true;
+}
+
+bool explode_save_checkpoints( const explode_checkpoints_type* checkpoints,
+                               FILE* fp )
+{
+    bool file_error = false;
+    
+    file_error |= fwrite("LFGC", sizeof(unsigned char), 4, fp) != 4;
+    file_error |= !write_checkpoint_value(fp, checkpoints->length);
+    file_error |= !write_checkpoint_value(fp, checkpoints->interval);
+    file_error |= !write_checkpoint_value(fp, checkpoints->count);
+    
+    for (unsigned long i = 0; (i < checkpoints->count) && !file_error; i++)
+    {
+        const explode_checkpoint_type* checkpoint =
+            &checkpoints->checkpoints[i];
+        
+        file_error |= !write_checkpoint_value(fp, checkpoint->bit_offset);
+        file_error |= !write_checkpoint_value(fp, checkpoint->output_offset);
+        file_error |= fwrite(checkpoint->window, sizeof(unsigned char),
+                             EXPLODE_WINDOW_SIZE, fp) != EXPLODE_WINDOW_SIZE;
+    }
+    
+    return !file_error;
+}
+
+bool explode_load_checkpoints( explode_checkpoints_type* checkpoints,
+                               FILE* fp )
+{
+    char tag[4];
+    unsigned long count;
+    unsigned long previous = 0;
+    bool file_error = false;
+    
+    checkpoints->count = 0;
+    checkpoints->checkpoints = NULL;
+    
+    file_error |= fread(tag, sizeof tag[0], 4, fp) != 4;
+    file_error |= !read_checkpoint_value(fp, &checkpoints->length);
+    file_error |= !read_checkpoint_value(fp, &checkpoints->interval);
+    file_error |= !read_checkpoint_value(fp, &count);
+    
+    // At most one checkpoint per output byte.
+    if (file_error || (memcmp(tag, "LFGC", 4) != 0) ||
+        (count > checkpoints->length))
+    {
+        return false;
+    }
+    
+    checkpoints->checkpoints = malloc((count ? count : 1) *
+                                      sizeof(explode_checkpoint_type));
+    
+    if (!checkpoints->checkpoints)
+    {
+        return false;
+    }
+    
+    for (unsigned long i = 0; (i < count) && !file_error; i++)
+    {
+        explode_checkpoint_type* checkpoint = &checkpoints->checkpoints[i];
+        
+        file_error |= !read_checkpoint_value(fp, &checkpoint->bit_offset);
+        file_error |= !read_checkpoint_value(fp, &checkpoint->output_offset);
+        file_error |= fread(checkpoint->window, sizeof(unsigned char),
+                            EXPLODE_WINDOW_SIZE, fp) != EXPLODE_WINDOW_SIZE;
+        
+        // Offsets must go up and stay inside the member.
+        if ((checkpoint->output_offset <= previous) ||
+            (checkpoint->output_offset > checkpoints->length) ||
+            (checkpoint->bit_offset < 16))
+        {
+            file_error = true;
+        }
+        previous = checkpoint->output_offset;
+    }
+    
+    if (file_error)
+    {
+        explode_checkpoints_free(checkpoints);
+        return false;
+    }
+    
+    checkpoints->count = count;
+    
+    return true;
+}
+
+// -- TWO STAGE (PIPELINED) EXPLODE --
+
+#define TOKEN_BLOCK_SIZE     0x4000
+    // Tokens passed from the parse stage to the copy stage at a time.
+
+#define TOKEN_BLOCK_COUNT    8
+    // Blocks in flight between the stages.
+
+bool explode_read_token( explode_state_type* state,
+                         explode_token_type* token )
+{
+    read_bitstream_type* read_bitstream = &state->read_bitstream;
+    
+    // Literals from the fast path tables, one at a time.
+    if ((read_bitstream->bit_count >= ASCII_TABLE_BITS) ||
+        (read_bitstream_fill(read_bitstream) >= ASCII_TABLE_BITS))
+    {
+        if (state->header.literal_mode == 0)
+        {
+            if (!(read_bitstream->bit_buffer & 0x1))
+            {
+                token->length = 0;
+                token->value = (unsigned char)(read_bitstream->bit_buffer >> 1);
+                read_bitstream->bit_buffer >>= 9;
+                read_bitstream->bit_count -= 9;
+                return true;
+            }
+        }
+        else
+        {
+            const ascii_table_entry_type* entry =
+                &ascii_table[read_bitstream->bit_buffer &
+                             ((1 << ASCII_TABLE_BITS) - 1)];
+            
+            if (entry->count)
+            {
+                int bits = ascii_literal_bits[entry->literals[0]];
+                
+                token->length = 0;
+                token->value = entry->literals[0];
+                read_bitstream->bit_buffer >>= bits;
+                read_bitstream->bit_count -= bits;
+                return true;
+            }
+        }
+    }
+    
+    if (read_copy_from_table(state))
+    {
+        if (state->explode.end_marker)
+        {
+            return false;
+        }
+        
+        token->length = state->explode.length;
+        token->value = state->explode.offset;
+        return true;
+    }
+    
+    // Next bit indicates a literal or dictionary lookup.
+    if (read_next_bit(&state->read_bitstream) == 0)
+    {
+        token->length = 0;
+        token->value = read_literal(state);
+    }
+    else
+    {
+        state->explode.length = read_copy_length(state);
+        
+        // Length of 519 indicates end of file.
+        if (state->explode.length == 519)
+        {
+            state->explode.end_marker = true;
+            return false;
+        }
+        
+        token->length = state->explode.length;
+        token->value = read_copy_offset(state);
+    }
+    
+    return !state->read_bitstream.error_flag;
+}
+
+// Set up a state to parse tokens from the start of in_data. Returns false
+// if the header isn't valid.
+bool explode_parse_init( explode_state_type* state,
+                         const unsigned char* in_data,
+                         unsigned long in_length )
+{
+    if (in_length < 2)
+    {
+        printf("Error: Unable to read header info.\n");
+        return false;
+    }
+    
+    state->header.literal_mode = in_data[0];
+    state->header.dictionary_size = in_data[1];
+    
+    if (!explode_check_header(&state->header))
+    {
+        return false;
+    }
+    
+    read_bitstream_init_memory(&state->read_bitstream, in_data, in_length, 16);
+    explode_reset(state);
+    explode_tables_init();
+    
+    return true;
+}
+
+long explode_tokens( const unsigned char* in_data,
+                     unsigned long in_length,
+                     explode_token_type** tokens )
+{
+    explode_state_type* state = malloc(sizeof(explode_state_type));
+    explode_token_type* token_array = NULL;
+    unsigned long count = 0;
+    unsigned long size = 0;
+    bool error = false;
+    
+    *tokens = NULL;
+    
+    if (!state)
+    {
+        printf("Error: out of memory.\n");
+        return -1;
+    }
+    
+    error = !explode_parse_init(state, in_data, in_length);
+    
+    while (!error)
+    {
+        explode_token_type token;
+        
+        if (!explode_read_token(state, &token))
+        {
+            error = !state->explode.end_marker;
+            break;
+        }
+        
+        if (count == size)
+        {
+            unsigned long new_size = size ? size * 2 : TOKEN_BLOCK_SIZE;
+            explode_token_type* new_array =
+                realloc(token_array, new_size * sizeof(explode_token_type));
+            
+            if (!new_array)
+            {
+                printf("Error: out of memory.\n");
+                error = true;
+                break;
+            }
+            
+            token_array = new_array;
+            size = new_size;
+        }
+        
+        token_array[count++] = token;
+    }
+    
+    free(state);
+    
+    if (error)
+    {
+        free(token_array);
+        return -1;
+    }
+    
+    *tokens = token_array;
+    return count;
+}
+
+// Token blocks shared by the two stages. Blocks are filled and emptied in
+// order, round the ring.
+typedef struct
+{
+    const unsigned char* in_data;
+    unsigned long in_length;
+    explode_state_type* state;          // Parse stage state.
+    
+    explode_token_type* tokens;         // TOKEN_BLOCK_COUNT blocks.
+    unsigned long block_length[TOKEN_BLOCK_COUNT];
+    
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    unsigned long blocks_filled;
+    unsigned long blocks_emptied;
+    bool parse_done;                    // No more blocks coming.
+    bool parse_error;
+    bool stop;                          // Copy stage gave up.
+} token_pipeline_type;
+
+// Parse stage: fill token blocks until the end marker or an error.
+void* explode_parse_thread( void* pipeline_ptr )
+{
+    token_pipeline_type* pipeline = pipeline_ptr;
+    bool more = true;
+    uint64_t thread_start = explode_time_ns();
+    
+    while (more)
+    {
+        unsigned long block;
+        explode_token_type* tokens;
+        unsigned long count = 0;
+        
+        pthread_mutex_lock(&pipeline->lock);
+        
+        while (!pipeline->stop &&
+               (pipeline->blocks_filled - pipeline->blocks_emptied ==
+                TOKEN_BLOCK_COUNT))
+        {
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        }
+        
+        if (pipeline->stop)
+        {
+            pthread_mutex_unlock(&pipeline->lock);
+            break;
+        }
+        
+        block = pipeline->blocks_filled % TOKEN_BLOCK_COUNT;
+        pthread_mutex_unlock(&pipeline->lock);
+        
+        tokens = &pipeline->tokens[block * TOKEN_BLOCK_SIZE];
+        
+        while (more && (count < TOKEN_BLOCK_SIZE))
+        {
+            more = explode_read_token(pipeline->state, &tokens[count]);
+            
+            if (more)
+            {
+                count++;
+            }
+        }
+        
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->block_length[block] = count;
+        pipeline->blocks_filled++;
+        
+        if (!more)
+        {
+            pipeline->parse_done = true;
+            pipeline->parse_error = !pipeline->state->explode.end_marker;
+        }
+        
+        pthread_cond_broadcast(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+    
+    explode_trace("parse tokens", "worker", thread_start,
+                  read_bitstream_position(&pipeline->state->read_bitstream)
+                  / 8, 0);
+    
+    return NULL;
+}
+
+long explode_pipelined( const unsigned char* in_data,
+                        unsigned long in_length,
+                        unsigned char* out_data,
+                        unsigned long out_length,
+                        explode_stats_type* explode_stats )
+{
+    token_pipeline_type pipeline;
+    explode_state_type* parse_state = malloc(sizeof(explode_state_type));
+    explode_state_type* state = malloc(sizeof(explode_state_type));
+    explode_token_type* tokens =
+        malloc(TOKEN_BLOCK_COUNT * TOKEN_BLOCK_SIZE *
+               sizeof(explode_token_type));
+    pthread_t parse_thread;
+    bool error = false;
+    
+    if (!parse_state || !state || !tokens)
+    {
+        printf("Error: out of memory.\n");
+        free(parse_state);
+        free(state);
+        free(tokens);
+        return -1;
+    }
+    
+    if (!explode_parse_init(parse_state, in_data, in_length))
+    {
+        free(parse_state);
+        free(state);
+        free(tokens);
+        return -1;
+    }
+    
+    // Copy stage writes through its own state.
+    state->header = parse_state->header;
+    state->write_buffer.file_pointer = NULL;
+    state->write_buffer.data = out_data;
+    state->write_buffer.history_length = 0;
+    state->write_buffer.data_length = out_length;
+    state->write_buffer.stop_length = 0;
+    state->write_buffer.bytes_written = 0;
+    state->write_buffer.buffer_position = 0;
+    state->write_buffer.error_flag = 0;
+    explode_reset(state);
+    
+    pipeline.in_data = in_data;
+    pipeline.in_length = in_length;
+    pipeline.state = parse_state;
+    pipeline.tokens = tokens;
+    pipeline.blocks_filled = 0;
+    pipeline.blocks_emptied = 0;
+    pipeline.parse_done = false;
+    pipeline.parse_error = false;
+    pipeline.stop = false;
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.changed, NULL);
+    
+    if (pthread_create(&parse_thread, NULL, explode_parse_thread, &pipeline))
+    {
+        pthread_mutex_destroy(&pipeline.lock);
+        pthread_cond_destroy(&pipeline.changed);
+        free(parse_state);
+        free(state);
+        free(tokens);
+        return -1;
+    }
+    
+    // Copy stage: empty blocks as they are filled.
+    while (!error)
+    {
+        unsigned long block;
+        const explode_token_type* block_tokens;
+        
+        pthread_mutex_lock(&pipeline.lock);
+        
+        while ((pipeline.blocks_emptied == pipeline.blocks_filled) &&
+               !pipeline.parse_done)
+        {
+            pthread_cond_wait(&pipeline.changed, &pipeline.lock);
+        }
+        
+        if (pipeline.blocks_emptied == pipeline.blocks_filled)
+        {
+            error = pipeline.parse_error;
+            pthread_mutex_unlock(&pipeline.lock);
+            break;
+        }
+        
+        block = pipeline.blocks_emptied % TOKEN_BLOCK_COUNT;
+        pthread_mutex_unlock(&pipeline.lock);
+        
+        block_tokens = &tokens[block * TOKEN_BLOCK_SIZE];
+        
+        for (unsigned long i = 0; i < pipeline.block_length[block]; i++)
+        {
+            if (block_tokens[i].length == 0)
+            {
+                write_byte(&state->write_buffer,
+                           (unsigned char) block_tokens[i].value);
+                state->explode.literal_count++;
+                state->explode.literal_histogram[block_tokens[i].value]++;
+            }
+            else
+            {
+                state->explode.length = block_tokens[i].length;
+                state->explode.offset = block_tokens[i].value;
+                explode_copy(state);
+            }
+        }
+        
+        error = state->write_buffer.error_flag;
+        
+        pthread_mutex_lock(&pipeline.lock);
+        pipeline.blocks_emptied++;
+        if (error)
+        {
+            pipeline.stop = true;
+        }
+        pthread_cond_broadcast(&pipeline.changed);
+        pthread_mutex_unlock(&pipeline.lock);
+    }
+    
+    pthread_join(parse_thread, NULL);
+    
+    pthread_mutex_destroy(&pipeline.lock);
+    pthread_cond_destroy(&pipeline.changed);
+    
+    if (explode_stats != NULL)
+    {
+        // The end marker was read by the parsing thread.
+        state->explode.end_marker = parse_state->explode.end_marker;
+        explode_get_stats(state, explode_stats);
+    }
+    
+    if (state->write_buffer.bytes_written != out_length)
+    {
+        error = true;
+    }
+    
+    free(parse_state);
+    free(state);
+    free(tokens);
+    
+    return error ? -1 : (long) out_length;
+}
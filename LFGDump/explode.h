@@ -16,6 +16,46 @@
 #define explode_h
 
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define EXPLODE_WINDOW_SIZE  4096
+    // Furthest back a copy can reach (largest dictionary).
+
+/* Where the time goes while exploding. Match copies are interleaved with
+   decoding token by token, so only a sample of them is timed and the total
+   estimated from it; bit decoding is whatever is left of the decode loop.
+   Header and switch times are for archive input (see extract_and_explode).
+*/
+typedef enum {
+    EXPLODE_PHASE_HEADER = 0,   // Reading archive and file headers
+    EXPLODE_PHASE_READ,         // Reading imploded input
+    EXPLODE_PHASE_DECODE,       // Decoding tokens from the bitstream
+    EXPLODE_PHASE_COPY,         // Copying from the dictionary (estimated)
+    EXPLODE_PHASE_WRITE,        // Writing output
+    EXPLODE_PHASE_SWITCH,       // Moving on to the next archive file
+    EXPLODE_PHASE_COUNT
+} explode_phase_type;
+
+/* Kinds of token, as counted in explode_stats_type token_count. */
+typedef enum {
+    EXPLODE_TOKEN_LITERAL = 0,  // A literal byte
+    EXPLODE_TOKEN_COPY,         // A length/offset copy from the dictionary
+    EXPLODE_TOKEN_END,          // The end marker (length 519)
+    EXPLODE_TOKEN_COUNT
+} explode_token_kind_type;
+
+/* What the bits of an imploded file are spent on. The 16 bit header and
+   the padding after the end marker make up the rest of the file.
+*/
+typedef enum {
+    EXPLODE_BITS_FLAGS = 0,     // Literal/copy flag starting each token
+    EXPLODE_BITS_LITERALS,      // Literal bytes, or their ASCII mode codes
+    EXPLODE_BITS_LENGTH_CODES,  // Copy length codes (end marker included)
+    EXPLODE_BITS_LENGTH_EXTRA,  // Extra bits after the longer length codes
+    EXPLODE_BITS_OFFSETS,       // Offset codes and their low bits
+    EXPLODE_BITS_COUNT
+} explode_bit_use_type;
 
 typedef struct {
     unsigned int dictionary_size;
@@ -28,8 +68,43 @@ typedef struct {
     int min_offset;
     int max_length;
     int min_length;
+    
+    // Histograms: copies of each length (519 is the end marker, not a
+    // copy), copies from each offset (value+1 bytes back) and literals of
+    // each byte value.
+    unsigned int length_histogram[520];
+    unsigned int offset_histogram[EXPLODE_WINDOW_SIZE];
+    unsigned int literal_histogram[256];
+    
+    // Tokens of each kind, and imploded bits spent on each use.
+    unsigned int token_count[EXPLODE_TOKEN_COUNT];
+    uint64_t bits[EXPLODE_BITS_COUNT];
+    
+    // Time in each phase, in nanoseconds. Summed over threads when the
+    // file is exploded on several.
+    uint64_t phase_ns[EXPLODE_PHASE_COUNT];
 } explode_stats_type;
 
+/* Add the statistics of another file or part to explode_stats: counts,
+   histograms, bits and times are summed, and the ranges widened.
+*/
+void explode_add_stats( explode_stats_type* explode_stats,
+                        const explode_stats_type* part_stats );
+
+/* Monotonic clock in nanoseconds, for timing phases. */
+uint64_t explode_time_ns( void );
+
+/* If set, called as each worker thread finishes and after each write of
+   output to a file, on the thread that did the work, with a name for the
+   span, the category, when it started (explode_time_ns()) and the bytes it
+   took in and put out. Used to trace extraction (LFGDump --trace).
+*/
+extern void (*explode_trace_hook)( const char* name,
+                                   const char* category,
+                                   uint64_t start_ns,
+                                   unsigned long bytes_in,
+                                   unsigned long bytes_out );
+
 unsigned int write_buffer_get_bytes_written( void );
 unsigned long read_buffer_get_bytes_read( void );
 
@@ -47,4 +122,143 @@ int extract_and_explode( FILE* in_fp,
                          explode_stats_type* explode_stats,
                          FILE* (*eof_reached)(void));
 
+/* Explode imploded data that is already in memory.
+   in_data:         The whole imploded file, including the two header bytes.
+   bit_offset:      Where to start decoding, counted in bits from the start
+                    of in_data. Must be the start of a token (16 for the
+                    first one).
+   out_data:        Output memory. The first history_length bytes hold
+                    earlier output, which copies may refer back to; new
+                    output is placed after it.
+   out_length:      Bytes to produce. Decoding stops once this many are
+                    written or the end marker is found.
+   Each call uses its own state, so calls may run concurrently on different
+   threads. Returns the number of bytes written, or -1 on error.
+*/
+long explode_memory( const unsigned char* in_data,
+                     unsigned long in_length,
+                     unsigned long bit_offset,
+                     unsigned char* out_data,
+                     unsigned long history_length,
+                     unsigned long out_length,
+                     explode_stats_type* explode_stats );
+
+/* Explode imploded data made up of independent blocks (see LFGMake -b),
+   each on its own thread (up to thread_count). Block i starts at
+   bit_offset[i] in in_data and fills out_data from output_offset[i] up to
+   the start of the next block (or out_length for the last one). Returns
+   out_length, or -1 if any block fails.
+*/
+long explode_blocks( const unsigned char* in_data,
+                     unsigned long in_length,
+                     const unsigned long* bit_offset,
+                     const unsigned long* output_offset,
+                     unsigned long block_count,
+                     unsigned char* out_data,
+                     unsigned long out_length,
+                     unsigned int thread_count,
+                     explode_stats_type* explode_stats );
+
+/* Explode a whole imploded file held in memory on up to thread_count
+   threads, without any index. Later parts start from guessed offsets that
+   are checked against where the earlier part ends. Returns out_length, or
+   -1 if the file couldn't be exploded this way (including when the output
+   isn't exactly out_length bytes).
+*/
+long explode_parallel( const unsigned char* in_data,
+                       unsigned long in_length,
+                       unsigned char* out_data,
+                       unsigned long out_length,
+                       unsigned int thread_count,
+                       explode_stats_type* explode_stats );
+
+/* Same as extract_and_explode(), for imploded data already in memory. */
+int extract_and_explode_memory( const unsigned char* in_data,
+                                unsigned long in_length,
+                                FILE* out_fp,
+                                int expected_length,
+                                explode_stats_type* explode_stats );
+
+/* A point where decoding can restart: the token boundary at bit_offset,
+   which produces output from output_offset on, and the 4K of output before
+   it (right aligned; bytes before the start of the file are zero).
+*/
+typedef struct {
+    unsigned long bit_offset;
+    unsigned long output_offset;
+    unsigned char window[EXPLODE_WINDOW_SIZE];
+} explode_checkpoint_type;
+
+typedef struct {
+    unsigned long length;       // Exploded length of the file.
+    unsigned long interval;     // Output bytes between checkpoints.
+    unsigned long count;
+    explode_checkpoint_type* checkpoints;
+} explode_checkpoints_type;
+
+/* Explode a whole imploded file held in memory (as for explode_memory) and
+   record a checkpoint about every interval output bytes (0 for 64K). The
+   output itself isn't kept. Returns the exploded length, or -1 on error.
+   Free with explode_checkpoints_free().
+*/
+long explode_build_checkpoints( const unsigned char* in_data,
+                                unsigned long in_length,
+                                unsigned long interval,
+                                explode_checkpoints_type* checkpoints );
+
+/* Read bytes [offset, offset+length) of the exploded file into out_data,
+   decoding from the nearest checkpoint before offset rather than from the
+   start. The range is cut short at the end of the file. Returns the number
+   of bytes read, or -1 on error. Safe to call from several threads.
+*/
+long explode_read_range( const unsigned char* in_data,
+                         unsigned long in_length,
+                         const explode_checkpoints_type* checkpoints,
+                         unsigned long offset,
+                         unsigned long length,
+                         unsigned char* out_data );
+
+void explode_checkpoints_free( explode_checkpoints_type* checkpoints );
+
+/* Save checkpoints at the current position of fp, or load them back, so
+   they only need building once. Format ('LFGC', all values 4 bytes, least
+   significant byte first):
+       'LFGC', length, interval, count,
+       then per checkpoint: bit_offset, output_offset, 4096 window bytes.
+   Loading returns false if the data isn't valid.
+*/
+bool explode_save_checkpoints( const explode_checkpoints_type* checkpoints,
+                               FILE* fp );
+bool explode_load_checkpoints( explode_checkpoints_type* checkpoints,
+                               FILE* fp );
+
+/* One token of an imploded file: a literal (length 0, value is the byte)
+   or a copy of length bytes from value+1 bytes back.
+*/
+typedef struct {
+    uint16_t length;
+    uint16_t value;
+} explode_token_type;
+
+/* Parse a whole imploded file held in memory into its tokens (end marker
+   not included), for debugging and analysis. Returns the number of tokens
+   and sets *tokens to an array to be freed by the caller, or returns -1 on
+   error.
+*/
+long explode_tokens( const unsigned char* in_data,
+                     unsigned long in_length,
+                     explode_token_type** tokens );
+
+/* Explode a whole imploded file held in memory in two stages running at
+   the same time: one thread parses the bitstream into blocks of tokens,
+   while the calling thread copies them out into out_data. Returns
+   out_length, or -1 on error (including when the output isn't exactly
+   out_length bytes).
+*/
+long explode_pipelined( const unsigned char* in_data,
+                        unsigned long in_length,
+                        unsigned char* out_data,
+                        unsigned long out_length,
+                        explode_stats_type* explode_stats );
+
 #endif /* explode_h */
@@ -7,9 +7,12 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include "read_lfg.h"
+#include "explode.h"
+#include "trace_lfg.h"
 #define LFG_DUMP_VERSION_MAJOR 1
 #define LFG_DUMP_VERSION_MINOR 3
 
@@ -21,9 +24,13 @@ void print_usage ( void )
     printf("   -d              Display process details\n");
     printf("   -f              Force overwrite of existing files during extraction\n");
     printf("   -i              Show archive info only (do not extract)\n");
+    printf("   -j N            Explode blocks and large files on N threads\n");
     printf("   -o output_dir   Extract to directory 'output_dir'\n");
+    printf("   -p              Explode large files in two stages on two threads\n");
     printf("   -s              Display file stats\n");
-    printf("   -v              Display version info\n\n");
+    printf("   -v              Display version info\n");
+    printf("   --histograms file  Write token histograms and bit use (JSON) to 'file'\n");
+    printf("   --trace file    Write a Chrome/Perfetto trace (JSON) to 'file'\n\n");
 }
 
 void print_version ( void )
@@ -42,6 +49,10 @@ int main (int argc, const char * argv[])
     bool overwrite = false;
     int file_arg = 1;
     const char* output_dir = NULL;
+    unsigned int thread_count = 1;
+    bool pipelined = false;
+    const char* trace_path = NULL;
+    const char* histogram_path = NULL;
     
     for (int j = 1; j<argc; j++)
     {
@@ -72,6 +83,35 @@ int main (int argc, const char * argv[])
             if (j<argc)
                 output_dir = argv[j];
          }
+        else if (strcmp(argv[j], "-j") == 0)
+        {
+            j++;
+            file_arg+=2;
+            if (j<argc)
+            {
+                int value = atoi(argv[j]);
+                thread_count = (value > 1) ? value : 1;
+            }
+        }
+        else if (strcmp(argv[j], "-p") == 0)
+        {
+            pipelined = true;
+            file_arg++;
+        }
+        else if (strcmp(argv[j], "--histograms") == 0)
+        {
+            j++;
+            file_arg+=2;
+            if (j<argc)
+                histogram_path = argv[j];
+        }
+        else if (strcmp(argv[j], "--trace") == 0)
+        {
+            j++;
+            file_arg+=2;
+            if (j<argc)
+                trace_path = argv[j];
+        }
         else if (strcmp(argv[j], "-v") == 0)
         {
             print_version();
@@ -96,6 +136,21 @@ int main (int argc, const char * argv[])
         return 0;
     }
     
+    if (trace_path)
+    {
+        if (!trace_open(trace_path, "LFGDump"))
+        {
+            return 0;
+        }
+        explode_trace_hook = trace_span;
+    }
+    
+    if (histogram_path && !read_lfg_histograms_open(histogram_path))
+    {
+        trace_close();
+        return 0;
+    }
+    
     while (file_arg < argc)
     {
         int result;
@@ -106,7 +161,9 @@ int main (int argc, const char * argv[])
                                   show_stats,
                                   verbose,
                                   overwrite,
-                                  output_dir);
+                                  output_dir,
+                                  thread_count,
+                                  pipelined);
         
         if (result <= 0)
           result = 1;       // Extract failed, move to next file.
@@ -114,6 +171,9 @@ int main (int argc, const char * argv[])
         file_arg+=result;
     }
     
+    read_lfg_histograms_close();
+    trace_close();
+    
     return 0;
 }
 
@@ -15,9 +15,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
-#include <time.h>
 #include "explode.h"
 #include "read_lfg.h"
+#include "trace_lfg.h"
 
 // ----
 
@@ -187,6 +187,202 @@ file_info_type file_info = {0};
 
 explode_stats_type explode_stats;
 
+// Time in each phase over the whole archive, in ns (shown with -s).
+uint64_t phase_ns[EXPLODE_PHASE_COUNT];
+
+// Token counts, histograms and bits over the archive (shown with -s), and
+// the imploded bytes they came from.
+explode_stats_type archive_stats;
+unsigned long archive_stream_bytes;
+
+// Histogram file (--histograms), or NULL, whether anything has been written
+// to its current list yet (so commas go in the right places), and whether
+// an archive's list of members is still open.
+FILE* histogram_fp = NULL;
+bool histogram_archive_first;
+bool histogram_member_first;
+bool histogram_archive_open = false;
+
+const char* token_names[EXPLODE_TOKEN_COUNT] = {
+    "Literal", "Copy", "End marker"
+};
+
+const char* bit_names[EXPLODE_BITS_COUNT] = {
+    "Flags", "Literals", "Length codes", "Length extra bits", "Offsets"
+};
+
+const char* bit_keys[EXPLODE_BITS_COUNT] = {
+    "flags", "literals", "length_codes", "length_extra", "offsets"
+};
+
+const char* phase_names[EXPLODE_PHASE_COUNT] = {
+    "Header parse", "Input read", "Bit decoding", "Match copy (est.)",
+    "Output write", "Segment switch"
+};
+
+#define PARALLEL_EXPLODE_MIN_LENGTH  0x40000
+    // Compressed files at least this long are exploded on several threads
+    // when asked to (-j), even without a block index.
+
+// Block index entry for one archived file (see LFGMake -b).
+typedef struct
+{
+    char filename[14];
+    uint32_t final_length;
+    unsigned long block_count;
+    unsigned long* bit_offset;
+    unsigned long* output_offset;
+} block_index_entry_type;
+
+struct
+{
+    int count;
+    block_index_entry_type* entries;
+} block_index = {0};
+
+void free_block_index( void )
+{
+    for (int i=0; i<block_index.count; i++)
+    {
+        free(block_index.entries[i].bit_offset);
+        free(block_index.entries[i].output_offset);
+    }
+    free(block_index.entries);
+    block_index.entries = NULL;
+    block_index.count = 0;
+}
+
+// Load the block index for an archive if there is one ([archive].idx).
+// Returns false if there is none or it can't be used.
+bool load_block_index( const char* archive_filename )
+{
+    char index_path[261];
+    FILE* fp_index;
+    char tag[4];
+    uint32_t count;
+    bool file_error = false;
+    
+    free_block_index();
+    
+    snprintf(index_path, sizeof(index_path), "%s.idx", archive_filename);
+    fp_index = fopen(index_path, "rb");
+    
+    if (fp_index == 0)
+    {
+        return false;
+    }
+    
+    file_error |= !read_chunk(fp_index, tag, 4);
+    file_error |= !read_uint32(fp_index, &count);
+    
+    if (file_error || (memcmp(tag, "LFGI", 4) != 0) || (count > 0xFFFF))
+    {
+        printf("Warning: Block index %s not valid, ignored.\n", index_path);
+        fclose(fp_index);
+        return false;
+    }
+    
+    block_index.entries = calloc(count ? count : 1,
+                                 sizeof(block_index_entry_type));
+    
+    if (!block_index.entries)
+    {
+        fclose(fp_index);
+        return false;
+    }
+    
+    block_index.count = count;
+    
+    for (int i=0; (i<count) && !file_error; i++)
+    {
+        block_index_entry_type* entry = &block_index.entries[i];
+        uint32_t block_size, block_count, value;
+        
+        file_error |= !read_chunk(fp_index, entry->filename, 13);
+        file_error |= !read_uint32(fp_index, &entry->final_length);
+        file_error |= !read_uint32(fp_index, &block_size);
+        file_error |= !read_uint32(fp_index, &block_count);
+        
+        // Every block holds at least one byte, except for an empty file.
+        if (file_error || (block_count == 0) ||
+            (block_count > (unsigned long) entry->final_length + 1))
+        {
+            file_error = true;
+            break;
+        }
+        
+        entry->block_count = block_count;
+        entry->bit_offset = malloc(block_count * sizeof(unsigned long));
+        entry->output_offset = malloc(block_count * sizeof(unsigned long));
+        
+        if (!entry->bit_offset || !entry->output_offset)
+        {
+            file_error = true;
+            break;
+        }
+        
+        for (unsigned long j=0; (j<block_count) && !file_error; j++)
+        {
+            file_error |= !read_uint32(fp_index, &value);
+            entry->bit_offset[j] = value;
+            file_error |= !read_uint32(fp_index, &value);
+            entry->output_offset[j] = value;
+            
+            // Blocks start after the 16 bit header, from the start of the
+            // output, and go forward in both.
+            if (j == 0)
+            {
+                file_error |= (entry->bit_offset[0] < 16) ||
+                              (entry->output_offset[0] != 0);
+            }
+            else
+            {
+                file_error |=
+                    (entry->bit_offset[j] <= entry->bit_offset[j-1]) ||
+                    (entry->output_offset[j] <= entry->output_offset[j-1]);
+            }
+            file_error |= (entry->output_offset[j] > entry->final_length);
+        }
+    }
+    
+    fclose(fp_index);
+    
+    if (file_error)
+    {
+        printf("Warning: Block index %s not valid, ignored.\n", index_path);
+        free_block_index();
+        return false;
+    }
+    
+    return true;
+}
+
+// Index entry for the file_number'th archived file, if it matches.
+block_index_entry_type* find_block_index_entry( int file_number )
+{
+    block_index_entry_type* entry;
+    
+    if ((file_number < 0) || (file_number >= block_index.count))
+    {
+        return NULL;
+    }
+    
+    entry = &block_index.entries[file_number];
+    
+    // Every block must start inside the imploded data (which follows 24
+    // bytes of header).
+    if ((strncmp(entry->filename, file_info.filename, 13) != 0) ||
+        (entry->final_length != file_info.final_length) ||
+        (file_info.length < 26) ||
+        (entry->bit_offset[entry->block_count - 1] >=
+         (unsigned long) (file_info.length - 24) * 8))
+    {
+        return NULL;
+    }
+    
+    return entry;
+}
+
 // Used as a callback function.
 // Closes old file pointer, opens next file in archive.
 // First tries incrementing last letter in filename, ie
@@ -195,6 +391,7 @@ explode_stats_type explode_stats;
 FILE* new_file(void)
 {
     unsigned long temp;
+    uint64_t start = explode_time_ns();
     
     fclose(disk_info.fp);
     
@@ -270,26 +467,375 @@ FILE* new_file(void)
         printf( "  %-12s ", file_info.filename);
     }
     
+    trace_span(disk_info.cur_filename, "switch", start,
+               archive_info.file_length, 0);
+    
     return disk_info.fp;
 }
 
 
+// Read the compressed data of the current file into memory, continuing
+// into the next archive file(s) if it spans disks.
+unsigned char* read_file_data( unsigned long length )
+{
+    unsigned char* data = malloc(length ? length : 1);
+    unsigned long bytes_read = 0;
+    
+    if (!data)
+    {
+        printf("Error: out of memory.\n");
+        return NULL;
+    }
+    
+    while (bytes_read < length)
+    {
+        uint64_t start = explode_time_ns();
+        FILE* fp;
+        
+        bytes_read += fread(&data[bytes_read], sizeof data[0],
+                            length - bytes_read, disk_info.fp);
+        
+        phase_ns[EXPLODE_PHASE_READ] += explode_time_ns() - start;
+        
+        if (bytes_read < length)
+        {
+            start = explode_time_ns();
+            fp = new_file();
+            phase_ns[EXPLODE_PHASE_SWITCH] += explode_time_ns() - start;
+            
+            if (fp == NULL)
+            {
+                free(data);
+                return NULL;
+            }
+        }
+    }
+    
+    return data;
+}
+
+// Explode the current file from memory on thread_count threads. Blocks from
+// its block index entry are used if there is one; otherwise the file is
+// either exploded in two pipelined stages or its later parts are decoded
+// speculatively. Should any of these fail, the file is exploded serially
+// instead.
+int explode_file_in_memory( block_index_entry_type* entry,
+                            FILE* out_fp,
+                            unsigned int thread_count,
+                            bool pipelined )
+{
+    // Length field counts the 24 header bytes that follow it.
+    unsigned long in_length = file_info.length - 24;
+    unsigned char* in_data;
+    unsigned char* out_data;
+    long result;
+    uint64_t start;
+    
+    in_data = read_file_data(in_length);
+    
+    if (!in_data)
+    {
+        return -1;
+    }
+    
+    out_data = malloc(file_info.final_length ? file_info.final_length : 1);
+    
+    if (!out_data)
+    {
+        printf("Error: out of memory.\n");
+        free(in_data);
+        return -1;
+    }
+    
+    start = explode_time_ns();
+    
+    if (entry)
+    {
+        result = explode_blocks(in_data,
+                                in_length,
+                                entry->bit_offset,
+                                entry->output_offset,
+                                entry->block_count,
+                                out_data,
+                                file_info.final_length,
+                                thread_count,
+                                &explode_stats);
+        
+        if (result < 0)
+        {
+            printf("\nWarning: Block index doesn't match %s, ignored.\n",
+                   file_info.filename);
+        }
+    }
+    else if (pipelined)
+    {
+        result = explode_pipelined(in_data,
+                                   in_length,
+                                   out_data,
+                                   file_info.final_length,
+                                   &explode_stats);
+    }
+    else
+    {
+        result = explode_parallel(in_data,
+                                  in_length,
+                                  out_data,
+                                  file_info.final_length,
+                                  thread_count,
+                                  &explode_stats);
+    }
+    
+    if (result < 0)
+    {
+        result = extract_and_explode_memory(in_data,
+                                            in_length,
+                                            out_fp,
+                                            file_info.final_length,
+                                            &explode_stats);
+    }
+    else
+    {
+        // Times of the threads (-j, or -p's two stages) are summed, so
+        // share out the time the explode took between decoding and copying
+        // in the same proportion. The -s table shows wall time here, unlike
+        // LFGMake's threaded paths.
+        uint64_t elapsed = explode_time_ns() - start;
+        uint64_t decode_ns = explode_stats.phase_ns[EXPLODE_PHASE_DECODE];
+        uint64_t copy_ns = explode_stats.phase_ns[EXPLODE_PHASE_COPY];
+        
+        memset(explode_stats.phase_ns, 0, sizeof(explode_stats.phase_ns));
+        
+        if (decode_ns > 0)
+        {
+            explode_stats.phase_ns[EXPLODE_PHASE_COPY] =
+                (uint64_t)((double) elapsed * copy_ns /
+                           (decode_ns + copy_ns));
+        }
+        explode_stats.phase_ns[EXPLODE_PHASE_DECODE] =
+            elapsed - explode_stats.phase_ns[EXPLODE_PHASE_COPY];
+        
+        start = explode_time_ns();
+        
+        if (out_fp &&
+            (fwrite(out_data, sizeof out_data[0], result, out_fp) != result))
+        {
+            printf("\nError: Failure while writing file %s.\n",
+                   file_info.filename);
+            result = -1;
+        }
+        
+        explode_stats.phase_ns[EXPLODE_PHASE_WRITE] =
+            explode_time_ns() - start;
+        
+        if (out_fp)
+        {
+            trace_span("flush", "io", start, 0, result);
+        }
+    }
+    
+    free(in_data);
+    free(out_data);
+    
+    return (int) result;
+}
+
+// Show where the time went over the archive (-s). Whatever isn't in one of
+// the phases (opening and closing output files, printing) is shown as other.
+void print_phase_times( uint64_t wall_ns )
+{
+    uint64_t total_ns = 0;
+    
+    printf("  Phase                 Time (s)     Share\n");
+    
+    for (int i = 0; i < EXPLODE_PHASE_COUNT; i++)
+    {
+        printf("  %-18s  %10.4f   %6.1f%%\n", phase_names[i],
+               phase_ns[i] / 1e9,
+               wall_ns ? 100.0 * phase_ns[i] / wall_ns : 0);
+        total_ns += phase_ns[i];
+    }
+    
+    total_ns = (wall_ns > total_ns) ? wall_ns - total_ns : 0;
+    
+    printf("  %-18s  %10.4f   %6.1f%%\n", "Other", total_ns / 1e9,
+           wall_ns ? 100.0 * total_ns / wall_ns : 0);
+    printf("  %-18s  %10.4f\n\n", "Wall time", wall_ns / 1e9);
+}
+
+// Show the kinds of token and what the imploded bits were spent on over the
+// archive (-s). Other is the headers and the padding after each end marker,
+// and for files with a block index the end marker too: their last block
+// stops once its output is complete.
+void print_token_summary( void )
+{
+    uint64_t total_bits = (uint64_t) archive_stream_bytes * 8;
+    uint64_t counted_bits = 0;
+    unsigned long total_tokens = 0;
+    
+    for (int i = 0; i < EXPLODE_TOKEN_COUNT; i++)
+    {
+        total_tokens += archive_stats.token_count[i];
+    }
+    
+    printf("  Token                    Count     Share\n");
+    
+    for (int i = 0; i < EXPLODE_TOKEN_COUNT; i++)
+    {
+        printf("  %-18s  %11u   %6.1f%%\n", token_names[i],
+               archive_stats.token_count[i],
+               total_tokens ?
+                   100.0 * archive_stats.token_count[i] / total_tokens : 0);
+    }
+    
+    printf("\n  Bits spent on             Bits     Share\n");
+    
+    for (int i = 0; i < EXPLODE_BITS_COUNT; i++)
+    {
+        printf("  %-18s  %11llu   %6.1f%%\n", bit_names[i],
+               (unsigned long long) archive_stats.bits[i],
+               total_bits ? 100.0 * archive_stats.bits[i] / total_bits : 0);
+        counted_bits += archive_stats.bits[i];
+    }
+    
+    counted_bits = (total_bits > counted_bits) ? total_bits - counted_bits : 0;
+    
+    printf("  %-18s  %11llu   %6.1f%%\n", "Other",
+           (unsigned long long) counted_bits,
+           total_bits ? 100.0 * counted_bits / total_bits : 0);
+    printf("  %-18s  %11llu\n\n", "Total",
+           (unsigned long long) total_bits);
+}
+
+bool read_lfg_histograms_open( const char* path )
+{
+    histogram_fp = fopen(path, "w");
+    
+    if (!histogram_fp)
+    {
+        printf("Error creating file %s for histograms.\n\n", path);
+        return false;
+    }
+    
+    fprintf(histogram_fp, "{\n  \"archives\": [");
+    histogram_archive_first = true;
+    
+    return true;
+}
+
+void read_lfg_histograms_close( void )
+{
+    if (!histogram_fp)
+    {
+        return;
+    }
+    
+    fprintf(histogram_fp, "\n  ]\n}\n");
+    
+    if (ferror(histogram_fp))
+    {
+        printf("Error: file error while writing histograms.\n");
+    }
+    
+    fclose(histogram_fp);
+    histogram_fp = NULL;
+}
+
+// Write a histogram as an object of its non-zero counts, keyed by value.
+void write_histogram( const char* key, const unsigned int* counts, int size )
+{
+    bool first = true;
+    
+    fprintf(histogram_fp, ",\n        \"%s\": {", key);
+    
+    for (int i = 0; i < size; i++)
+    {
+        if (counts[i])
+        {
+            fprintf(histogram_fp, "%s\"%d\": %u", first ? "" : ", ", i,
+                    counts[i]);
+            first = false;
+        }
+    }
+    
+    fprintf(histogram_fp, "}");
+}
+
+// Close the current archive's list of members, even if the archive was cut
+// short by an error.
+void end_archive_histograms( void )
+{
+    if (histogram_fp && histogram_archive_open)
+    {
+        fprintf(histogram_fp, "\n    ]}");
+        histogram_archive_open = false;
+    }
+}
+
+// Write the histograms and bit use of the member just exploded.
+void write_member_histograms( void )
+{
+    uint64_t total_bits = (uint64_t) (file_info.length - 24) * 8;
+    uint64_t counted_bits = 0;
+    
+    fprintf(histogram_fp, "%s\n      {\"name\": ",
+            histogram_member_first ? "" : ",");
+    trace_write_string(histogram_fp, file_info.filename);
+    fprintf(histogram_fp, ", \"imploded_bytes\": %u, "
+                          "\"exploded_bytes\": %u,\n",
+            file_info.length - 24, file_info.final_length);
+    fprintf(histogram_fp, "        \"literal_mode\": \"%s\", "
+                          "\"dictionary_size\": %d,\n",
+            explode_stats.literal_mode ? "ascii" : "binary",
+            1 << (explode_stats.dictionary_size + 6));
+    
+    fprintf(histogram_fp, "        \"tokens\": {\"literal\": %u, "
+                          "\"copy\": %u, \"end\": %u},\n",
+            explode_stats.token_count[EXPLODE_TOKEN_LITERAL],
+            explode_stats.token_count[EXPLODE_TOKEN_COPY],
+            explode_stats.token_count[EXPLODE_TOKEN_END]);
+    
+    fprintf(histogram_fp, "        \"bits\": {");
+    
+    for (int i = 0; i < EXPLODE_BITS_COUNT; i++)
+    {
+        fprintf(histogram_fp, "\"%s\": %llu, ", bit_keys[i],
+                (unsigned long long) explode_stats.bits[i]);
+        counted_bits += explode_stats.bits[i];
+    }
+    
+    fprintf(histogram_fp, "\"other\": %llu}",
+            (unsigned long long) ((total_bits > counted_bits) ?
+                                  total_bits - counted_bits : 0));
+    
+    write_histogram("lengths", explode_stats.length_histogram, 520);
+    write_histogram("offsets", explode_stats.offset_histogram,
+                    EXPLODE_WINDOW_SIZE);
+    write_histogram("literals", explode_stats.literal_histogram, 256);
+    
+    fprintf(histogram_fp, "}");
+    histogram_member_first = false;
+}
+
 int read_lfg_archive(int file_max,
                      const char * file_list[],
                      bool info_only,
                      bool show_stats,
                      verbose_level_enum verbose_level,
                      bool overwrite_flag,
-                     const char* output_dir)
+                     const char* output_dir,
+                     unsigned int thread_count,
+                     bool pipelined)
 {
     verbose = verbose_level;
     int file_index = 0;
+    int file_number = 0;     // files so far in this archive
     bool isNotEnd = true;
     char temp_buff[6];
     const char exp_buff[6] = {2,0,1,0,0,0};
     
     // Profiling
-    clock_t start, stop;
+    uint64_t archive_start = explode_time_ns();
+    uint64_t start, stop;
     double elapsed_time = 0;
     
     // Output (extracted) file pointer.
@@ -300,6 +846,10 @@ int read_lfg_archive(int file_max,
     long file_length = 0;
     
     archive_info.total_length =0;
+    memset(phase_ns, 0, sizeof(phase_ns));
+    memset(&archive_stats, 0, sizeof(archive_stats));
+    archive_stats.min_offset = archive_stats.min_length = 0x8000;
+    archive_stream_bytes = 0;
     
     disk_info.file_index = file_index;
     disk_info.filename_length = strlen(file_list[disk_info.file_index]);
@@ -335,6 +885,9 @@ int read_lfg_archive(int file_max,
     }
     archive_info.total_length += archive_info.file_length;
     
+    // Archives made in block mode come with an index of their blocks.
+    load_block_index(disk_info.cur_filename);
+    
     bool file_error = false;
     
     file_error |= !read_chunk(disk_info.fp, archive_info.filename, 13);
@@ -356,6 +909,19 @@ int read_lfg_archive(int file_max,
         printf("Warning: Disk count of 0 indicated. File may be corrupted.\n");
     }
     
+    phase_ns[EXPLODE_PHASE_HEADER] += explode_time_ns() - archive_start;
+    
+    if (histogram_fp)
+    {
+        fprintf(histogram_fp, "%s\n    {\"archive\": ",
+                histogram_archive_first ? "" : ",");
+        trace_write_string(histogram_fp, disk_info.cur_filename);
+        fprintf(histogram_fp, ", \"members\": [");
+        histogram_archive_first = false;
+        histogram_member_first = true;
+        histogram_archive_open = true;
+    }
+    
     if (verbose != VERBOSE_LEVEL_SILENT)
     {
         printf( "Reported archive name: \t\t\t%s\n", archive_info.filename );
@@ -400,8 +966,12 @@ int read_lfg_archive(int file_max,
         }
     }
     
+    start = explode_time_ns();
+    
     while (isNotEnd && isFileNext(disk_info.fp))
     {
+        uint64_t member_start = start;
+        
         file_error |= !read_uint32(disk_info.fp, &file_info.length);
         
         disk_info.file_pos = ftell(disk_info.fp);
@@ -420,6 +990,7 @@ int read_lfg_archive(int file_max,
         {
             printf("Unexpected end of file %s.\n\n", disk_info.cur_filename);
             fclose (disk_info.fp);
+            end_archive_histograms();
             return 0;
         }
         
@@ -428,6 +999,8 @@ int read_lfg_archive(int file_max,
             printf("Warning: Unexpected values in header. File may be corrupted.\n");
         }
         
+        phase_ns[EXPLODE_PHASE_HEADER] += explode_time_ns() - start;
+        
         disk_info.file_pos += file_info.length;
         
         if (verbose != VERBOSE_LEVEL_SILENT)
@@ -477,6 +1050,7 @@ int read_lfg_archive(int file_max,
                 printf("\nError: File %s already exists.\n",
                        complete_filename);
                 
+                end_archive_histograms();
                 return -1;
             }
             
@@ -493,19 +1067,42 @@ int read_lfg_archive(int file_max,
             {
                 printf("\nError: Failure while creating file %s.\n",
                        complete_filename);
+                end_archive_histograms();
                 return -1;
             }
         }
             
-        start = clock();
-            
-        (void) extract_and_explode( disk_info.fp,
-                                    out_fp,
-                                    file_info.final_length,
-                                    &explode_stats,
-                                    &new_file );
+        start = explode_time_ns();
+        memset(explode_stats.phase_ns, 0, sizeof(explode_stats.phase_ns));
+        
+        block_index_entry_type* index_entry =
+            find_block_index_entry(file_number++);
+        
+        // Files with a block index, and large files when there are
+        // threads to spare, are exploded in memory.
+        if ((file_info.length >= 26) &&
+            (index_entry ||
+             ((thread_count > 1 || pipelined) &&
+              (file_info.length >= PARALLEL_EXPLODE_MIN_LENGTH))))
+        {
+            (void) explode_file_in_memory( index_entry, out_fp, thread_count,
+                                           pipelined );
+        }
+        else
+        {
+            (void) extract_and_explode( disk_info.fp,
+                                        out_fp,
+                                        file_info.final_length,
+                                        &explode_stats,
+                                        &new_file );
+        }
             
-        stop = clock();
+        stop = explode_time_ns();
+        
+        for (int i = 0; i < EXPLODE_PHASE_COUNT; i++)
+        {
+            phase_ns[i] += explode_stats.phase_ns[i];
+        }
           
         if (!info_only)
         {
@@ -515,7 +1112,18 @@ int read_lfg_archive(int file_max,
         out_fp=NULL;
         complete_filename=NULL;
         
-        elapsed_time = (double)(stop - start) / CLOCKS_PER_SEC;
+        elapsed_time = (stop - start) / 1e9;
+        
+        trace_span(file_info.filename, "member", member_start,
+                   file_info.length + 8, file_info.final_length);
+        
+        explode_add_stats(&archive_stats, &explode_stats);
+        archive_stream_bytes += file_info.length - 24;
+        
+        if (histogram_fp)
+        {
+            write_member_histograms();
+        }
         
         
         if (verbose != VERBOSE_LEVEL_SILENT)
@@ -555,12 +1163,18 @@ int read_lfg_archive(int file_max,
             printf("\n");
         }
         
+        start = explode_time_ns();
+        
         while (/*info_only &&*/ archive_info.num_disks &&
                (disk_info.file_pos > archive_info.file_length ))
         {
             (void)new_file();
         }
         
+        stop = explode_time_ns();
+        phase_ns[EXPLODE_PHASE_SWITCH] += stop - start;
+        start = stop;
+        
         fseek(disk_info.fp, disk_info.file_pos, SEEK_SET);
         
         // check for error in new_file here...?
@@ -583,9 +1197,18 @@ int read_lfg_archive(int file_max,
                disk_info.file_count, archive_info.total_length,
                disk_info.bytes_written_so_far );
         printf ("\n");
+        
+        if (show_stats)
+        {
+            print_token_summary();
+            print_phase_times(explode_time_ns() - archive_start);
+        }
     }
     
+    end_archive_histograms();
+    
     fclose(disk_info.fp);
+    free_block_index();
     
     return ++disk_info.file_index;
 }
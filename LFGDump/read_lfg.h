@@ -59,6 +59,21 @@ int read_lfg_archive(int file_max,
                      bool show_stats,
                      verbose_level_enum verbose_level,
                      bool overwrite_flag,
-                     const char* output_dir);
+                     const char* output_dir,
+                     unsigned int thread_count,
+                     bool pipelined);
+
+/* Write full histograms of each member's copy lengths, copy offsets and
+   literal bytes, with its token counts and the bits spent on each part of
+   its tokens, to path as JSON ({"archives": [{"archive", "members": [...]}]})
+   while archives are read. Histograms are objects of the non-zero counts,
+   keyed by length, offset (value+1 bytes back) or byte value. Bits not
+   spent on tokens (headers, padding) are counted as other. Returns false
+   if the file can't be created.
+*/
+bool read_lfg_histograms_open( const char* path );
+
+/* Finish the histogram file, if open, and close it. */
+void read_lfg_histograms_close( void );
 
 #endif /* read_lfg_h */
@@ -0,0 +1,202 @@
+//
+//  trace_lfg.c
+//  LFGDump
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "explode.h"
+#include "trace_lfg.h"
+
+#define TRACE_MAX_TRACKS    256
+    // Tracks reused as threads come and go. Should more threads than this
+    // run at once, the rest share the last track.
+
+// Open trace file, or NULL when not tracing. Only changed by trace_open()
+// and trace_close(), while no other threads are running.
+FILE* trace_fp = NULL;
+
+uint64_t trace_start_ns;            // Timestamps are relative to this.
+
+// Tracks (thread ids in the trace) in use by a running thread, when each
+// was last given back, and those already named. A thread gives its track
+// back when it exits, so the threads started for each member in turn show
+// up on the same few tracks.
+bool trace_track_used[TRACE_MAX_TRACKS];
+uint64_t trace_track_free_ns[TRACE_MAX_TRACKS];
+bool trace_track_named[TRACE_MAX_TRACKS];
+
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Track of each thread, NULL until it records its first span.
+pthread_key_t trace_track_key;
+
+void trace_write_string( FILE* fp, const char* text )
+{
+    fputc('"', fp);
+    
+    for (const unsigned char* c = (const unsigned char*) text; *c; c++)
+    {
+        if ((*c == '"') || (*c == '\\'))
+        {
+            fprintf(fp, "\\%c", *c);
+        }
+        else if ((*c < 0x20) || (*c >= 0x7F))
+        {
+            fprintf(fp, "\\u%04x", *c);
+        }
+        else
+        {
+            fputc(*c, fp);
+        }
+    }
+    
+    fputc('"', fp);
+}
+
+// Called as a thread exits, to give back its track.
+void trace_thread_exit( void* track )
+{
+    pthread_mutex_lock(&trace_lock);
+    trace_track_used[(uintptr_t) track] = false;
+    trace_track_free_ns[(uintptr_t) track] = explode_time_ns();
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Give the calling thread the first track that was free by start_ns (when
+// its first span started, so spans on a track never overlap), naming the
+// track the first time it is used. Track 1 is the main thread. Lock must be
+// held.
+uintptr_t trace_new_thread( uint64_t start_ns )
+{
+    uintptr_t track = 1;
+    
+    while ((track < TRACE_MAX_TRACKS - 1) &&
+           (trace_track_used[track] ||
+            (trace_track_free_ns[track] > start_ns)))
+    {
+        track++;
+    }
+    
+    trace_track_used[track] = true;
+    pthread_setspecific(trace_track_key, (void*) track);
+    
+    if (!trace_track_named[track])
+    {
+        fprintf(trace_fp, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+                          "\"pid\": 1, \"tid\": %u, \"args\": {\"name\": ",
+                (unsigned int) track);
+        
+        if (track == 1)
+        {
+            fprintf(trace_fp, "\"main\"");
+        }
+        else
+        {
+            fprintf(trace_fp, "\"worker %u\"", (unsigned int) track - 1);
+        }
+        
+        fprintf(trace_fp, "}}");
+        trace_track_named[track] = true;
+    }
+    
+    return track;
+}
+
+bool trace_open( const char* path, const char* process_name )
+{
+    trace_fp = fopen(path, "w");
+    
+    if (!trace_fp)
+    {
+        printf("Error creating file %s for trace.\n\n", path);
+        return false;
+    }
+    
+    trace_start_ns = explode_time_ns();
+    memset(trace_track_used, 0, sizeof(trace_track_used));
+    memset(trace_track_free_ns, 0, sizeof(trace_track_free_ns));
+    memset(trace_track_named, 0, sizeof(trace_track_named));
+    pthread_key_create(&trace_track_key, trace_thread_exit);
+    
+    fprintf(trace_fp, "{\"traceEvents\": [\n");
+    fprintf(trace_fp, "{\"name\": \"process_name\", \"ph\": \"M\", "
+                      "\"pid\": 1, \"args\": {\"name\": ");
+    trace_write_string(trace_fp, process_name);
+    fprintf(trace_fp, "}}");
+    
+    // Main thread gets the first track, even if a worker records first.
+    trace_new_thread(trace_start_ns);
+    
+    return true;
+}
+
+void trace_close( void )
+{
+    if (!trace_fp)
+    {
+        return;
+    }
+    
+    fprintf(trace_fp, "\n],\n\"displayTimeUnit\": \"ms\"}\n");
+    
+    if (ferror(trace_fp))
+    {
+        printf("Error: file error while writing trace.\n");
+    }
+    
+    fclose(trace_fp);
+    trace_fp = NULL;
+    
+    pthread_setspecific(trace_track_key, NULL);
+    pthread_key_delete(trace_track_key);
+}
+
+void trace_span( const char* name,
+                 const char* category,
+                 uint64_t start_ns,
+                 unsigned long bytes_in,
+                 unsigned long bytes_out )
+{
+    uint64_t stop_ns = explode_time_ns();
+    uintptr_t track;
+    
+    if (!trace_fp)
+    {
+        return;
+    }
+    
+    if (start_ns < trace_start_ns)
+    {
+        start_ns = trace_start_ns;
+    }
+    if (stop_ns < start_ns)
+    {
+        stop_ns = start_ns;
+    }
+    
+    pthread_mutex_lock(&trace_lock);
+    
+    track = (uintptr_t) pthread_getspecific(trace_track_key);
+    
+    if (track == 0)
+    {
+        track = trace_new_thread(start_ns);
+    }
+    
+    // Complete event, times in microseconds.
+    fprintf(trace_fp, ",\n{\"name\": ");
+    trace_write_string(trace_fp, name);
+    fprintf(trace_fp, ", \"cat\": ");
+    trace_write_string(trace_fp, category);
+    fprintf(trace_fp, ", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                      "\"pid\": 1, \"tid\": %u, ",
+            (start_ns - trace_start_ns) / 1e3,
+            (stop_ns - start_ns) / 1e3,
+            (unsigned int) track);
+    fprintf(trace_fp, "\"args\": {\"bytes_in\": %lu, \"bytes_out\": %lu}}",
+            bytes_in, bytes_out);
+    
+    pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,41 @@
+//
+//  trace_lfg.h
+//  LFGDump
+//
+//  Trace of where the time goes (LFGDump and LFGMake --trace), written as
+//  Chrome trace events (JSON) for chrome://tracing or ui.perfetto.dev. Each
+//  span is a complete event on the track of the thread that ran it, with
+//  the bytes it took in and put out as arguments.
+
+#ifndef trace_lfg_h
+#define trace_lfg_h
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Start writing a trace to path, for a process named process_name. The
+   calling thread is shown as the main thread. Returns false if the file
+   can't be created.
+*/
+bool trace_open( const char* path, const char* process_name );
+
+/* Finish the trace and close the file. Any worker threads must be done. */
+void trace_close( void );
+
+/* Record a span that started at start_ns (CLOCK_MONOTONIC, as returned by
+   explode_time_ns() and implode_time_ns()) and ends now. Does nothing if no
+   trace is open. Safe to call from any thread.
+*/
+void trace_span( const char* name,
+                 const char* category,
+                 uint64_t start_ns,
+                 unsigned long bytes_in,
+                 unsigned long bytes_out );
+
+/* Write text to fp as a JSON string. Bytes outside printable ASCII (old
+   archive names may hold any) are escaped as Latin-1 characters.
+*/
+void trace_write_string( FILE* fp, const char* text );
+
+#endif /* trace_lfg_h */
@@ -11,14 +11,34 @@
 
 #include "implode.h"
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define MIN(x,y)  ((x)<(y))?(x):(y)    
     // Minimum of 2 values
 
+#define MAX(x,y)  ((x)>(y))?(x):(y)
+    // Maximum of 2 values
+
 #define ENCODE_BUFF_SIZE         0x2000
     // Buffer for the file to encode.  Must be larger than dictionary and have
     // at least 518 bytes of future data (1K works).
     // Maximum dictionary size is 4K (0x1000); here, 8K is used.
+    // Must be a power of two (positions wrap with a mask).
+
+#define ENCODE_BUFF_MIRROR_SIZE  0x208
+    // The first bytes of the buffer are mirrored past its end so that any
+    // sequence of up to 520 bytes starting in the buffer is contiguous in
+    // memory. Must be at least the maximum match length (518).
 
 #define ENCODE_BUFF_MASK         0x1800
     // Masked MSBs of the encoder buffer are used to determine when
@@ -38,7 +58,7 @@
     // Minimum offset to use for encoding.
     // DCL appears to have used 1.
 
-#define ENCODE_MAX_OFFSET ( dictionary_size_bytes )
+#define ENCODE_MAX_OFFSET ( state->dictionary_size_bytes )
     // Maximum offset to use for encoding.  Maximum possible is the
     // dictionary size.
     // DCL appears to have used the dictionary size - 2.
@@ -48,21 +68,93 @@
     // Maximum length to use for encoding.  Max possible is 518.
     // DCL appears to have used 516.
 
-unsigned char encoding_buffer[ENCODE_BUFF_SIZE];
-//unsigned int encode_index;
-unsigned int dictionary_size_bytes;  // 0x1000, 0x800, 0x400 for 4k, 2k, 1k
-unsigned int dictionary_size_bits;   // 4,5, or 6
-unsigned long bytes_encoded;
-unsigned long bytes_length;
-implode_literal_type literal_mode = IMPLODE_BINARY;
+#define PROBE_SIZE               0x800
+    // Binary mode input is checked for anything worth matching this many
+    // bytes at a time. Must not be more than ENCODE_BUFF_LOAD_SIZE (all of
+    // a stretch has to be loaded).
+
+#define PROBE_SPACING            32
+    // One position in this many is searched when probing.
+
+#define LITERAL_PACK_SIZE        0x200
+    // Literals packed at a time by write_binary_literals (multiple of 8).
+
+#define EMIT_SAMPLE_BITS         6
+    // One token in 2^this is timed as it is written, to estimate the time
+    // spent emitting bits. Which ones is scattered by hashing the token
+    // count, so the sample doesn't fall in step with the data.
+
+#define SAMPLE_HASH              0x9E3779B9u
+    // Multiplier for the hash (2^32 divided by the golden ratio).
+
+// -- PHASE TIMING --
+
+uint64_t implode_time_ns( void )
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Time taken by a pair of implode_time_ns() calls themselves, taken off
+// each timed sample.
+uint64_t implode_timer_overhead_ns = 0;
+
+pthread_once_t implode_timer_overhead_once = PTHREAD_ONCE_INIT;
+
+void implode_timer_overhead_measure( void )
+{
+    uint64_t least = ~0ULL;
+    
+    for (int i = 0; i < 32; i++)
+    {
+        uint64_t start = implode_time_ns();
+        uint64_t elapsed = implode_time_ns() - start;
+        
+        if (elapsed < least)
+        {
+            least = elapsed;
+        }
+    }
+    
+    implode_timer_overhead_ns = least;
+}
+
+void (*implode_trace_hook)( const char* name,
+                            const char* category,
+                            uint64_t start_ns,
+                            unsigned long bytes_in,
+                            unsigned long bytes_out ) = NULL;
 
+// Pass a span to the trace hook, if there is one.
+void implode_trace( const char* name,
+                    const char* category,
+                    uint64_t start_ns,
+                    unsigned long bytes_in,
+                    unsigned long bytes_out )
+{
+    if (implode_trace_hook)
+    {
+        implode_trace_hook(name, category, start_ns, bytes_in, bytes_out);
+    }
+}
 
 // -- BIT WRITE ROUTINES --
+
+#define WRITE_BLOCK_SIZE    0x1000
+    // Completed bytes are collected in a block of this size before being
+    // written to the output file.
+
 typedef struct {
     
     // Output file pointer. (Could be replaced by access function.)
     FILE* file_pointer;
     
+    // Output memory buffer, used instead of the file pointer when set.
+    implode_buffer_type* buffer;
+    
     // Signals a write error
     int error_flag;
     
@@ -72,102 +164,322 @@ typedef struct {
     
     FILE* (*max_reached)( FILE* , unsigned long*);
     
+    // Time spent writing to the file, and in max_reached(), in ns.
+    uint64_t write_ns;
+    uint64_t switch_ns;
+    
+    // Bit accumulator. Bits are added above the bit_count bits already held
+    // and leave from the bottom, 32 at a time.
+    uint64_t bit_buffer;
+    unsigned int bit_count;
+    
+    // Completed bytes not yet written out.
+    unsigned int block_position;
+    unsigned char block[WRITE_BLOCK_SIZE];
+    
 } write_bitstream_type;
 
-write_bitstream_type write_bitstream;
+// Everything needed for one implode operation. Each operation has its own
+// state, so several can run at once on different threads.
+typedef struct {
+    
+    // Input file pointer, NULL when imploding from memory.
+    FILE* in_file;
+    
+    // Data being encoded. For file input this is the encoding buffer, for
+    // memory input it is the whole input. Positions in it are wrapped
+    // with window_mask.
+    const unsigned char* window;
+    unsigned int window_mask;
+    
+    unsigned int dictionary_size_bytes;  // 0x1000, 0x800, 0x400 for 4k, 2k, 1k
+    unsigned int dictionary_size_bits;   // 4,5, or 6
+    unsigned long bytes_encoded;
+    unsigned long bytes_length;
+    implode_literal_type literal_mode;
+    
+    // Earliest position matches may refer back to (memory input only).
+    unsigned long history_start;
+    
+    // A chunk of a larger stream may leave out the header or end marker.
+    bool write_header;
+    bool write_end;
+    
+    // Exact length of the output in bits, before padding to a byte.
+    unsigned long bit_length;
+    
+    // Match finding results for every input position, used instead of
+    // searching when set (memory input only).
+    const implode_match_type* matches;
+    
+    write_bitstream_type write_bitstream;
+    
+    // Phase timing: time spent reading file input and writing runs of
+    // literals, and the sample of other tokens timed as they were written.
+    uint64_t read_ns;
+    uint64_t emit_ns;
+    uint64_t emit_sample_ns;
+    unsigned long emit_samples;
+    unsigned long token_count;
+    
+    // Buffer for file input.
+    unsigned char encoding_buffer[ENCODE_BUFF_SIZE + ENCODE_BUFF_MIRROR_SIZE];
+    
+} implode_state_type;
 
-void ffputc( unsigned char val )
+// Append bytes to a memory buffer, growing it as needed.
+bool append_to_buffer( implode_buffer_type* buffer,
+                       const unsigned char* data,
+                       unsigned long count )
 {
-    if (write_bitstream.file_pointer)
+    if (buffer->length + count > buffer->size)
     {
-        fputc(val, write_bitstream.file_pointer);
+        unsigned long new_size = buffer->size ? buffer->size * 2 : 0x10000;
+        unsigned char* new_data;
+        
+        while (new_size < buffer->length + count)
+        {
+            new_size *= 2;
+        }
         
-        // Check if error is reported.
-        if (ferror(write_bitstream.file_pointer)) {
-            printf("Error: file error.\n");
-            write_bitstream.error_flag = true;
+        new_data = realloc(buffer->data, new_size);
+        
+        if (!new_data)
+        {
+            return false;
         }
+        
+        buffer->data = new_data;
+        buffer->size = new_size;
     }
     
-    write_bitstream.bytes_written++;
+    memcpy(&buffer->data[buffer->length], data, count);
+    buffer->length += count;
+    
+    return true;
+}
 
-    if ((write_bitstream.max_length) && (write_bitstream.file_pointer))
+// Write out bytes. If the output reaches max_length, the data is split
+// there and max_reached() is called to switch to the next file before
+// writing the rest.
+void write_block( write_bitstream_type* write_bitstream,
+                  const unsigned char* data,
+                  unsigned long count )
+{
+    while (count)
     {
-        if (write_bitstream.bytes_written>=*write_bitstream.max_length)
+        unsigned long chunk = count;
+        bool split = false;
+        
+        if ((write_bitstream->max_length) && (write_bitstream->max_reached) &&
+            (write_bitstream->file_pointer))
+        {
+            // Bytes left before the limit. At least one byte is always
+            // written before checking again.
+            unsigned long to_limit = 1;
+            
+            if (*write_bitstream->max_length > write_bitstream->bytes_written)
+            {
+                to_limit = *write_bitstream->max_length -
+                           write_bitstream->bytes_written;
+            }
+            
+            if (to_limit <= chunk)
+            {
+                chunk = to_limit;
+                split = true;
+            }
+        }
+        
+        if (write_bitstream->buffer)
+        {
+            // Count only what the buffer holds. Nothing is added after a
+            // failure, as it would leave a gap.
+            if (write_bitstream->error_flag ||
+                !append_to_buffer(write_bitstream->buffer, data, chunk))
+            {
+                if (!write_bitstream->error_flag)
+                {
+                    printf("Error: out of memory.\n");
+                    write_bitstream->error_flag = true;
+                }
+                break;
+            }
+        }
+        else if (write_bitstream->file_pointer)
         {
-            if (write_bitstream.max_reached)
+            uint64_t start = implode_time_ns();
+            
+            fwrite(data, sizeof data[0], chunk, write_bitstream->file_pointer);
+            
+            // Check if error is reported.
+            if (ferror(write_bitstream->file_pointer) &&
+                !write_bitstream->error_flag)
             {
-                write_bitstream.file_pointer =
-                    write_bitstream.max_reached( write_bitstream.file_pointer,
-                                                 write_bitstream.max_length );
-                *write_bitstream.max_length+=write_bitstream.bytes_written;
+                printf("Error: file error.\n");
+                write_bitstream->error_flag = true;
             }
+            
+            write_bitstream->write_ns += implode_time_ns() - start;
+            
+            implode_trace("flush", "io", start, 0, chunk);
+        }
+        
+        write_bitstream->bytes_written += chunk;
+        
+        if (split)
+        {
+            uint64_t start = implode_time_ns();
+            
+            write_bitstream->file_pointer =
+                write_bitstream->max_reached( write_bitstream->file_pointer,
+                                             write_bitstream->max_length );
+            *write_bitstream->max_length+=write_bitstream->bytes_written;
+            
+            write_bitstream->switch_ns += implode_time_ns() - start;
         }
+        
+        data += chunk;
+        count -= chunk;
     }
 }
 
-
-/* Bit write functions and supporting structures */
-struct {
-    // The current byte that is being built.
-    unsigned char byte_value;
+// Write out the bytes collected in the block.
+void write_flush_block( write_bitstream_type* write_bitstream )
+{
+    write_block(write_bitstream,
+                write_bitstream->block,
+                write_bitstream->block_position);
     
-    // Bit position in current byte for the next bit to be written.
-    int bit_position;
-} write_bits;
+    write_bitstream->block_position = 0;
+}
 
-// Write a single bit.
-void write_next_bit( unsigned int bit )
+// Write some bits, lsb first.
+// Max bit_count is 32. Bits above bit_count must be zero.
+void write_bits_lsb_first( write_bitstream_type* write_bitstream,
+                           unsigned int bit_count,
+                           unsigned int bits)
 {
+    write_bitstream->bit_buffer |= (uint64_t) bits << write_bitstream->bit_count;
+    write_bitstream->bit_count += bit_count;
     
-    write_bits.byte_value |=
-        (bit & 0x1) << write_bits.bit_position;
-
-    if (write_bits.bit_position == 7)
+    // Move a whole word to the block once there is one.
+    if (write_bitstream->bit_count >= 32)
     {
-        ffputc(write_bits.byte_value);
+        unsigned char *next =
+            &write_bitstream->block[write_bitstream->block_position];
         
-        write_bits.byte_value = 0;
+        next[0] = (unsigned char) write_bitstream->bit_buffer;
+        next[1] = (unsigned char)(write_bitstream->bit_buffer >> 8);
+        next[2] = (unsigned char)(write_bitstream->bit_buffer >> 16);
+        next[3] = (unsigned char)(write_bitstream->bit_buffer >> 24);
+        
+        write_bitstream->bit_buffer >>= 32;
+        write_bitstream->bit_count -= 32;
+        write_bitstream->block_position += 4;
+        
+        if (write_bitstream->block_position == WRITE_BLOCK_SIZE)
+        {
+            write_flush_block(write_bitstream);
+        }
     }
-    
-    write_bits.bit_position++;
-    write_bits.bit_position%=8;
 }
 
-// Flush remaining bits to next byte.
-void write_flush( void )
+// Flush remaining bits (zero padded to the next byte) and write out the
+// block.
+void write_flush( write_bitstream_type* write_bitstream )
 {
-    int j = (8-write_bits.bit_position) % 8;
-    int i;
-    
-    for (i=0; i<j; i++){
-        write_next_bit(0);
+    while (write_bitstream->bit_count > 0)
+    {
+        write_bitstream->block[write_bitstream->block_position++] =
+            (unsigned char) write_bitstream->bit_buffer;
+        
+        if (write_bitstream->block_position == WRITE_BLOCK_SIZE)
+        {
+            write_flush_block(write_bitstream);
+        }
+        
+        write_bitstream->bit_buffer >>= 8;
+        write_bitstream->bit_count =
+            (write_bitstream->bit_count > 8) ? write_bitstream->bit_count - 8 : 0;
     }
+    
+    write_flush_block(write_bitstream);
 }
 
-// Write some bits, msb first.
-// Max bit_count is (sizeof(int)/8). No error checking performed.
-void write_bits_msb_first( unsigned int bit_count,
-                           unsigned int bits)
+// Write bit_length bits taken lsb first from data, continuing from
+// wherever the bitstream is (not necessarily on a byte boundary).
+void write_bits_from_buffer( write_bitstream_type* write_bitstream,
+                             const unsigned char* data,
+                             unsigned long bit_length )
 {
-    int i;
+    // Three bytes at a time keeps within the 32 bit limit.
+    while (bit_length >= 24)
+    {
+        write_bits_lsb_first(write_bitstream, 24,
+                             data[0] | (data[1] << 8) | (data[2] << 16));
+        data += 3;
+        bit_length -= 24;
+    }
+    
+    while (bit_length >= 8)
+    {
+        write_bits_lsb_first(write_bitstream, 8, data[0]);
+        data++;
+        bit_length -= 8;
+    }
     
-    for (i=bit_count-1; i>=0;i--)
+    if (bit_length)
     {
-        write_next_bit((bits >> i) & 1);
+        write_bits_lsb_first(write_bitstream, (unsigned int) bit_length,
+                             data[0] & ((1 << bit_length) - 1));
     }
 }
 
-// Write some bits, lsb first.
-// Max bit_count is (sizeof(int)/8). No error checking is performed.
-void write_bits_lsb_first( unsigned int bit_count,
-                           unsigned int bits)
+
+// Write a run of binary mode literals. Each is a zero flag bit followed by
+// the byte, so 8 literals make exactly 9 bytes; they are packed 8 at a
+// time and written out in bulk.
+void write_binary_literals( write_bitstream_type* write_bitstream,
+                            const unsigned char* data,
+                            unsigned long count )
 {
-    int i;
+    unsigned char packed[LITERAL_PACK_SIZE / 8 * 9];
+    
+    while (count >= 8)
+    {
+        unsigned long groups = MIN(count / 8, LITERAL_PACK_SIZE / 8);
+        
+        for (unsigned long g = 0; g < groups; g++)
+        {
+            const unsigned char* in = &data[g * 8];
+            unsigned char* out = &packed[g * 9];
+            uint64_t bits = 0;
+            
+            // First 7 literals fill bits 0-62 (bit 0 of each is the flag).
+            for (int i = 0; i < 7; i++)
+            {
+                bits |= (uint64_t) in[i] << (9 * i + 1);
+            }
+            
+            for (int i = 0; i < 8; i++)
+            {
+                out[i] = (unsigned char)(bits >> (8 * i));
+            }
+            
+            // Last literal's flag is bit 63 (zero), its byte all of byte 8.
+            out[8] = in[7];
+        }
+        
+        write_bits_from_buffer(write_bitstream, packed, groups * 72);
+        
+        data += groups * 8;
+        count -= groups * 8;
+    }
     
-    for (i=0; i<bit_count;i++)
+    while (count--)
     {
-        write_next_bit((bits >> i) & 1);
+        write_bits_lsb_first(write_bitstream, 9, *data++ << 1);
     }
 }
 
@@ -266,41 +578,6 @@ void find_literal_codes(unsigned int literal,
 }
 
 
-void write_literal( unsigned int literal_val )
-{
-    unsigned int literal_bits;
-    unsigned int literal_code;
-    
-    write_next_bit(0);
-    
-    if( literal_mode == IMPLODE_BINARY )
-    {
-        write_bits_lsb_first(8, literal_val);
-    }
-    else
-    {
-        find_literal_codes(literal_val, &literal_bits, &literal_code);
-        write_bits_msb_first(literal_bits, literal_code);
-    }
-};
-
-int length_literal( unsigned int literal_val )
-{
-    unsigned int literal_bits;
-    unsigned int literal_code;
-    
-    if( literal_mode == IMPLODE_BINARY )
-    {
-        literal_bits = 8;
-    }
-    else
-    {
-        find_literal_codes(literal_val, &literal_bits, &literal_code);
-    }
-    
-    return literal_bits+1;
-};
-
 // --- Routines for finding length and offset ---
 
 // Lookup table for coverting dictionary offset to bit codes.
@@ -379,139 +656,298 @@ void find_length_codes(unsigned int length,
     *length_lsb_value = length - length_table[i].lookup_min;
 }
 
+// --- Pre-packed code tables ---
+
+// A code with its bits in the order they go to the bitstream (first bit in
+// the lsb), so it can be written with a single lsb-first write.
+typedef struct {
+    unsigned int bits;
+    unsigned int count;
+} packed_code_type;
+
+#define LENGTH_CODE_TABLE_SIZE  520     // Lengths 2-518 and end marker (519).
+#define OFFSET_CODE_TABLE_SIZE  64      // High part of offset is 6 bits max.
+
+// Literal codes, including the 0 flag bit. Indexed by literal mode and value.
+packed_code_type literal_code_table[2][256];
+
+// Length codes, including the 1 flag bit and the lsb (extra) bits.
+packed_code_type length_code_table[LENGTH_CODE_TABLE_SIZE];
+
+// Codes for the high part of the offset (offset without its low bits).
+packed_code_type offset_code_table[OFFSET_CODE_TABLE_SIZE];
+
+pthread_once_t code_tables_once = PTHREAD_ONCE_INIT;
+
+// Reverse the order of the low bit_count bits, turning a code that is
+// written msb first into one that can be written lsb first.
+unsigned int reverse_bits( unsigned int bit_count,
+                           unsigned int bits )
+{
+    unsigned int result = 0;
+    unsigned int i;
+    
+    for (i = 0; i < bit_count; i++)
+    {
+        result = (result << 1) | ((bits >> i) & 1);
+    }
+    
+    return result;
+}
+
+// Fill in the code tables from the search tables above. Only needs to be
+// done once (see code_tables_init).
+void code_tables_build( void )
+{
+    unsigned int i;
+    unsigned int bit_count, code, lsb_count, lsb_value;
+    
+    literal_init();
+    
+    for (i = 0; i < 256; i++)
+    {
+        literal_code_table[IMPLODE_BINARY][i].bits = i << 1;
+        literal_code_table[IMPLODE_BINARY][i].count = 9;
+        
+        find_literal_codes(i, &bit_count, &code);
+        literal_code_table[IMPLODE_ASCII][i].bits =
+            reverse_bits(bit_count, code) << 1;
+        literal_code_table[IMPLODE_ASCII][i].count = bit_count + 1;
+    }
+    
+    for (i = 2; i < LENGTH_CODE_TABLE_SIZE; i++)
+    {
+        find_length_codes(i, &bit_count, &code, &lsb_count, &lsb_value);
+        length_code_table[i].bits = 1 |
+                                    (reverse_bits(bit_count, code) << 1) |
+                                    (lsb_value << (bit_count + 1));
+        length_code_table[i].count = 1 + bit_count + lsb_count;
+    }
+    
+    for (i = 0; i < OFFSET_CODE_TABLE_SIZE; i++)
+    {
+        find_offset_codes(i, &bit_count, &code);
+        offset_code_table[i].bits = reverse_bits(bit_count, code);
+        offset_code_table[i].count = bit_count;
+    }
+}
+
+// Safe to call from several threads.
+void code_tables_init( void )
+{
+    pthread_once(&code_tables_once, code_tables_build);
+    pthread_once(&implode_timer_overhead_once,
+                 implode_timer_overhead_measure);
+}
+
+void write_literal( implode_state_type* state, unsigned int literal_val )
+{
+    packed_code_type code =
+        literal_code_table[state->literal_mode][literal_val];
+    
+    write_bits_lsb_first(&state->write_bitstream, code.count, code.bits);
+}
+
+int length_literal( implode_state_type* state, unsigned int literal_val )
+{
+    return literal_code_table[state->literal_mode][literal_val].count;
+}
+
 // Find offset bits, length bits and write to file.
-void write_dictionary_entry( int offset, int length )
+void write_dictionary_entry( implode_state_type* state,
+                             int offset,
+                             int length )
 {
     unsigned int low_offset_bits;
-    unsigned int high_offset_bits;
-    unsigned int offset_msb_code;
-    unsigned int length_bits;
-    unsigned int length_code;
-    unsigned int length_lsb_bits;
-    unsigned int length_lsb_value;
+    packed_code_type length_code;
+    packed_code_type offset_code;
     
     if (length!= 2)
     {
-        low_offset_bits = dictionary_size_bits;
+        low_offset_bits = state->dictionary_size_bits;
     }
     else
     {
         low_offset_bits = 2;
     }
-   
-    find_length_codes(length,
-                      &length_bits,
-                      &length_code,
-                      &length_lsb_bits,
-                      &length_lsb_value);
-
-    write_next_bit(1);
-    write_bits_msb_first( length_bits, length_code);
-    write_bits_lsb_first( length_lsb_bits, length_lsb_value);
     
-    find_offset_codes(offset>>low_offset_bits,
-                      &high_offset_bits,
-                      &offset_msb_code);
+    length_code = length_code_table[length];
+    offset_code = offset_code_table[offset >> low_offset_bits];
     
-    write_bits_msb_first( high_offset_bits, offset_msb_code);
-    write_bits_lsb_first( low_offset_bits, offset);
+    // Flag, length code and length lsbs; then offset code and offset lsbs.
+    write_bits_lsb_first(&state->write_bitstream,
+                         length_code.count, length_code.bits);
+    write_bits_lsb_first(&state->write_bitstream,
+                         offset_code.count + low_offset_bits,
+                         offset_code.bits |
+                         ((offset & ((1 << low_offset_bits) - 1)) <<
+                          offset_code.count));
 }
 
 // Find the bit length of a offset, length pair without writing it.
-int length_dictionary_entry( int offset, int length)
+int length_dictionary_entry( implode_state_type* state,
+                             int offset,
+                             int length )
 {
     unsigned int low_offset_bits;
-    unsigned int high_offset_bits;
-    unsigned int offset_msb_code;
-    unsigned int length_bits;
-    unsigned int length_code;
-    unsigned int length_lsb_bits;
-    unsigned int length_lsb_value;
-    
-    int bit_length = 1;
     
     if (length != 2)
     {
-        low_offset_bits = dictionary_size_bits;
+        low_offset_bits = state->dictionary_size_bits;
     }
     else
     {
         low_offset_bits = 2;
     }
     
-    bit_length+=low_offset_bits;
-    
-    find_length_codes(length,
-                      &length_bits,
-                      &length_code,
-                      &length_lsb_bits,
-                      &length_lsb_value);
-    
-    bit_length += length_bits + length_lsb_bits;    
-    
-    find_offset_codes(offset>>low_offset_bits,
-                      &high_offset_bits,
-                      &offset_msb_code);
-    
-    bit_length += high_offset_bits;
-    
-    return bit_length;
+    return length_code_table[length].count +
+           offset_code_table[offset >> low_offset_bits].count +
+           low_offset_bits;
+}
+
+
+// Copy the start of the encoding buffer to the mirror area past its end.
+// Needs to be done whenever data is loaded at the start of the buffer.
+void update_buffer_mirror( unsigned char * buffer )
+{
+    memcpy(&buffer[ENCODE_BUFF_SIZE], buffer, ENCODE_BUFF_MIRROR_SIZE);
 }
 
+#if defined(__GNUC__)
+#define COUNT_TRAILING_ZEROS(x)     __builtin_ctz(x)
+#define COUNT_TRAILING_ZEROS_64(x)  __builtin_ctzll(x)
+#endif
 
 // Check dictionary for a byte sequence match at a particular position.
 // Target sequence is already in buffer (as those are the bytes being encoded).
-// Takes the buffer (bytes), two positions within the buffer,
-// the max length of the byte sequence to compare, and
-// the circular buffer size.
-int compare_in_circular( unsigned char * buffer,
-                         unsigned int position1,
-                         unsigned int position2,
-                         long max_length,
-                         long circular_buffer_size)
+// Takes the two byte sequences to compare and the max length to compare.
+// Both sequences must be readable for max_length bytes.  Returns the number
+// of leading bytes that match.
+int compare_sequences( const unsigned char * sequence1,
+                       const unsigned char * sequence2,
+                       long max_length )
 {
-    int i = 0;
+    long i = 0;
     
-    do
+#if defined(COUNT_TRAILING_ZEROS)
+#if defined(__AVX2__)
+    // 32 bytes at a time. Mask bits are set for bytes that differ.
+    for (; i + 32 <= max_length; i += 32)
     {
-        position1 %= circular_buffer_size;
-        position2 %= circular_buffer_size;
+        __m256i a = _mm256_loadu_si256((const __m256i *) &sequence1[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i *) &sequence2[i]);
+        unsigned int mask =
+            ~(unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
         
-        if (buffer[position1] != buffer[position2])
+        if (mask)
         {
-            break;
+            return (int)(i + COUNT_TRAILING_ZEROS(mask));
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    // 16 bytes at a time.
+    for (; i + 16 <= max_length; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *) &sequence1[i]);
+        __m128i b = _mm_loadu_si128((const __m128i *) &sequence2[i]);
+        unsigned int mask =
+            ~(unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & 0xFFFF;
+        
+        if (mask)
+        {
+            return (int)(i + COUNT_TRAILING_ZEROS(mask));
         }
+    }
+#endif
+#if (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    // Portable version, 8 bytes at a time. First differing byte is the
+    // lowest set byte of the xor.
+    for (; i + 8 <= max_length; i += 8)
+    {
+        uint64_t a, b;
+        
+        memcpy(&a, &sequence1[i], sizeof a);
+        memcpy(&b, &sequence2[i], sizeof b);
         
-        position1++;
-        position2++;
-        i++;
-    } while (i<max_length);
+        if (a != b)
+        {
+            return (int)(i + (COUNT_TRAILING_ZEROS_64(a ^ b) >> 3));
+        }
+    }
+#endif
+#endif
+    
+    // Remaining bytes one at a time.
+    for (; i < max_length; i++)
+    {
+        if (sequence1[i] != sequence2[i])
+        {
+            break;
+        }
+    }
     
-    return i;
+    return (int) i;
 }
 
 
-// Look in dictionary for sequence
+// Look in the last search_size bytes before the sequence starting ahead
+// bytes past the current position.
 // TRUE if sequence is found
-bool check_dictionary( unsigned int* length,           // length found
-                       unsigned int* offset,           // offset found
-                       unsigned char *encoding_buffer, // dictionary
-                       unsigned int encoding_index)    // start index
+bool search_dictionary( implode_state_type* state,
+                        unsigned int* length,          // length found
+                        unsigned int* offset,          // offset found
+                        unsigned int encoding_index,   // current index
+                        unsigned int ahead,            // bytes past current
+                        long search_size)              // bytes to search
 {
     bool match_found = false;
-    long search_size = MIN(ENCODE_MAX_OFFSET, bytes_encoded);
+    unsigned long position = state->bytes_encoded + ahead;
+    unsigned int sequence_index = (encoding_index + ahead) & state->window_mask;
     unsigned int offset_val = 0;
     int final_length = 1;
     int length_now;
-    long max_length = MIN(bytes_length - bytes_encoded, ENCODE_MAX_LENGTH);
+    long max_length = MIN(state->bytes_length - position, ENCODE_MAX_LENGTH);
+    
+    // Use the results of an earlier search if there are any. That search
+    // reached back from the position checked, so its match may be too far
+    // back when looking ahead; search again in that case.
+    if (state->matches)
+    {
+        const implode_match_type* match = &state->matches[position];
+        int size_index = state->dictionary_size_bits - IMPLODE_1K_DICTIONARY;
+        
+        if (match->offset[size_index] < search_size)
+        {
+            final_length = match->length[size_index];
+            offset_val = match->offset[size_index];
+            match_found = (final_length > 1);
+            search_size = 0;
+        }
+    }
     
     for (int i=(ENCODE_MIN_OFFSET+1); i<=search_size; i++)
     {
-        length_now = compare_in_circular( encoding_buffer,
-                                          encoding_index,
-                                          encoding_index-i,
-                                          max_length,
-                                          ENCODE_BUFF_SIZE );
+        // Sequences in the window are contiguous (for the encoding buffer,
+        // thanks to the mirror), only the start needs to wrap.
+        const unsigned char* sequence = &state->window[sequence_index];
+        const unsigned char* candidate =
+            &state->window[(sequence_index-i) & state->window_mask];
+        
+        // Nothing longer is possible, and a later offset can't win a tie.
+        if (final_length >= max_length)
+        {
+            break;
+        }
+        
+        // Can only beat the best so far if the byte just past its length
+        // matches too.
+        if (candidate[final_length] != sequence[final_length])
+        {
+            continue;
+        }
+        
+        length_now = compare_sequences( sequence, candidate, max_length );
         
         // If the found length is greater than the length found so far,
         // update length, remember the offset, continue looking.
@@ -538,35 +974,360 @@ bool check_dictionary( unsigned int* length,           // length found
     return match_found;
 }
 
-unsigned long implode(FILE * in_file,
-                      FILE * out_file,
-                      unsigned long length,
-                      implode_literal_type literal_encode_mode,
-                      implode_dictionary_size_type dictionary_size,
-                      unsigned int optimization_level,
-                      implode_stats_type* implode_stats,
-                      unsigned long *max_length,
-                      FILE* (*max_reached)(FILE* , unsigned long*) )
+// Look in dictionary for the sequence starting ahead bytes past the
+// current position. Offsets only reach back as far as the current
+// position, even when looking ahead.
+// TRUE if sequence is found
+bool check_dictionary( implode_state_type* state,
+                       unsigned int* length,           // length found
+                       unsigned int* offset,           // offset found
+                       unsigned int encoding_index,    // current index
+                       unsigned int ahead)             // bytes past current
 {
-    unsigned int encode_length = 0;
-    long bytes_loaded;
-    int optimize_type = optimization_level;
-    unsigned int next_load_point = 0;
-    unsigned int encode_index = 0;
-    literal_mode = literal_encode_mode;
-    //encode_index = 0;
-    bytes_encoded = 0;
-    bytes_length = length;
-
-    // Init bitstream data
-    write_bitstream.bytes_written = 0;
-    write_bitstream.max_length = max_length;
-    write_bitstream.max_reached = max_reached;
-    write_bitstream.file_pointer = out_file;
+    return search_dictionary(state, length, offset, encoding_index, ahead,
+                             MIN(ENCODE_MAX_OFFSET, state->bytes_encoded -
+                                                    state->history_start));
+}
 
+// Search a sample of the count positions from encoding_index for matches.
+// Returns false if matches look to save too little to be worth searching
+// for (less than about 2% of the bits the bytes take as literals).
+bool probe_for_matches( implode_state_type* state,
+                        unsigned int encoding_index,
+                        unsigned int count )
+{
+    unsigned long saving = 0;
+    
+    // Too little to go by.
+    if (count < PROBE_SIZE / 4)
+    {
+        return true;
+    }
+    
+    for (unsigned int ahead = 0; ahead < count; ahead += PROBE_SPACING)
+    {
+        unsigned int length, offset;
+        
+        // Each sample may use everything before it.
+        long search_size = MIN(ENCODE_MAX_OFFSET, state->bytes_encoded +
+                               ahead - state->history_start);
+        
+        if (search_dictionary(state, &length, &offset, encoding_index, ahead,
+                              search_size))
+        {
+            int bits = 9 * length - length_dictionary_entry(state, offset,
+                                                            length);
+            
+            if (bits > 0)
+            {
+                saving += bits;
+            }
+        }
+    }
+    
+    // Each sample stands for PROBE_SPACING places a match could start.
+    return saving * PROBE_SPACING * 50 > count * 9;
+}
+
+// Find the longest match at each position in a range for all three
+// dictionary sizes at once.  Each search over the 4K dictionary passes the
+// 1K and 2K limits on the way, and gives the same result as
+// check_dictionary() would for that size.
+void find_matches_in_range( const unsigned char * in_data,
+                            unsigned long length,
+                            implode_match_type * matches,
+                            unsigned long start,
+                            unsigned long end )
+{
+    unsigned long position;
+    
+    for (position = start; position < end; position++)
+    {
+        long max_length = MIN(length - position, ENCODE_MAX_LENGTH);
+        int final_length = 1;
+        unsigned int offset_val = 0;
+        int size_index = 0;
+        unsigned int size_limit = 1 << (IMPLODE_1K_DICTIONARY + 6);
+        int i;
+        
+        for (i = 1; i <= 1 << (IMPLODE_4K_DICTIONARY + 6); i++)
+        {
+            int length_now;
+            
+            // Passed the end of a dictionary size, record its result.
+            if (i > size_limit)
+            {
+                matches[position].length[size_index] = final_length;
+                matches[position].offset[size_index] = offset_val;
+                size_index++;
+                size_limit <<= 1;
+            }
+            
+            if ((i > position) || (final_length >= max_length))
+            {
+                break;
+            }
+            
+            if (in_data[position - i + final_length] !=
+                in_data[position + final_length])
+            {
+                continue;
+            }
+            
+            length_now = compare_sequences( &in_data[position],
+                                            &in_data[position - i],
+                                            max_length );
+            
+            if (length_now > final_length)
+            {
+                final_length = length_now;
+                offset_val = i - 1;
+            }
+        }
+        
+        // Remaining sizes get the final result.
+        for (; size_index < 3; size_index++)
+        {
+            matches[position].length[size_index] = final_length;
+            matches[position].offset[size_index] = offset_val;
+        }
+    }
+}
+
+typedef struct {
+    const unsigned char * in_data;
+    unsigned long length;
+    implode_match_type * matches;
+    unsigned long start;
+    unsigned long end;
+} find_matches_job_type;
+
+void* find_matches_thread( void* job_ptr )
+{
+    find_matches_job_type* job = job_ptr;
+    uint64_t thread_start = implode_time_ns();
+    
+    find_matches_in_range(job->in_data, job->length, job->matches,
+                          job->start, job->end);
+    
+    implode_trace("find matches", "worker", thread_start,
+                  job->end - job->start, 0);
+    return NULL;
+}
+
+#define MAX_MATCH_THREADS  64
+
+bool implode_find_matches( const unsigned char * in_data,
+                           unsigned long length,
+                           implode_match_table_type * table,
+                           unsigned int thread_count )
+{
+    find_matches_job_type jobs[MAX_MATCH_THREADS];
+    pthread_t threads[MAX_MATCH_THREADS];
+    bool thread_started[MAX_MATCH_THREADS] = {0};
+    unsigned int i;
+    
+    // One extra entry for the end of the input (never a match).
+    table->matches = malloc((length + 1) * sizeof(implode_match_type));
+    table->length = length;
+    
+    if (!table->matches)
+    {
+        return false;
+    }
+    
+    table->matches[length] = (implode_match_type) {{1, 1, 1}, {0, 0, 0}};
+    
+    if (thread_count < 1)
+    {
+        thread_count = 1;
+    }
+    if (thread_count > MAX_MATCH_THREADS)
+    {
+        thread_count = MAX_MATCH_THREADS;
+    }
+    
+    // Split the positions evenly. Later positions search a full dictionary,
+    // the first few don't, but that only matters for tiny inputs.
+    for (i = 0; i < thread_count; i++)
+    {
+        jobs[i].in_data = in_data;
+        jobs[i].length = length;
+        jobs[i].matches = table->matches;
+        jobs[i].start = length * i / thread_count;
+        jobs[i].end = length * (i + 1) / thread_count;
+        
+        if (i > 0)
+        {
+            thread_started[i] = (pthread_create(&threads[i], NULL,
+                                                find_matches_thread,
+                                                &jobs[i]) == 0);
+        }
+    }
+    
+    // First range (and any that didn't get a thread) run here.
+    for (i = 0; i < thread_count; i++)
+    {
+        if (!thread_started[i])
+        {
+            find_matches_thread(&jobs[i]);
+        }
+    }
+    
+    for (i = 1; i < thread_count; i++)
+    {
+        if (thread_started[i])
+        {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    
+    return true;
+}
+
+void implode_match_table_free( implode_match_table_type * table )
+{
+    free(table->matches);
+    table->matches = NULL;
+    table->length = 0;
+}
+
+// Set up the state for a new implode operation. Input is either a file
+// (in_file) or memory (in_data); output is either a file (out_file), a
+// memory buffer (out_buffer) or neither (count only).
+void implode_state_init( implode_state_type* state,
+                         FILE * in_file,
+                         const unsigned char * in_data,
+                         FILE * out_file,
+                         implode_buffer_type * out_buffer,
+                         unsigned long length,
+                         implode_literal_type literal_encode_mode,
+                         implode_dictionary_size_type dictionary_size,
+                         unsigned long *max_length,
+                         FILE* (*max_reached)(FILE* , unsigned long*) )
+{
+    state->in_file = in_file;
+    
+    if (in_file)
+    {
+        state->window = state->encoding_buffer;
+        state->window_mask = ENCODE_BUFF_SIZE - 1;
+    }
+    else
+    {
+        state->window = in_data;
+        state->window_mask = 0xFFFFFFFF;
+    }
+    
+    state->literal_mode = literal_encode_mode;
+    state->matches = NULL;
+    state->bytes_encoded = 0;
+    state->bytes_length = length;
+    state->history_start = 0;
+    state->write_header = true;
+    state->write_end = true;
+    
     // range check dictionary
-    dictionary_size_bytes = 1 << (dictionary_size + 6);
-    dictionary_size_bits = dictionary_size;
+    state->dictionary_size_bytes = 1 << (dictionary_size + 6);
+    state->dictionary_size_bits = dictionary_size;
+    
+    // Init bitstream data
+    state->write_bitstream.bytes_written = 0;
+    state->write_bitstream.max_length = max_length;
+    state->write_bitstream.max_reached = max_reached;
+    state->write_bitstream.file_pointer = out_file;
+    state->write_bitstream.buffer = out_buffer;
+    state->write_bitstream.error_flag = false;
+    state->write_bitstream.bit_buffer = 0;
+    state->write_bitstream.bit_count = 0;
+    state->write_bitstream.block_position = 0;
+    state->write_bitstream.write_ns = 0;
+    state->write_bitstream.switch_ns = 0;
+    
+    state->read_ns = 0;
+    state->emit_ns = 0;
+    state->emit_sample_ns = 0;
+    state->emit_samples = 0;
+    state->token_count = 0;
+    
+    code_tables_init();
+}
+
+// Read the next stretch of file input into the encoding buffer.
+long implode_read( implode_state_type* state,
+                   unsigned int load_point )
+{
+    uint64_t start = implode_time_ns();
+    long bytes_loaded;
+    
+    bytes_loaded = fread(&state->encoding_buffer[load_point],
+                         sizeof state->encoding_buffer[0],
+                         ENCODE_BUFF_LOAD_SIZE,
+                         state->in_file);
+    
+    state->read_ns += implode_time_ns() - start;
+    
+    return bytes_loaded;
+}
+
+// Time spent emitting bits since start, less any writing to the file and
+// switching files (other_ns is what those had taken at start).
+uint64_t implode_emit_time( implode_state_type* state,
+                            uint64_t start,
+                            uint64_t other_ns )
+{
+    uint64_t elapsed = implode_time_ns() - start;
+    
+    other_ns = state->write_bitstream.write_ns +
+               state->write_bitstream.switch_ns - other_ns +
+               implode_timer_overhead_ns;
+    
+    return (elapsed > other_ns) ? elapsed - other_ns : 0;
+}
+
+// Fill in the phase times of an implode_run() that took run_ns.
+void implode_phase_times( implode_state_type* state,
+                          uint64_t run_ns,
+                          implode_stats_type* implode_stats )
+{
+    uint64_t* phase_ns = implode_stats->phase_ns;
+    uint64_t other_ns;
+    
+    memset(phase_ns, 0, sizeof(implode_stats->phase_ns));
+    
+    phase_ns[IMPLODE_PHASE_READ] = state->read_ns;
+    phase_ns[IMPLODE_PHASE_WRITE] = state->write_bitstream.write_ns;
+    phase_ns[IMPLODE_PHASE_SWITCH] = state->write_bitstream.switch_ns;
+    
+    phase_ns[IMPLODE_PHASE_EMIT] = state->emit_ns;
+    
+    if (state->emit_samples)
+    {
+        phase_ns[IMPLODE_PHASE_EMIT] +=
+            (uint64_t)((double) state->emit_sample_ns *
+                       state->token_count / state->emit_samples);
+    }
+    
+    // Searching is what is left once the rest is taken out.
+    other_ns = phase_ns[IMPLODE_PHASE_READ] + phase_ns[IMPLODE_PHASE_WRITE] +
+               phase_ns[IMPLODE_PHASE_SWITCH] + phase_ns[IMPLODE_PHASE_EMIT];
+    
+    phase_ns[IMPLODE_PHASE_SEARCH] =
+        (run_ns > other_ns) ? run_ns - other_ns : 0;
+}
+
+// Implode the input set up in the state. Returns number of bytes written.
+unsigned long implode_run( implode_state_type* state,
+                           unsigned int optimization_level,
+                           implode_stats_type* implode_stats )
+{
+    unsigned int encode_length = 0;
+    long bytes_loaded;
+    int optimize_type = optimization_level;
+    unsigned int next_load_point = ENCODE_BUFF_LOAD_DONE;
+    unsigned int encode_index = (unsigned int) state->bytes_encoded;
+    unsigned long next_probe = state->bytes_encoded;
+    uint64_t run_start = implode_time_ns();
     
     // Initialize statistics.
     if (implode_stats)
@@ -574,62 +1335,104 @@ unsigned long implode(FILE * in_file,
         implode_stats->literal_count = 0;
         implode_stats->lookup_count = 0;
         implode_stats->max_offset = 0;
-        implode_stats->min_offset = dictionary_size_bytes;
+        implode_stats->min_offset = state->dictionary_size_bytes;
         implode_stats->max_length = 0;
         implode_stats->min_length = 1024;
     }
     
-    literal_init();
-    
-    bytes_loaded = fread( encoding_buffer,
-                          sizeof encoding_buffer[0],
-                          ENCODE_BUFF_LOAD_SIZE,
-                          in_file);
-    
-    // File is shorter than our buffer. Mark no more loads.
-    if ( bytes_loaded != ENCODE_BUFF_LOAD_SIZE )
+    if (state->in_file)
     {
-        next_load_point = ENCODE_BUFF_LOAD_DONE;
+        bytes_loaded = implode_read(state, 0);
+        update_buffer_mirror(state->encoding_buffer);
+        
+        // File is shorter than our buffer. Mark no more loads.
+        if ( bytes_loaded != ENCODE_BUFF_LOAD_SIZE )
+        {
+            next_load_point = ENCODE_BUFF_LOAD_DONE;
+        }
+        else
+        {
+            next_load_point = 0;
+        }
     }
-    else
+    
+    if (state->write_header)
     {
-        next_load_point = 0;
+        write_bits_lsb_first(&state->write_bitstream, 8, state->literal_mode);
+        write_bits_lsb_first(&state->write_bitstream, 8,
+                             state->dictionary_size_bits);
     }
     
-    ffputc(literal_mode);
-    ffputc(dictionary_size_bits);
-    
     // While there are bytes to encode...
-    while (bytes_encoded < length)
+    while (state->bytes_encoded < state->bytes_length)
     {
         unsigned int offset;
         bool use_literal = true;
+        bool sampled;
+        uint64_t emit_start = 0;
+        uint64_t other_ns = 0;
 
         // Check if data should be loaded into buffer.
-        if ((encode_index & ENCODE_BUFF_MASK) ==
-            (next_load_point & ENCODE_BUFF_MASK))
+        if ((state->in_file) &&
+            ((encode_index & ENCODE_BUFF_MASK) ==
+             (next_load_point & ENCODE_BUFF_MASK)))
         {
             next_load_point+=ENCODE_BUFF_LOAD_SIZE;
             next_load_point%=ENCODE_BUFF_SIZE;
             
-            if (fread(&encoding_buffer[next_load_point],
-                      sizeof encoding_buffer[0],
-                      ENCODE_BUFF_LOAD_SIZE,
-                      in_file)
-                != ENCODE_BUFF_LOAD_SIZE)
+            bytes_loaded = implode_read(state, next_load_point);
+            
+            if (next_load_point == 0)
+            {
+                update_buffer_mirror(state->encoding_buffer);
+            }
+            
+            if (bytes_loaded != ENCODE_BUFF_LOAD_SIZE)
             {
                 // Hit end of file. Signal no more data reads.
                 next_load_point = ENCODE_BUFF_LOAD_DONE;
             }
         }
 
-        encode_index %= ENCODE_BUFF_SIZE;
+        encode_index &= state->window_mask;
+        
+        // In binary mode, check each new stretch of input for matches first.
+        // If there's little to gain (noise, already compressed data), it is
+        // written as literals without a full search.
+        if ((state->literal_mode == IMPLODE_BINARY) &&
+            (state->bytes_encoded >= next_probe))
+        {
+            unsigned int count;
+            
+            next_probe = MIN((state->bytes_encoded / PROBE_SIZE + 1) *
+                             PROBE_SIZE, state->bytes_length);
+            count = (unsigned int)(next_probe - state->bytes_encoded);
+            
+            if (!probe_for_matches(state, encode_index, count))
+            {
+                emit_start = implode_time_ns();
+                other_ns = state->write_bitstream.write_ns +
+                           state->write_bitstream.switch_ns;
+                
+                write_binary_literals(&state->write_bitstream,
+                                      &state->window[encode_index], count);
+                
+                state->emit_ns += implode_emit_time(state, emit_start,
+                                                    other_ns);
+                encode_index += count;
+                state->bytes_encoded += count;
+                
+                if (implode_stats) implode_stats->literal_count += count;
+                
+                continue;
+            }
+        }
         
         // Encoding buffer and dictionary are one and the same.
         // Dictionary is simply bytes that have already been encoded.
         // Check for the longer run of next bytes in the dictionary.
-        if (check_dictionary(&encode_length, &offset,
-                              encoding_buffer, encode_index))
+        if (check_dictionary(state, &encode_length, &offset,
+                             encode_index, 0))
         {
             // Versions A,B,D -- different attempts to improve
             //  compression. Common code start.
@@ -645,11 +1448,11 @@ unsigned long implode(FILE * in_file,
                 unsigned int literal_length, literal_offset;
                 bool literal_check;
  
-                literal_check = check_dictionary(&literal_length,
+                literal_check = check_dictionary(state,
+                                                 &literal_length,
                                                  &literal_offset,
-                                                 encoding_buffer,
-                                                 (encode_index+1) %
-                                                 ENCODE_BUFF_SIZE);
+                                                 encode_index,
+                                                 1);
             
                 // Version B - only the below code. Version D uses also.
                 if (optimize_type>1)
@@ -664,12 +1467,12 @@ unsigned long implode(FILE * in_file,
                     {
                         // Compare the overall bit ratio for each case.
                         possible_bitcount =
-                            length_dictionary_entry(offset, encode_length);
+                            length_dictionary_entry(state, offset, encode_length);
                         bitcount_with_literal =
-                            length_dictionary_entry(literal_offset, literal_length);
+                            length_dictionary_entry(state, literal_offset, literal_length);
                     
                         bits_per_byte = (float)possible_bitcount / encode_length;
-                        bits_per_byte_lit = (float)(bitcount_with_literal + length_literal(encoding_buffer[encode_index])) //9)
+                        bits_per_byte_lit = (float)(bitcount_with_literal + length_literal(state, state->window[encode_index])) //9)
                                 / (literal_length + 1);
  
                         // For some reason, better results are produced when
@@ -685,26 +1488,26 @@ unsigned long implode(FILE * in_file,
                             {
                                 if ( sequence_length == 1 )
                                 {
-                                    sequence_bits = length_literal(encoding_buffer[encode_index + encode_length]); //9;
+                                    sequence_bits = length_literal(state, state->window[(encode_index + encode_length) & state->window_mask]); //9;
                                 }
                                 else
                                 {
                                     if ((sequence_length == 2) &&
                                         (literal_offset > 255))
                                     {
-                                        sequence_bits = length_literal(encoding_buffer[encode_index + encode_length]) +
-                                        length_literal(encoding_buffer[encode_index + encode_length+1]);//18;
+                                        sequence_bits = length_literal(state, state->window[(encode_index + encode_length) & state->window_mask]) +
+                                        length_literal(state, state->window[(encode_index + encode_length + 1) & state->window_mask]);//18;
                                     }
                                     else
                                     {
-                                        sequence_bits = length_dictionary_entry(
+                                        sequence_bits = length_dictionary_entry(state, 
                                                             literal_offset,
                                                             sequence_length);
                                     }
                                 }
                     
                                 if (( possible_bitcount + sequence_bits) <=
-                                    ( bitcount_with_literal + length_literal(encoding_buffer[encode_index]))) //9))
+                                    ( bitcount_with_literal + length_literal(state, state->window[encode_index]))) //9))
                                 {
                                     use_literal = false;
                                 }
@@ -731,11 +1534,11 @@ unsigned long implode(FILE * in_file,
                     }
                     else
                     {
-                        if (!check_dictionary(&next_length,
+                        if (!check_dictionary(state,
+                                              &next_length,
                                               &next_offset,
-                                              encoding_buffer,
-                                              (encode_index+encode_length) %
-                                              ENCODE_BUFF_SIZE))
+                                              encode_index,
+                                              encode_length))
                         {
                             next_length = 1;
                         }
@@ -756,22 +1559,33 @@ unsigned long implode(FILE * in_file,
         }
         
         // End Versions A,B,D
+        
+        // Time a sample of tokens as they are written.
+        sampled = ((uint32_t)(state->token_count++ * SAMPLE_HASH) >>
+                   (32 - EMIT_SAMPLE_BITS)) == 0;
+        
+        if (sampled)
+        {
+            emit_start = implode_time_ns();
+            other_ns = state->write_bitstream.write_ns +
+                       state->write_bitstream.switch_ns;
+        }
  
         // If flag for literal is set, use literal.
         // Otherwise, use dictionary.
         if (use_literal)
         {
-            write_literal(encoding_buffer[encode_index]);
+            write_literal(state, state->window[encode_index]);
             encode_index++;
-            bytes_encoded++;
+            state->bytes_encoded++;
             
             if (implode_stats) implode_stats->literal_count++;
         }
         else
         {
-            write_dictionary_entry(offset, encode_length);
+            write_dictionary_entry(state, offset, encode_length);
             encode_index += encode_length;
-            bytes_encoded += encode_length;
+            state->bytes_encoded += encode_length;
             
             if (implode_stats)
             {
@@ -788,19 +1602,399 @@ unsigned long implode(FILE * in_file,
             }
         }
         encode_length=0;
+        
+        if (sampled)
+        {
+            state->emit_sample_ns += implode_emit_time(state, emit_start,
+                                                       other_ns);
+            state->emit_samples++;
+        }
 
     }
     
     // Write end-of-data marker (Length 519) and zero bits for final byte.
-    write_next_bit(1);
-    write_bits_msb_first(7, 0);
-    write_bits_lsb_first(8, 0xFF);
-    write_flush();
+    if (state->write_end)
+    {
+        write_bits_lsb_first(&state->write_bitstream,
+                             length_code_table[519].count,
+                             length_code_table[519].bits);
+    }
+    
+    state->bit_length = (state->write_bitstream.bytes_written +
+                         state->write_bitstream.block_position) * 8 +
+                        state->write_bitstream.bit_count;
+    
+    write_flush(&state->write_bitstream);
+    
+    if (implode_stats)
+    {
+        implode_phase_times(state, implode_time_ns() - run_start,
+                            implode_stats);
+    }
+    
+    return state->write_bitstream.bytes_written;
+}
+
+unsigned long implode(FILE * in_file,
+                      FILE * out_file,
+                      unsigned long length,
+                      implode_literal_type literal_encode_mode,
+                      implode_dictionary_size_type dictionary_size,
+                      unsigned int optimization_level,
+                      implode_stats_type* implode_stats,
+                      unsigned long *max_length,
+                      FILE* (*max_reached)(FILE* , unsigned long*) )
+{
+    implode_state_type state;
+    unsigned long bytes_written;
+    
+    implode_state_init(&state, in_file, NULL, out_file, NULL, length,
+                       literal_encode_mode, dictionary_size,
+                       max_length, max_reached);
+    
+    bytes_written = implode_run(&state, optimization_level, implode_stats);
     
     // fix
+    if (max_length)
+        *max_length-=bytes_written;
+    
+    return bytes_written;
+}
+
+unsigned long implode_memory( const unsigned char * in_data,
+                              unsigned long length,
+                              implode_buffer_type * out_buffer,
+                              implode_literal_type literal_encode_mode,
+                              implode_dictionary_size_type dictionary_size,
+                              unsigned int optimization_level,
+                              const implode_match_table_type * matches,
+                              implode_stats_type* implode_stats )
+{
+    implode_state_type* state = malloc(sizeof(implode_state_type));
+    unsigned long bytes_written;
+    
+    if (!state)
+    {
+        printf("Error: out of memory.\n");
+        return 0;
+    }
+    
+    implode_state_init(state, NULL, in_data, NULL, out_buffer, length,
+                       literal_encode_mode, dictionary_size, NULL, NULL);
+    
+    if (matches)
+    {
+        state->matches = matches->matches;
+    }
+    
+    bytes_written = implode_run(state, optimization_level, implode_stats);
+    
+    // The output is incomplete.
+    if (state->write_bitstream.error_flag)
+    {
+        bytes_written = 0;
+    }
+    
+    free(state);
+    
+    return bytes_written;
+}
+
+unsigned long implode_write( const unsigned char * data,
+                             unsigned long length,
+                             FILE * out_file,
+                             unsigned long *max_length,
+                             FILE* (*max_reached)( FILE*, unsigned long* ) )
+{
+    write_bitstream_type write_bitstream = {0};
+    
+    write_bitstream.file_pointer = out_file;
+    write_bitstream.max_length = max_length;
+    write_bitstream.max_reached = max_reached;
+    
+    write_block(&write_bitstream, data, length);
+    
     if (max_length)
         *max_length-=write_bitstream.bytes_written;
     
     return write_bitstream.bytes_written;
 }
 
+// One chunk of an implode_chunks operation.
+typedef struct
+{
+    const unsigned char * in_data;
+    unsigned long length;
+    unsigned long start;
+    unsigned long end;
+    implode_literal_type literal_mode;
+    implode_dictionary_size_type dictionary_size;
+    unsigned int optimization_level;
+    bool independent;
+    
+    implode_buffer_type output;
+    unsigned long bit_length;
+    implode_stats_type stats;
+    bool error;
+} implode_chunk_type;
+
+typedef struct
+{
+    implode_chunk_type* chunks;
+    unsigned long chunk_count;
+    unsigned long first;       // Chunks first, first+step, first+2*step...
+    unsigned long step;
+} implode_chunk_job_type;
+
+// Implode one chunk. Matches may refer back into the data before the
+// chunk (unless it is independent), but no match runs past its end.
+void implode_one_chunk( implode_chunk_type* chunk )
+{
+    implode_state_type* state = malloc(sizeof(implode_state_type));
+    
+    if (!state)
+    {
+        chunk->error = true;
+        return;
+    }
+    
+    implode_state_init(state, NULL, chunk->in_data, NULL, &chunk->output,
+                       chunk->end, chunk->literal_mode, chunk->dictionary_size,
+                       NULL, NULL);
+    
+    state->bytes_encoded = chunk->start;
+    state->history_start = chunk->independent ? chunk->start : 0;
+    state->write_header = (chunk->start == 0);
+    state->write_end = (chunk->end == chunk->length);
+    
+    implode_run(state, chunk->optimization_level, &chunk->stats);
+    
+    chunk->bit_length = state->bit_length;
+    chunk->error = state->write_bitstream.error_flag;
+    
+    free(state);
+}
+
+void* implode_chunk_thread( void* job_ptr )
+{
+    implode_chunk_job_type* job = job_ptr;
+    uint64_t thread_start = implode_time_ns();
+    unsigned long bytes_in = 0;
+    unsigned long bytes_out = 0;
+    
+    for (unsigned long i = job->first; i < job->chunk_count; i += job->step)
+    {
+        implode_one_chunk(&job->chunks[i]);
+        
+        bytes_in += job->chunks[i].end - job->chunks[i].start;
+        bytes_out += job->chunks[i].bit_length / 8;
+    }
+    
+    implode_trace("implode chunks", "worker", thread_start, bytes_in,
+                  bytes_out);
+    
+    return NULL;
+}
+
+unsigned long implode_chunks( const unsigned char * in_data,
+                              unsigned long length,
+                              implode_buffer_type * out_buffer,
+                              implode_literal_type literal_encode_mode,
+                              implode_dictionary_size_type dictionary_size,
+                              unsigned int optimization_level,
+                              unsigned long chunk_size,
+                              bool independent,
+                              unsigned int thread_count,
+                              implode_stats_type* implode_stats,
+                              implode_block_index_type* index )
+{
+    implode_chunk_type* chunks;
+    implode_chunk_job_type jobs[MAX_MATCH_THREADS];
+    pthread_t threads[MAX_MATCH_THREADS];
+    bool thread_started[MAX_MATCH_THREADS] = {0};
+    write_bitstream_type* write_bitstream;
+    unsigned long chunk_count;
+    unsigned long i;
+    bool error = false;
+    unsigned long bytes_written;
+    uint64_t join_start;
+    
+    if (chunk_size < 1)
+    {
+        chunk_size = (length > 0) ? length : 1;
+    }
+    
+    chunk_count = (length + chunk_size - 1) / chunk_size;
+    if (chunk_count < 1)
+    {
+        chunk_count = 1;
+    }
+    
+    chunks = calloc(chunk_count, sizeof(implode_chunk_type));
+    write_bitstream = calloc(1, sizeof(write_bitstream_type));
+    
+    if (index)
+    {
+        index->count = chunk_count;
+        index->block_size = chunk_size;
+        index->bit_offset = malloc(chunk_count * sizeof(unsigned long));
+        index->output_offset = malloc(chunk_count * sizeof(unsigned long));
+    }
+    
+    if (!chunks || !write_bitstream ||
+        (index && (!index->bit_offset || !index->output_offset)))
+    {
+        printf("Error: out of memory.\n");
+        free(chunks);
+        free(write_bitstream);
+        if (index)
+        {
+            implode_block_index_free(index);
+        }
+        return 0;
+    }
+    
+    for (i = 0; i < chunk_count; i++)
+    {
+        chunks[i].in_data = in_data;
+        chunks[i].length = length;
+        chunks[i].start = i * chunk_size;
+        chunks[i].end = MIN(length, (i + 1) * chunk_size);
+        chunks[i].literal_mode = literal_encode_mode;
+        chunks[i].dictionary_size = dictionary_size;
+        chunks[i].optimization_level = optimization_level;
+        chunks[i].independent = independent;
+    }
+    
+    if (thread_count < 1)
+    {
+        thread_count = 1;
+    }
+    if (thread_count > MAX_MATCH_THREADS)
+    {
+        thread_count = MAX_MATCH_THREADS;
+    }
+    if (thread_count > chunk_count)
+    {
+        thread_count = (unsigned int) chunk_count;
+    }
+    
+    for (i = 0; i < thread_count; i++)
+    {
+        jobs[i].chunks = chunks;
+        jobs[i].chunk_count = chunk_count;
+        jobs[i].first = i;
+        jobs[i].step = thread_count;
+        
+        if (i > 0)
+        {
+            thread_started[i] = (pthread_create(&threads[i], NULL,
+                                                implode_chunk_thread,
+                                                &jobs[i]) == 0);
+        }
+    }
+    
+    for (i = 0; i < thread_count; i++)
+    {
+        if (!thread_started[i])
+        {
+            implode_chunk_thread(&jobs[i]);
+        }
+    }
+    
+    for (i = 1; i < thread_count; i++)
+    {
+        if (thread_started[i])
+        {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    
+    // Join the chunks' bits into one stream, in order.
+    write_bitstream->buffer = out_buffer;
+    join_start = implode_time_ns();
+    
+    if (implode_stats)
+    {
+        *implode_stats = chunks[0].stats;
+    }
+    
+    for (i = 0; i < chunk_count; i++)
+    {
+        error |= chunks[i].error;
+        
+        // Tokens of the first chunk start after the two header bytes.
+        if (index)
+        {
+            index->bit_offset[i] = (write_bitstream->bytes_written +
+                                    write_bitstream->block_position) * 8 +
+                                   write_bitstream->bit_count +
+                                   ((i == 0) ? 16 : 0);
+            index->output_offset[i] = chunks[i].start;
+        }
+        
+        write_bits_from_buffer(write_bitstream,
+                               chunks[i].output.data,
+                               chunks[i].bit_length);
+        implode_buffer_free(&chunks[i].output);
+        
+        if (implode_stats && (i > 0))
+        {
+            implode_stats_type* stats = &chunks[i].stats;
+            
+            implode_stats->literal_count += stats->literal_count;
+            implode_stats->lookup_count += stats->lookup_count;
+            implode_stats->max_offset = MAX(implode_stats->max_offset,
+                                            stats->max_offset);
+            implode_stats->min_offset = MIN(implode_stats->min_offset,
+                                            stats->min_offset);
+            implode_stats->max_length = MAX(implode_stats->max_length,
+                                            stats->max_length);
+            implode_stats->min_length = MIN(implode_stats->min_length,
+                                            stats->min_length);
+            
+            for (int j = 0; j < IMPLODE_PHASE_COUNT; j++)
+            {
+                implode_stats->phase_ns[j] += stats->phase_ns[j];
+            }
+        }
+    }
+    
+    write_flush(write_bitstream);
+    
+    // Joining counts as emitting bits.
+    if (implode_stats)
+    {
+        implode_stats->phase_ns[IMPLODE_PHASE_EMIT] +=
+            implode_time_ns() - join_start;
+    }
+    error |= write_bitstream->error_flag;
+    bytes_written = write_bitstream->bytes_written;
+    
+    free(write_bitstream);
+    free(chunks);
+    
+    if (error)
+    {
+        return 0;
+    }
+    
+    return bytes_written;
+}
+
+void implode_block_index_free( implode_block_index_type * index )
+{
+    free(index->bit_offset);
+    free(index->output_offset);
+    index->bit_offset = NULL;
+    index->output_offset = NULL;
+    index->count = 0;
+}
+
+void implode_buffer_free( implode_buffer_type * buffer )
+{
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->size = 0;
+}
@@ -10,6 +10,8 @@
 #define implode_h
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 typedef enum {
     IMPLODE_BINARY = 0,
@@ -22,6 +24,22 @@ typedef enum {
     IMPLODE_4K_DICTIONARY = 6      // 4096 bytes.
 } implode_dictionary_size_type;
 
+/* Where the time goes while imploding. Tokens are written one by one
+   between searches, so only a sample of them is timed and the time spent
+   emitting bits estimated from it; searching for matches is whatever is
+   left of the encode loop. LFGMake adds back-patching (lengths filled in
+   once known) and switching to the next archive file.
+*/
+typedef enum {
+    IMPLODE_PHASE_READ = 0,     // Reading input
+    IMPLODE_PHASE_SEARCH,       // Searching for matches
+    IMPLODE_PHASE_EMIT,         // Encoding tokens as bits (estimated)
+    IMPLODE_PHASE_WRITE,        // Writing output
+    IMPLODE_PHASE_PATCH,        // Filling in lengths
+    IMPLODE_PHASE_SWITCH,       // Moving on to the next archive file
+    IMPLODE_PHASE_COUNT
+} implode_phase_type;
+
 typedef struct {
     // Statistics
     long literal_count;  // Number of literals
@@ -32,8 +50,62 @@ typedef struct {
     int min_offset;    // Min offset is 0
     int max_length;    // Max possible length is 518
     int min_length;    // Min length is 2
+    
+    // Time in each phase, in nanoseconds. Summed over threads when the
+    // data is imploded on several.
+    uint64_t phase_ns[IMPLODE_PHASE_COUNT];
 } implode_stats_type;
 
+/* Monotonic clock in nanoseconds, for timing phases. */
+uint64_t implode_time_ns( void );
+
+/* If set, called as each worker thread finishes and after each write of
+   output to a file, on the thread that did the work, with a name for the
+   span, the category, when it started (implode_time_ns()) and the bytes it
+   took in and put out. Used to trace packing (LFGMake --trace).
+*/
+extern void (*implode_trace_hook)( const char* name,
+                                   const char* category,
+                                   uint64_t start_ns,
+                                   unsigned long bytes_in,
+                                   unsigned long bytes_out );
+
+/* Pass a span to implode_trace_hook, if set. For the packer's own spans. */
+void implode_trace( const char* name,
+                    const char* category,
+                    uint64_t start_ns,
+                    unsigned long bytes_in,
+                    unsigned long bytes_out );
+
+// Growable memory buffer for imploded data.
+typedef struct {
+    unsigned char* data;
+    unsigned long length;   // Bytes used
+    unsigned long size;     // Bytes allocated
+} implode_buffer_type;
+
+// Longest match found at one input position for each dictionary size
+// (1K, 2K, 4K). A length of 1 means no match.
+typedef struct {
+    uint16_t length[3];
+    uint16_t offset[3];
+} implode_match_type;
+
+// Match finding results for every position of an input.
+typedef struct {
+    implode_match_type* matches;
+    unsigned long length;
+} implode_match_table_type;
+
+// Where each block of a block mode stream starts. Bit offsets count from
+// the start of the imploded data, header bytes included.
+typedef struct {
+    unsigned long count;
+    unsigned long block_size;
+    unsigned long* bit_offset;
+    unsigned long* output_offset;
+} implode_block_index_type;
+
 unsigned long implode( FILE * in_file,
                        FILE * out_file,
                        unsigned long length,
@@ -44,4 +116,68 @@ unsigned long implode( FILE * in_file,
                        unsigned long *max_length,
                        FILE* (*max_reached)( FILE*, unsigned long* ) );
 
+/* Implode data that is already in memory. Output is appended to out_buffer
+   (which should start out zeroed); if out_buffer is NULL, output is only
+   counted.  If matches is given (see implode_find_matches), its results are
+   used instead of searching, which leaves only the cheap parse and cost
+   steps to run.  Each call uses its own state, so calls may run
+   concurrently on different threads.  Returns the number of imploded bytes,
+   or 0 if out_buffer couldn't hold the output.
+*/
+unsigned long implode_memory( const unsigned char * in_data,
+                              unsigned long length,
+                              implode_buffer_type * out_buffer,
+                              implode_literal_type literal_encode_mode,
+                              implode_dictionary_size_type dictionary_size,
+                              unsigned int optimization_level,
+                              const implode_match_table_type * matches,
+                              implode_stats_type* implode_stats );
+
+/* Implode data in memory as chunks of chunk_size bytes, each on its own
+   thread (up to thread_count).  Matches in a chunk may still refer back to
+   the data before it, so only the parse is split up.  The chunks are joined
+   into one ordinary stream that any explode can read.
+   If independent is set, matches never refer to data before the chunk, so
+   each chunk (block) can be exploded by itself given its starting bit
+   offset, which is recorded in index (if not NULL; free it with
+   implode_block_index_free).  Returns the number of imploded bytes, or 0 on
+   error.
+*/
+unsigned long implode_chunks( const unsigned char * in_data,
+                              unsigned long length,
+                              implode_buffer_type * out_buffer,
+                              implode_literal_type literal_encode_mode,
+                              implode_dictionary_size_type dictionary_size,
+                              unsigned int optimization_level,
+                              unsigned long chunk_size,
+                              bool independent,
+                              unsigned int thread_count,
+                              implode_stats_type* implode_stats,
+                              implode_block_index_type* index );
+
+void implode_block_index_free( implode_block_index_type * index );
+
+/* Run match finding once over data in memory, for all dictionary sizes.
+   The table can be shared by any number of implode_memory() calls on the
+   same data, regardless of literal mode, dictionary size or optimization
+   level.  The work is split over thread_count threads.
+*/
+bool implode_find_matches( const unsigned char * in_data,
+                           unsigned long length,
+                           implode_match_table_type * table,
+                           unsigned int thread_count );
+
+void implode_match_table_free( implode_match_table_type * table );
+
+/* Write already imploded data to out_file, splitting it across files the
+   same way implode() does when max_length is reached.
+*/
+unsigned long implode_write( const unsigned char * data,
+                             unsigned long length,
+                             FILE * out_file,
+                             unsigned long *max_length,
+                             FILE* (*max_reached)( FILE*, unsigned long* ) );
+
+void implode_buffer_free( implode_buffer_type * buffer );
+
 #endif /* implode_h */
@@ -11,20 +11,31 @@
 #include <string.h>
 #include <stdbool.h>
 #include "pack_lfg.h"
+#include "report_lfg.h"
+#include "implode.h"
+#include "../LFGDump/trace_lfg.h"
 
 
 void print_usage ( void )
 {
     printf("\nUsage: LFGMake [options] archive_name archive_file_1 archive_file_2 ... \n");
+    printf("       LFGMake -r report.json [-j N] archive_file_1 archive_file_2 ... \n");
     printf("Creates an LFG-type archive.\n\n");
     printf("Options:\n");
+    printf("  -b N                  Implode in independent N k blocks, write block index\n");
+    printf("  -c N                  Implode files over N k in chunks on separate threads\n");
+    printf("                        (not with -b, whose blocks are already imploded apart)\n");
     printf("  -f filelist           Use filelist (text file) as archive file list\n");
     printf("  -h                    Display this help\n");
+    printf("  -j N                  Implode up to N files at once on separate threads\n");
     printf("  -m initial_size size  Set max size for first and subsequent archive files\n");
+    printf("  -r report.json        Report time and size of every -o/-w/-t setting\n");
+    printf("                        (no archive is made), trials on -j threads\n");
     printf("  -s                    Print stats\n");
     printf("  -t                    Use ASCII (text) mode encoding of literals\n");
     printf("  -v                    Print version info\n");
     printf("  -w N                  Use sliding window size of N k (where N=1,2,4)\n");
+    printf("  --trace file          Write a Chrome/Perfetto trace (JSON) to file\n");
 }
 
 void print_version ( void )
@@ -46,6 +57,13 @@ int main (int argc, const char * argv[])
     bool verbose = false;
     unsigned int literal_mode = 0;
     unsigned int optimize_level = 3;
+    unsigned int thread_count = 1;
+    unsigned long chunk_size = 0;
+    bool chunk_option = false;
+    unsigned long block_size = 0;
+    bool block_mode = false;
+    const char* report_path = NULL;
+    const char* trace_path = NULL;
     
     for (int j = 1; j<argc; j++)
     {
@@ -65,6 +83,44 @@ int main (int argc, const char * argv[])
             }
             optimize_level = atoi(argv[j]);
         }
+        else if (strcmp(argv[j], "-j") == 0)
+        {
+            j++;
+            file_arg+=2;
+            if (j >= argc)
+            {
+                print_version();
+                return 0;
+            }
+            int value = atoi(argv[j]);
+            thread_count = (value > 1) ? value : 1;
+        }
+        else if (strcmp(argv[j], "-b") == 0)
+        {
+            j++;
+            file_arg+=2;
+            if (j >= argc)
+            {
+                print_version();
+                return 0;
+            }
+            int value = atoi(argv[j]);
+            block_size = (value > 0) ? (unsigned long) value * 1024 : 0x10000;
+            block_mode = true;
+        }
+        else if (strcmp(argv[j], "-c") == 0)
+        {
+            j++;
+            file_arg+=2;
+            if (j >= argc)
+            {
+                print_version();
+                return 0;
+            }
+            int value = atoi(argv[j]);
+            chunk_size = (value > 0) ? (unsigned long) value * 1024 : 0;
+            chunk_option = true;
+        }
         else if (strcmp(argv[j], "-f") == 0)
         {
             j++;
@@ -88,6 +144,28 @@ int main (int argc, const char * argv[])
             first_disk = atoi(argv[j++]);
             disk_size = atoi(argv[j]);
         }
+        else if (strcmp(argv[j], "-r") == 0)
+        {
+            j++;
+            file_arg+=2;
+            if (j >= argc)
+            {
+                print_version();
+                return 0;
+            }
+            report_path = argv[j];
+        }
+        else if (strcmp(argv[j], "--trace") == 0)
+        {
+            j++;
+            file_arg+=2;
+            if (j >= argc)
+            {
+                print_version();
+                return 0;
+            }
+            trace_path = argv[j];
+        }
         else if (strcmp(argv[j], "-v") == 0)
         {
             print_version();
@@ -134,12 +212,33 @@ int main (int argc, const char * argv[])
         }
     }
     
-    if (file_arg >= argc)
+    if ((file_arg >= argc) && !(report_path && file_list))
     {
         print_usage();
         return 0;
     }
     
+    // Blocks are imploded in chunks of the block size.
+    if (block_mode)
+    {
+        if (chunk_option)
+        {
+            printf("Error: -b and -c can't be used together.\n");
+            print_usage();
+            return 0;
+        }
+        chunk_size = block_size;
+    }
+    
+    if (trace_path)
+    {
+        if (!trace_open(trace_path, "LFGMake"))
+        {
+            return 0;
+        }
+        implode_trace_hook = trace_span;
+    }
+    
     int file_count = 0;
     
     // if read from file
@@ -150,6 +249,7 @@ int main (int argc, const char * argv[])
         if (!list_ptr)
         {
             printf("%s not found!\n", file_list);
+            trace_close();
             return 0;
         }
         
@@ -169,7 +269,8 @@ int main (int argc, const char * argv[])
     }
     else
     {
-        for (int i=file_arg+1; i<argc; i++)
+        // A report takes no archive name, so its files start at file_arg.
+        for (int i=(report_path ? file_arg : file_arg+1); i<argc; i++)
         {
             long length = strlen( argv[i] );
             file_list_ptr[file_count] = malloc( sizeof(char) * length + 1);
@@ -185,15 +286,30 @@ int main (int argc, const char * argv[])
     //    printf(" %d: %s\n", i+1, file_list_ptr[i]);
     //}
     
-    pack_lfg(dictionary_size,
-             literal_mode,
-             argv[file_arg],
-             file_list_ptr,
-             file_count,
-             first_disk,
-             disk_size,
-             optimize_level,
-             verbose);
+    if (report_path)
+    {
+        report_lfg(file_list_ptr,
+                   file_count,
+                   report_path,
+                   (thread_count > 1) ? thread_count : processor_count());
+    }
+    else
+    {
+        pack_lfg(dictionary_size,
+                 literal_mode,
+                 argv[file_arg],
+                 file_list_ptr,
+                 file_count,
+                 first_disk,
+                 disk_size,
+                 optimize_level,
+                 thread_count,
+                 chunk_size,
+                 block_mode,
+                 verbose);
+    }
+    
+    trace_close();
     
     // Free file list
     for (int i=0; i< file_count; i++)
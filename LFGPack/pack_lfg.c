@@ -10,7 +10,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
-#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "implode.h"
 #include "pack_lfg.h"
 
@@ -75,6 +76,25 @@ int disk_count;
 unsigned long archive_total_length;
 FILE *fp_out;
 
+// Time in each phase over the whole archive, in ns (shown with -s). Member
+// stats give the read, search, emit and write times; switching disks and
+// back-patching are timed here, in max_reached() and pack_lfg().
+uint64_t phase_ns[IMPLODE_PHASE_COUNT];
+
+const char* phase_names[IMPLODE_PHASE_COUNT] = {
+    "Input read", "Match search", "Bit emission (est.)", "Output write",
+    "Back-patching", "Segment switch"
+};
+
+// Add a member's read, search, emit and write times.
+void add_phase_times( const implode_stats_type* stats )
+{
+    for (int i = 0; i <= IMPLODE_PHASE_WRITE; i++)
+    {
+        phase_ns[i] += stats->phase_ns[i];
+    }
+}
+
 
 void remove_path(char* filename,
                  const char* pathfile,
@@ -96,83 +116,639 @@ void remove_path(char* filename,
     
 }
 
+// Read a whole file into memory. Returns NULL on failure.
+unsigned char* read_file_data( FILE * in_file,
+                               unsigned long length)
+{
+    // Allocate at least one byte so empty files work too.
+    unsigned char* data = malloc(length + 1);
+    
+    if (data == NULL)
+    {
+        printf("Error: out of memory.\n");
+        return NULL;
+    }
+    
+    if (fread(data, sizeof data[0], length, in_file) != length)
+    {
+        printf("Error: file read error.\n");
+        free(data);
+        return NULL;
+    }
+    
+    return data;
+}
+
 // general idea. error check.
-int check_ascii( FILE * in_file,
+int check_ascii( const unsigned char * data,
                  unsigned long length)
 {
-    signed char ch;
-    int ascii = 1;
-    while (length--)
+    unsigned long i;
+    
+    // Same test as a signed char compare against EOF (-1); 0xFF passes.
+    for (i = 0; i < length; i++)
     {
-        ch = fgetc(in_file);
-        if (ch < -1) {
-            ascii = 0;
-            break;
+        if ((signed char) data[i] < -1)
+        {
+            return 0;
         }
     }
     
-    fseek ( in_file, 0, SEEK_SET );
+    return 1;
+}
+
+// One trial configuration for find_best_implode.
+typedef struct
+{
+    const unsigned char * data;
+    unsigned long length;
+    unsigned int literal_mode;
+    implode_dictionary_size_type window_size;
+    unsigned int optimization_level;
+    const implode_match_table_type * matches;
+    
+    implode_buffer_type output;
+    implode_stats_type stats;
+    unsigned long bytes_written;
+} implode_trial_type;
+
+void* run_implode_trial( void* trial_ptr )
+{
+    implode_trial_type* trial = trial_ptr;
+    uint64_t start = implode_time_ns();
+    
+    trial->bytes_written = implode_memory(trial->data,
+                                          trial->length,
+                                          &trial->output,
+                                          trial->literal_mode,
+                                          trial->window_size,
+                                          trial->optimization_level,
+                                          trial->matches,
+                                          &trial->stats);
+    
+    implode_trace("implode trial", "worker", start, trial->length,
+                  trial->bytes_written);
+    return NULL;
+}
+
+#define MAX_IMPLODE_TRIALS  6
+
+// Number of processors available, for sizing thread counts.
+unsigned int processor_count( void )
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
     
-    return ascii;
+    return (count > 0) ? (unsigned int) count : 1;
 }
 
-void find_best_implode( FILE * in_file,
+// Implode the data with each candidate configuration and keep the smallest
+// result. Match finding is done once up front and shared by all trials,
+// then the trials run concurrently, up to thread_count at a time, the
+// first of each batch on this thread. The winning output and its stats are
+// returned; the caller frees best_output. Trials that fail (out of memory)
+// are left out; false if they all fail.
+bool find_best_implode( const unsigned char * data,
                         unsigned long length,
                         unsigned int * literal_encode_mode,
                         implode_dictionary_size_type *window_size,
-                        unsigned int *optimization_level)
+                        unsigned int *optimization_level,
+                        implode_buffer_type *best_output,
+                        implode_stats_type *best_stats,
+                        unsigned int thread_count)
 {
-    unsigned long bytes_written;
+    implode_trial_type trials[MAX_IMPLODE_TRIALS] = {{0}};
+    implode_match_table_type match_table = {0};
+    bool have_matches;
+    pthread_t threads[MAX_IMPLODE_TRIALS];
+    bool thread_started[MAX_IMPLODE_TRIALS] = {0};
+    int trial_count = 0;
+    int best = -1;
     int i,j,k;
-    unsigned long min_size = 0xFFFFFFFF;
     unsigned long dictionary_length_threshold = 4096 * 5;
     
+    uint64_t search_ns = implode_time_ns();
+    
+    // Search once for all trials. If there isn't memory for the table,
+    // each trial does its own search.
+    have_matches = implode_find_matches(data, length, &match_table,
+                                        thread_count);
+    
+    search_ns = implode_time_ns() - search_ns;
+    
+    // Guess whether ascii file or bin file
+    i = check_ascii(data, length);
+    
+    for(j=4;j<7;j++)
+    {
+        // If over 20K, only try largest dictionary size.
+        if (length > dictionary_length_threshold)
+        {
+            j=6;
+        }
+        
+        for (k=1; k<4;k+=2)
+        {
+            trials[trial_count].data = data;
+            trials[trial_count].length = length;
+            trials[trial_count].literal_mode = i;
+            trials[trial_count].window_size = j;
+            trials[trial_count].optimization_level = k;
+            trials[trial_count].matches = have_matches ? &match_table : NULL;
+            trial_count++;
+        }
+    }
+    
+    if (thread_count < 1)
     {
-        // Guess whether ascii file or bin file
-        i = check_ascii(in_file, length);
+        thread_count = 1;
+    }
+    
+    for (i = 0; i < trial_count; i += thread_count)
+    {
+        int batch_end = (i + (int) thread_count < trial_count) ?
+                        i + (int) thread_count : trial_count;
         
-        for(j=4;j<7;j++)
+        for (j = i + 1; j < batch_end; j++)
         {
-            // If over 20K, only try largest dictionary size.
-            if (length > dictionary_length_threshold)
+            thread_started[j] = (pthread_create(&threads[j], NULL,
+                                                run_implode_trial,
+                                                &trials[j]) == 0);
+            
+            // No thread available, run it here instead.
+            if (!thread_started[j])
             {
-                j=6;
+                run_implode_trial(&trials[j]);
             }
-            
-            for (k=1; k<4;k+=2)
+        }
+        
+        run_implode_trial(&trials[i]);
+        
+        for (j = i + 1; j < batch_end; j++)
+        {
+            if (thread_started[j])
             {
-                bytes_written = implode(in_file,
-                                        NULL,
-                                        length,
-                                        i,
-                                        j,
-                                        k,
-                                        NULL,
-                                        NULL,
-                                        NULL);
-                fseek ( in_file, 0, SEEK_SET );
-
-                if (bytes_written < min_size)
-                {
-                   
-                    min_size = bytes_written;
-                    *literal_encode_mode = i;
-                    *window_size = j;
-                    *optimization_level = k;
-                }
+                pthread_join(threads[j], NULL);
             }
         }
     }
+    
+    // Pick the smallest. On a tie, the earlier configuration wins.
+    for (i = 0; i < trial_count; i++)
+    {
+        if ((trials[i].bytes_written > 0) &&
+            ((best < 0) ||
+             (trials[i].bytes_written < trials[best].bytes_written)))
+        {
+            best = i;
+        }
+    }
+    
+    if (best < 0)
+    {
+        for (i = 0; i < trial_count; i++)
+        {
+            implode_buffer_free(&trials[i].output);
+        }
+        implode_match_table_free(&match_table);
+        return false;
+    }
+    
+    *literal_encode_mode = trials[best].literal_mode;
+    *window_size = trials[best].window_size;
+    *optimization_level = trials[best].optimization_level;
+    *best_output = trials[best].output;
+    *best_stats = trials[best].stats;
+    
+    // Times count the work of every trial, not just the best.
+    best_stats->phase_ns[IMPLODE_PHASE_SEARCH] += search_ns;
+    
+    for (i = 0; i < trial_count; i++)
+    {
+        if (i != best)
+        {
+            for (j = 0; j < IMPLODE_PHASE_COUNT; j++)
+            {
+                best_stats->phase_ns[j] += trials[i].stats.phase_ns[j];
+            }
+            implode_buffer_free(&trials[i].output);
+        }
+    }
+    
+    implode_match_table_free(&match_table);
+    
+    return true;
+}
+
+// Pick the dictionary size for a member. By default, the smallest dictionary
+// that covers the whole file.
+implode_dictionary_size_type select_window_size(
+                                        lfg_window_size_type dictionary_size,
+                                        long length)
+{
+    if  (dictionary_size == LFG_DEFAULT)
+    {
+        if (length <= 1024)
+        {
+            return IMPLODE_1K_DICTIONARY;
+        }
+        else if (length <=2048)
+        {
+            return IMPLODE_2K_DICTIONARY;
+        }
+        else
+        {
+            return IMPLODE_4K_DICTIONARY;
+        }
+    }
+    
+    return (implode_dictionary_size_type) dictionary_size;
+}
+
+// One archive member for the concurrent (-j) path. A worker fills in
+// everything below path, then sets done.
+typedef struct
+{
+    const char * path;
+    
+    long length;
+    unsigned int literal_mode;
+    implode_dictionary_size_type window_size;
+    unsigned int optimization_level;
+    implode_buffer_type output;
+    implode_stats_type stats;
+    implode_block_index_type blocks;
+    double elapsed;
+    bool open_error;
+    bool error;
+    bool done;
+} pack_member_type;
+
+// Work shared between the imploding workers and the thread writing the
+// archive. Workers stay at most max_ahead members ahead of the writer so
+// that only a bounded number of imploded members is held in memory.
+typedef struct
+{
+    pack_member_type * members;
+    int member_count;
+    int next_member;
+    int members_written;
+    int max_ahead;
+    
+    lfg_window_size_type dictionary_size;
+    unsigned int literal_mode;
+    unsigned int optimize_level;
+    unsigned long chunk_size;
+    bool block_mode;
+    unsigned int member_threads;    // Threads each worker may use itself
+    
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} pack_queue_type;
+
+// Implode one member completely in memory, ready to be copied into the
+// archive.
+void implode_member( pack_member_type * member,
+                     lfg_window_size_type dictionary_size,
+                     unsigned int literal_mode,
+                     unsigned int optimize_level,
+                     unsigned long chunk_size,
+                     bool block_mode,
+                     unsigned int thread_count)
+{
+    FILE * fp_in;
+    unsigned char* file_data;
+    uint64_t start, read_ns;
+    
+    fp_in = fopen(member->path, "rb");
+    
+    if (fp_in == 0)
+    {
+        member->open_error = true;
+        member->error = true;
+        return;
+    }
+    
+    fseek ( fp_in, 0, SEEK_END );
+    member->length = ftell( fp_in );
+    fseek ( fp_in, 0, SEEK_SET );
+    
+    start = implode_time_ns();
+    file_data = read_file_data(fp_in, member->length);
+    read_ns = implode_time_ns() - start;
+    fclose(fp_in);
+    
+    if (file_data == NULL)
+    {
+        member->error = true;
+        return;
+    }
+    
+    member->window_size = select_window_size(dictionary_size,
+                                             member->length);
+    
+    start = implode_time_ns();
+    
+    if (optimize_level==5)
+    {
+        if (!find_best_implode( file_data,
+                                member->length,
+                                &member->literal_mode,
+                                &member->window_size,
+                                &member->optimization_level,
+                                &member->output,
+                                &member->stats,
+                                thread_count))
+        {
+            member->error = true;
+        }
+    }
+    else if (block_mode || (chunk_size && (member->length > chunk_size)))
+    {
+        member->literal_mode = literal_mode;
+        member->optimization_level = optimize_level;
+        
+        // Nothing imploded means an error part way; the output may hold
+        // part of the stream.
+        if (implode_chunks(file_data,
+                           member->length,
+                           &member->output,
+                           member->literal_mode,
+                           member->window_size,
+                           member->optimization_level,
+                           chunk_size,
+                           block_mode,
+                           thread_count,
+                           &member->stats,
+                           block_mode ? &member->blocks : NULL) == 0)
+        {
+            member->error = true;
+        }
+    }
+    else
+    {
+        member->literal_mode = literal_mode;
+        member->optimization_level = optimize_level;
+        
+        // Any imploded data has at least the header; nothing means there
+        // wasn't memory for it.
+        if (implode_memory(file_data,
+                           member->length,
+                           &member->output,
+                           member->literal_mode,
+                           member->window_size,
+                           member->optimization_level,
+                           NULL,
+                           &member->stats) == 0)
+        {
+            member->error = true;
+        }
+    }
+    
+    member->elapsed = (implode_time_ns() - start) / 1e9;
+    member->stats.phase_ns[IMPLODE_PHASE_READ] += read_ns;
+    
+    implode_trace(member->path, "member", start - read_ns, member->length,
+                  member->output.length);
+    
+    free(file_data);
+}
+
+void* pack_worker( void* queue_ptr )
+{
+    pack_queue_type* queue = queue_ptr;
+    int member_num;
+    uint64_t start = implode_time_ns();
+    unsigned long bytes_in = 0;
+    unsigned long bytes_out = 0;
+    
+    while (1)
+    {
+        pthread_mutex_lock(&queue->lock);
+        
+        while ((queue->next_member < queue->member_count) &&
+               (queue->next_member >=
+                queue->members_written + queue->max_ahead))
+        {
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        }
+        
+        if (queue->next_member >= queue->member_count)
+        {
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        
+        member_num = queue->next_member++;
+        pthread_mutex_unlock(&queue->lock);
+        
+        implode_member(&queue->members[member_num],
+                       queue->dictionary_size,
+                       queue->literal_mode,
+                       queue->optimize_level,
+                       queue->chunk_size,
+                       queue->block_mode,
+                       queue->member_threads);
+        
+        bytes_in += queue->members[member_num].length;
+        bytes_out += queue->members[member_num].output.length;
+        
+        pthread_mutex_lock(&queue->lock);
+        queue->members[member_num].done = true;
+        pthread_cond_broadcast(&queue->changed);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    
+    implode_trace("pack worker", "worker", start, bytes_in, bytes_out);
+    
+    return NULL;
+}
+
+// Wait for a worker to finish the given member.
+pack_member_type* wait_for_member( pack_queue_type* queue, int member_num )
+{
+    pack_member_type* member = &queue->members[member_num];
+    
+    pthread_mutex_lock(&queue->lock);
+    
+    while (!member->done)
+    {
+        pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+    
+    pthread_mutex_unlock(&queue->lock);
+    
+    return member;
+}
+
+// Member has been written to the archive; let the workers move ahead.
+void release_member( pack_queue_type* queue, int member_num )
+{
+    implode_buffer_free(&queue->members[member_num].output);
+    
+    pthread_mutex_lock(&queue->lock);
+    queue->members_written = member_num + 1;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Start thread_count workers on the file list. Returns the number started.
+int start_pack_workers( pack_queue_type* queue,
+                        pthread_t* threads,
+                        unsigned int thread_count,
+                        char** file_list,
+                        int num_files,
+                        lfg_window_size_type dictionary_size,
+                        unsigned int literal_mode,
+                        unsigned int optimize_level,
+                        unsigned long chunk_size,
+                        bool block_mode)
+{
+    int started = 0;
+    
+    queue->members = calloc(num_files > 0 ? num_files : 1,
+                            sizeof(pack_member_type));
+    
+    if (queue->members == NULL)
+    {
+        return 0;
+    }
+    
+    for (int i=0; i<num_files; i++)
+    {
+        queue->members[i].path = file_list[i];
+    }
+    
+    queue->member_count = num_files;
+    queue->next_member = 0;
+    queue->members_written = 0;
+    queue->max_ahead = thread_count * 2;
+    queue->dictionary_size = dictionary_size;
+    queue->literal_mode = literal_mode;
+    queue->optimize_level = optimize_level;
+    queue->chunk_size = chunk_size;
+    queue->block_mode = block_mode;
+    
+    // Share the processors out between the workers, so chunks, blocks and
+    // level 5 trials don't start a full set of threads in every worker.
+    queue->member_threads = processor_count() / thread_count;
+    if (queue->member_threads < 1)
+    {
+        queue->member_threads = 1;
+    }
+    
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+    
+    for (unsigned int i=0; i<thread_count; i++)
+    {
+        if (pthread_create(&threads[started], NULL, pack_worker, queue) == 0)
+        {
+            started++;
+        }
+    }
+    
+    if (started == 0)
+    {
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->changed);
+        free(queue->members);
+        queue->members = NULL;
+    }
+    
+    return started;
+}
+
+// Stop handing out members, wait for the workers and free what is left.
+void stop_pack_workers( pack_queue_type* queue,
+                        pthread_t* threads,
+                        int thread_count)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->member_count = queue->next_member;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    
+    for (int i=0; i<thread_count; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    
+    for (int i=0; i<queue->member_count; i++)
+    {
+        implode_buffer_free(&queue->members[i].output);
+        implode_block_index_free(&queue->members[i].blocks);
+    }
+    
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->changed);
+    free(queue->members);
+    queue->members = NULL;
+}
+
+
+// Block index entry for one member, see pack_lfg.h.
+typedef struct
+{
+    char filename[13];
+    unsigned long final_length;
+    implode_block_index_type blocks;
+} block_index_entry_type;
+
+// Write the block index for the archive to index_path.
+int write_block_index( const char* index_path,
+                       block_index_entry_type* entries,
+                       int count)
+{
+    FILE* fp_index = fopen(index_path, "wb");
+    
+    if (fp_index == 0)
+    {
+        printf("Error creating file %s for block index.\n\n", index_path);
+        return -1;
+    }
+    
+    fwrite( "LFGI", sizeof(unsigned char), 4, fp_index);
+    write_le_word(count, fp_index);
+    
+    for (int i=0; i<count; i++)
+    {
+        fwrite( entries[i].filename, sizeof(unsigned char), 13, fp_index);
+        write_le_word(entries[i].final_length, fp_index);
+        write_le_word(entries[i].blocks.block_size, fp_index);
+        write_le_word(entries[i].blocks.count, fp_index);
+        
+        for (unsigned long j=0; j<entries[i].blocks.count; j++)
+        {
+            write_le_word(entries[i].blocks.bit_offset[j], fp_index);
+            write_le_word(entries[i].blocks.output_offset[j], fp_index);
+        }
+    }
+    
+    if (ferror(fp_index))
+    {
+        printf("Error: file error.\n");
+        fclose(fp_index);
+        return -1;
+    }
+    
+    fclose(fp_index);
+    return 0;
 }
-                     
 
 FILE* max_reached (FILE* current_file, unsigned long * max_length )
 {
+    uint64_t start = implode_time_ns();
+    uint64_t stop;
+    
     // Calculate archive length and fill in
     unsigned long archive_length = ftell(current_file) - 8;
     fseek(current_file, length_location, SEEK_SET);
     write_le_word(archive_length, current_file);
     
+    stop = implode_time_ns();
+    phase_ns[IMPLODE_PHASE_PATCH] += stop - start;
+    start = stop;
+    
     archive_total_length += archive_length + 8;
     
     //printf("Archive %s created. Length: %d bytes\n",
@@ -196,6 +772,7 @@ FILE* max_reached (FILE* current_file, unsigned long * max_length )
     if (current_file== 0)
     {
         printf("Error creating file %s for archive.\n\n", full_archive_path);
+        phase_ns[IMPLODE_PHASE_SWITCH] += implode_time_ns() - start;
         return NULL;
     }
     
@@ -211,9 +788,62 @@ FILE* max_reached (FILE* current_file, unsigned long * max_length )
     
     *max_length-=8; //ftell(fp_out);
     
+    phase_ns[IMPLODE_PHASE_SWITCH] += implode_time_ns() - start;
+    implode_trace(full_archive_path, "switch", start, 0, archive_length + 8);
+    
     return current_file;
 }
 
+// Write a member already imploded in memory. Timed as writing, less any
+// switching and back-patching done on the way.
+unsigned long write_member_data( const implode_buffer_type* output,
+                                 unsigned long* space_left )
+{
+    uint64_t start = implode_time_ns();
+    uint64_t other_ns = phase_ns[IMPLODE_PHASE_PATCH] +
+                        phase_ns[IMPLODE_PHASE_SWITCH];
+    unsigned long bytes_written;
+    
+    bytes_written = implode_write(output->data,
+                                  output->length,
+                                  fp_out,
+                                  space_left,
+                                  max_reached);
+    
+    other_ns = phase_ns[IMPLODE_PHASE_PATCH] +
+               phase_ns[IMPLODE_PHASE_SWITCH] - other_ns;
+    phase_ns[IMPLODE_PHASE_WRITE] += implode_time_ns() - start - other_ns;
+    
+    return bytes_written;
+}
+
+// Show where the time went over the archive (-s). Whatever isn't in one of
+// the phases (opening input files, printing) is shown as other.
+void print_phase_times( uint64_t wall_ns, bool threaded )
+{
+    uint64_t total_ns = 0;
+    
+    printf("\n  Phase                 Time (s)     Share\n");
+    
+    for (int i = 0; i < IMPLODE_PHASE_COUNT; i++)
+    {
+        printf("  %-20s%10.4f   %6.1f%%\n", phase_names[i],
+               phase_ns[i] / 1e9,
+               wall_ns ? 100.0 * phase_ns[i] / wall_ns : 0);
+        total_ns += phase_ns[i];
+    }
+    
+    total_ns = (wall_ns > total_ns) ? wall_ns - total_ns : 0;
+    
+    printf("  %-20s%10.4f   %6.1f%%\n", "Other", total_ns / 1e9,
+           wall_ns ? 100.0 * total_ns / wall_ns : 0);
+    printf("  %-20s%10.4f\n", "Wall time", wall_ns / 1e9);
+    
+    if (threaded)
+    {
+        printf("  (Times on worker threads are summed over the threads.)\n");
+    }
+}
 
 int pack_lfg(lfg_window_size_type dictionary_size,
              unsigned int literal_mode,
@@ -223,6 +853,9 @@ int pack_lfg(lfg_window_size_type dictionary_size,
              unsigned long first_disk_size,
              unsigned long disk_size,
              unsigned int optimize_level,
+             unsigned int thread_count,
+             unsigned long chunk_size,
+             bool block_mode,
              bool verbose)
 {
     
@@ -239,10 +872,17 @@ int pack_lfg(lfg_window_size_type dictionary_size,
     unsigned long space_left = first_disk_size;
     next_disk_size = disk_size;
     disk_count = 1;
+    archive_total_length = 0;
     implode_dictionary_size_type window_size_val;
     implode_stats_type implode_stats;
     unsigned int optimization_level;
     char filename[14] = {0};
+    double elapsed;
+    pack_queue_type queue = {0};
+    pthread_t* threads = NULL;
+    int threads_started = 0;
+    block_index_entry_type* block_indexes = NULL;
+    char index_path[261];
     
     if (strlen(archive)>256)
     {
@@ -252,8 +892,29 @@ int pack_lfg(lfg_window_size_type dictionary_size,
     
     strncpy(full_archive_path, archive, 256);
     
+    if (block_mode)
+    {
+        // Trials aren't run per block; use the best single level instead.
+        if (optimize_level == 5)
+        {
+            optimize_level = 3;
+        }
+        
+        block_indexes = calloc(num_files > 0 ? num_files : 1,
+                               sizeof(block_index_entry_type));
+        
+        if (block_indexes == NULL)
+        {
+            printf("Error: out of memory.\n");
+            return -1;
+        }
+    }
+    
     // Profiling
-    clock_t start, stop;
+    uint64_t pack_start = implode_time_ns();
+    uint64_t start, stop;
+    
+    memset(phase_ns, 0, sizeof(phase_ns));
     
     // currently archive must be filename only, no path
     // Create archive
@@ -315,21 +976,64 @@ int pack_lfg(lfg_window_size_type dictionary_size,
     // Account for initial archive header
     space_left-=28;
     
+    // With more than one thread, members are imploded ahead of time into
+    // memory by worker threads. They are still written out here one at a
+    // time, in order, so the archive comes out the same as when serial.
+    if (thread_count > 1)
+    {
+        threads = malloc(thread_count * sizeof(pthread_t));
+        
+        if (threads != NULL)
+        {
+            threads_started = start_pack_workers(&queue,
+                                                 threads,
+                                                 thread_count,
+                                                 file_list,
+                                                 num_files,
+                                                 dictionary_size,
+                                                 literal_mode,
+                                                 optimize_level,
+                                                 chunk_size,
+                                                 block_mode);
+        }
+    }
+    
     while (file_num < num_files) {
         
+        pack_member_type* member = NULL;
+        uint64_t member_start = implode_time_ns();
+        
         if (strlen(file_list[file_num])==0)
         {
             continue;
         }
         
-        // Open for binary read
-        fp_in=fopen(file_list[file_num], "rb");
-        
-        if (fp_in == 0)
+        if (threads_started)
         {
-            printf("Error opening file %s.\n\n", file_list[file_num]);
-            //free(full_archive_path);
-            return -1;
+            member = wait_for_member(&queue, file_num);
+            
+            if (member->error)
+            {
+                if (member->open_error)
+                {
+                    printf("Error opening file %s.\n\n", file_list[file_num]);
+                }
+                stop_pack_workers(&queue, threads, threads_started);
+                free(threads);
+                return -1;
+            }
+        }
+        else
+        {
+            // Open for binary read
+            fp_in=fopen(file_list[file_num], "rb");
+            
+            if (fp_in == 0)
+            {
+                printf("Error opening file %s.\n\n", file_list[file_num]);
+                //free(full_archive_path);
+                return -1;
+            }
         }
  
         //Remove path
@@ -337,10 +1041,19 @@ int pack_lfg(lfg_window_size_type dictionary_size,
         
         printf("  %-13s", filename); //file_list[file_num]);
         
-        // Find file length
-        fseek ( fp_in, 0, SEEK_END );
-        length = ftell( fp_in );
-        fseek ( fp_in, 0, SEEK_SET );
+        if (member)
+        {
+            length = member->length;
+        }
+        else
+        {
+            // Find file length
+            fseek ( fp_in, 0, SEEK_END );
+            length = ftell( fp_in );
+            fseek ( fp_in, 0, SEEK_SET );
+        }
+        
+        start = implode_time_ns();
         
         // Output "FILE" tag
         fwrite( file_string, sizeof(unsigned char), 4, fp_out);
@@ -356,6 +1069,12 @@ int pack_lfg(lfg_window_size_type dictionary_size,
         strncpy( file_name, file_list[file_num++], 13);
         fwrite( file_name, sizeof(unsigned char), 13, fp_out);
         
+        if (block_mode)
+        {
+            memcpy(block_indexes[file_num - 1].filename, file_name, 13);
+            block_indexes[file_num - 1].final_length = length;
+        }
+        
         // Write 0
         fputc( 0, fp_out);
         
@@ -366,6 +1085,8 @@ int pack_lfg(lfg_window_size_type dictionary_size,
         fputc( 2, fp_out);
         fputc( 0, fp_out);
         write_le_word(1, fp_out);  // 1, 0, 0, 0
+        
+        phase_ns[IMPLODE_PHASE_WRITE] += implode_time_ns() - start;
 
         // Track sum of uncompressed bytes
         bytes_needed += length;
@@ -373,57 +1094,161 @@ int pack_lfg(lfg_window_size_type dictionary_size,
         // Account for header
         space_left-=32;
         
-        if  (dictionary_size == LFG_DEFAULT)
+        if (member)
         {
-            if (length <= 1024)
+            // Already imploded, only needs copying in (and splitting
+            // across disks).
+            literal_mode = member->literal_mode;
+            window_size_val = member->window_size;
+            optimization_level = member->optimization_level;
+            implode_stats = member->stats;
+            add_phase_times(&implode_stats);
+            
+            bytes_written = write_member_data(&member->output, &space_left);
+            
+            elapsed = member->elapsed;
+            
+            // The block index now belongs to the archive's index.
+            if (block_mode)
             {
-                window_size_val = IMPLODE_1K_DICTIONARY;
+                block_indexes[file_num - 1].blocks = member->blocks;
+                member->blocks = (implode_block_index_type) {0};
             }
-            else if (length <=2048)
+            
+            release_member(&queue, file_num - 1);
+        }
+        else if (optimize_level==5)
+        {
+            // Load the file once and try the configurations on it in
+            // memory. Only the best result is written to the archive.
+            implode_buffer_type best_output = {0};
+            unsigned char* file_data;
+            
+            window_size_val = select_window_size(dictionary_size, length);
+            
+            // Time implode operation
+            start = implode_time_ns();
+            
+            file_data = read_file_data(fp_in, length);
+            
+            if (file_data == NULL)
             {
-                window_size_val = IMPLODE_2K_DICTIONARY;
+                fclose(fp_in);
+                return -1;
             }
-            else
+            
+            phase_ns[IMPLODE_PHASE_READ] += implode_time_ns() - start;
+            
+            if (!find_best_implode( file_data,
+                                    length,
+                                    &literal_mode,
+                                    &window_size_val,
+                                    &optimization_level,
+                                    &best_output,
+                                    &implode_stats,
+                                    processor_count()))
             {
-                window_size_val = IMPLODE_4K_DICTIONARY;
+                free(file_data);
+                fclose(fp_in);
+                return -1;
             }
+            
+            add_phase_times(&implode_stats);
+            
+            bytes_written = write_member_data(&best_output, &space_left);
+            
+            stop = implode_time_ns();
+            elapsed = (stop - start) / 1e9;
+            
+            implode_buffer_free(&best_output);
+            free(file_data);
+            fclose(fp_in);
         }
-        else
+        else if (block_mode || (chunk_size && (length > chunk_size)))
         {
-            window_size_val = (implode_dictionary_size_type) dictionary_size;
-        }
-        
-        if (optimize_level==5)
-        {
-            find_best_implode( fp_in,
+            // Large file, or block mode. Implode it in chunks, all at once,
+            // then write the joined result.
+            implode_buffer_type output = {0};
+            unsigned char* file_data;
+            
+            window_size_val = select_window_size(dictionary_size, length);
+            optimization_level = optimize_level;
+            
+            // Time implode operation
+            start = implode_time_ns();
+            
+            file_data = read_file_data(fp_in, length);
+            
+            if (file_data == NULL)
+            {
+                fclose(fp_in);
+                return -1;
+            }
+            
+            phase_ns[IMPLODE_PHASE_READ] += implode_time_ns() - start;
+            
+            if (implode_chunks(file_data,
                                length,
-                               &literal_mode,
-                               &window_size_val,
-                               &optimization_level);
+                               &output,
+                               literal_mode,
+                               window_size_val,
+                               optimization_level,
+                               chunk_size,
+                               block_mode,
+                               processor_count(),
+                               &implode_stats,
+                               block_mode ?
+                                   &block_indexes[file_num - 1].blocks :
+                                   NULL) == 0)
+            {
+                // Don't write a stream cut short by an error.
+                implode_buffer_free(&output);
+                free(file_data);
+                fclose(fp_in);
+                return -1;
+            }
+            
+            add_phase_times(&implode_stats);
+            
+            bytes_written = write_member_data(&output, &space_left);
+            
+            stop = implode_time_ns();
+            elapsed = (stop - start) / 1e9;
+            
+            implode_buffer_free(&output);
+            free(file_data);
+            fclose(fp_in);
         }
         else
         {
+            window_size_val = select_window_size(dictionary_size, length);
             optimization_level = optimize_level;
+            
+            // Time implode operation
+            start = implode_time_ns();
+            
+            bytes_written = implode(fp_in,
+                                    fp_out,
+                                    length,
+                                    literal_mode,
+                                    window_size_val,
+                                    optimization_level,
+                                    &implode_stats,
+                                    &space_left,
+                                    max_reached);
+            
+            stop = implode_time_ns();
+            elapsed = (stop - start) / 1e9;
+            
+            // Switching disks was timed by max_reached().
+            add_phase_times(&implode_stats);
+            
+            fclose(fp_in);
         }
         
-        // Time implode operation
-        start = clock();
-        
-        bytes_written = implode(fp_in,
-                                fp_out,
-                                length,
-                                literal_mode,
-                                window_size_val,
-                                optimization_level,
-                                &implode_stats,
-                                &space_left,
-                                max_reached);        
-
-        stop = clock();
-        
         file_count++;
         
-        fclose(fp_in);
+        start = implode_time_ns();
         
         // Fill in compressed file length
         fseek(fp_current_file_start, compressed_length_location, SEEK_SET);
@@ -437,6 +1262,12 @@ int pack_lfg(lfg_window_size_type dictionary_size,
         
         // Move back to end of file
         fseek ( fp_out, 0, SEEK_END );
+        
+        phase_ns[IMPLODE_PHASE_PATCH] += implode_time_ns() - start;
+        
+        // With workers, this is waiting for the member and writing it.
+        implode_trace(filename, "member", member_start, length,
+                      bytes_written + 8);
 
         printf("   %10ld",  bytes_written+8);
         printf("     %10ld", length);
@@ -468,18 +1299,28 @@ int pack_lfg(lfg_window_size_type dictionary_size,
             {
                 printf("          N/A         N/A");
             }
-            printf("     %7.3f", (double)(stop - start) / CLOCKS_PER_SEC);
+            printf("     %7.3f", elapsed);
             printf("             %d", optimization_level);
         }
         printf("\n");
     }
     
+    if (threads_started)
+    {
+        stop_pack_workers(&queue, threads, threads_started);
+    }
+    free(threads);
+    
+    start = implode_time_ns();
+    
     // Calculate archive length and fill in
     archive_length = (unsigned int)(ftell(fp_out) - 8);
     /// fp_start
     fseek(fp_out, length_location, SEEK_SET);
     write_le_word(archive_length, fp_out);
     
+    phase_ns[IMPLODE_PHASE_PATCH] += implode_time_ns() - start;
+    
     archive_total_length += archive_length + 8;
 
     printf("------------------------------------------------------------------------------" );
@@ -493,6 +1334,8 @@ int pack_lfg(lfg_window_size_type dictionary_size,
     if (disk_count > 1) printf ("s");
     printf(".\n");
 
+    start = implode_time_ns();
+    
     // Fill in the disk
     fseek(fp_first, disk_count_location, SEEK_SET);
     fputc( (char)(disk_count & 0xFF), fp_first);
@@ -500,10 +1343,34 @@ int pack_lfg(lfg_window_size_type dictionary_size,
     // Fill in the overall bytes needed
     fseek(fp_first, space_needed_location, SEEK_SET);
     write_le_word(bytes_needed, fp_first);
+    
+    phase_ns[IMPLODE_PHASE_PATCH] += implode_time_ns() - start;
+    
     fclose(fp_first);
     
-    if (fp_out) fclose(fp_out);
-    if (fp_current_file_start) fclose(fp_current_file_start);
+    // Any earlier disk files, including the one the last member started
+    // on, have already been closed.
+    if (fp_out != fp_first) fclose(fp_out);
+    
+    if (verbose)
+    {
+        print_phase_times(implode_time_ns() - pack_start,
+                          threads_started || (optimize_level == 5) ||
+                          block_mode || chunk_size);
+    }
+    
+    // Block index goes next to the first archive file.
+    if (block_mode)
+    {
+        snprintf(index_path, sizeof(index_path), "%s.idx", archive);
+        write_block_index(index_path, block_indexes, file_count);
+        
+        for (int i=0; i<num_files; i++)
+        {
+            implode_block_index_free(&block_indexes[i].blocks);
+        }
+        free(block_indexes);
+    }
     
     return 0;
 }
@@ -54,6 +54,28 @@
  header and then continue immediately with compressed data from where previous
  file left off.
  
+                   -- Block index (LFGMake -b) [archive].idx --
+ 
+ Written next to the first archive file. Not part of the original format;
+ archives made in block mode are still ordinary archives. Each block of a
+ file can be exploded on its own, as no dictionary lookup reaches back past
+ the start of its block.
+ 
+ [Location][Len][Description]
+ 0000-0003	4	'LFGI'
+ 0004-0007	4	Number of files indexed.
+ --------------- REPEAT FOR EACH FILE ------------------------------------------
+            13	File name, as in the archive.
+            4	Final length of expanded file (in bytes).
+            4	Block size (in bytes).
+            4	Number of blocks.
+ --------------- REPEAT FOR EACH BLOCK -----------------------------------------
+            4	Start of block in the compressed file data, in bits (counted
+                from the first of the two implode header bytes).
+            4	Start of block in the expanded file (in bytes).
+ -------------------------------------------------------------------------------
+ All values least significant byte first.
+ 
   */
 
 
@@ -78,6 +100,38 @@ int pack_lfg(lfg_window_size_type dictionary_size,
              unsigned long first_disk_size,
              unsigned long disk_size,
              unsigned int optimize_level,
+             unsigned int thread_count,
+             unsigned long chunk_size,
+             bool block_mode,
              bool verbose);
 
+/* Helpers shared with the configuration report (report_lfg.c). */
+
+/* Read a whole file into memory (length bytes, plus one spare). Returns
+   NULL on failure.
+*/
+unsigned char* read_file_data( FILE * in_file,
+                               unsigned long length);
+
+/* Number of processors available, for sizing thread counts. */
+unsigned int processor_count( void );
+
+/* Dictionary size LFGMake uses for a member of the given length. */
+implode_dictionary_size_type select_window_size(
+                                        lfg_window_size_type dictionary_size,
+                                        long length);
+
+/* Implode as optimization level 5 does: try several configurations at
+   once, on up to thread_count threads, and keep the smallest result, which
+   the caller frees. Returns false if no configuration could be imploded.
+*/
+bool find_best_implode( const unsigned char * data,
+                        unsigned long length,
+                        unsigned int * literal_encode_mode,
+                        implode_dictionary_size_type *window_size,
+                        unsigned int *optimization_level,
+                        implode_buffer_type *best_output,
+                        implode_stats_type *best_stats,
+                        unsigned int thread_count);
+
 #endif /* lfgpack_h */
@@ -0,0 +1,461 @@
+//
+//  report_lfg.c
+//  LFGMake
+//
+//  Configuration report (LFGMake -r). Each configuration is a full pass
+//  over the files, imploded in memory and only counted, so the archive size
+//  is that of a single disk archive. Times are CPU time, so that running
+//  configurations side by side doesn't skew them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "implode.h"
+#include "pack_lfg.h"
+#include "report_lfg.h"
+
+#define ARCHIVE_HEADER_LENGTH   28
+#define MEMBER_HEADER_LENGTH    32
+
+typedef struct
+{
+    unsigned char * data;
+    unsigned long length;
+} report_file_type;
+
+typedef struct
+{
+    unsigned int optimization_level;
+    lfg_window_size_type dictionary_size;   // LFG_DEFAULT as with no -w
+    unsigned int literal_mode;
+    
+    double seconds;
+    unsigned long archive_length;
+    implode_stats_type stats;               // Counts summed over files
+    bool pareto;
+} report_config_type;
+
+typedef struct
+{
+    const report_file_type * files;
+    int file_count;
+    report_config_type * configs;
+    int config_count;
+    int next_config;
+    pthread_mutex_t lock;
+} report_queue_type;
+
+unsigned int report_levels[] = { 0, 1, 2, 3 };
+
+lfg_window_size_type report_windows[] = {
+    LFG_DEFAULT, LFG_WINDOW_1K, LFG_WINDOW_2K, LFG_WINDOW_4K
+};
+
+#define REPORT_LEVEL_COUNT  (sizeof(report_levels) / sizeof(report_levels[0]))
+#define REPORT_WINDOW_COUNT (sizeof(report_windows) / \
+                             sizeof(report_windows[0]))
+
+void add_report_stats( implode_stats_type * total,
+                       const implode_stats_type * stats )
+{
+    total->literal_count += stats->literal_count;
+    total->lookup_count += stats->lookup_count;
+}
+
+// Pack every file under one configuration (levels 0-3).
+void run_report_config( const report_file_type * files,
+                        int file_count,
+                        report_config_type * config )
+{
+    struct timespec start, stop;
+    
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    
+    config->archive_length = ARCHIVE_HEADER_LENGTH;
+    
+    for (int i = 0; i < file_count; i++)
+    {
+        implode_stats_type stats = {0};
+        
+        config->archive_length += MEMBER_HEADER_LENGTH;
+        config->archive_length +=
+            implode_memory(files[i].data,
+                           files[i].length,
+                           NULL,
+                           config->literal_mode,
+                           select_window_size(config->dictionary_size,
+                                              files[i].length),
+                           config->optimization_level,
+                           NULL,
+                           &stats);
+        
+        add_report_stats(&config->stats, &stats);
+    }
+    
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &stop);
+    
+    config->seconds = (stop.tv_sec - start.tv_sec) +
+                      (stop.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+double process_cpu_seconds( void )
+{
+    struct rusage usage;
+    
+    getrusage(RUSAGE_SELF, &usage);
+    
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// Pack every file as level 5 does. Its trials run on threads of their own,
+// so this runs by itself and takes the CPU time of the whole process.
+// False if a file couldn't be imploded.
+bool run_report_best( const report_file_type * files,
+                      int file_count,
+                      report_config_type * config )
+{
+    double start = process_cpu_seconds();
+    
+    config->archive_length = ARCHIVE_HEADER_LENGTH;
+    
+    for (int i = 0; i < file_count; i++)
+    {
+        implode_buffer_type output = {0};
+        implode_stats_type stats = {0};
+        unsigned int literal_mode;
+        implode_dictionary_size_type window_size;
+        unsigned int optimization_level;
+        
+        if (!find_best_implode(files[i].data,
+                               files[i].length,
+                               &literal_mode,
+                               &window_size,
+                               &optimization_level,
+                               &output,
+                               &stats,
+                               processor_count()))
+        {
+            return false;
+        }
+        
+        config->archive_length += MEMBER_HEADER_LENGTH + output.length;
+        add_report_stats(&config->stats, &stats);
+        implode_buffer_free(&output);
+    }
+    
+    config->seconds = process_cpu_seconds() - start;
+    
+    return true;
+}
+
+void* report_worker( void* queue_ptr )
+{
+    report_queue_type* queue = queue_ptr;
+    
+    while (1)
+    {
+        int config_num;
+        
+        pthread_mutex_lock(&queue->lock);
+        config_num = queue->next_config++;
+        pthread_mutex_unlock(&queue->lock);
+        
+        if (config_num >= queue->config_count)
+        {
+            break;
+        }
+        
+        run_report_config(queue->files, queue->file_count,
+                          &queue->configs[config_num]);
+    }
+    
+    return NULL;
+}
+
+// Run the level 0-3 configurations on thread_count threads.
+void run_report_configs( report_queue_type * queue,
+                         unsigned int thread_count )
+{
+    pthread_t* threads = malloc(thread_count * sizeof(pthread_t));
+    unsigned int started = 0;
+    
+    pthread_mutex_init(&queue->lock, NULL);
+    
+    while (threads && (started < thread_count) &&
+           (started < (unsigned int) queue->config_count))
+    {
+        if (pthread_create(&threads[started], NULL, report_worker,
+                           queue) != 0)
+        {
+            break;
+        }
+        started++;
+    }
+    
+    // Without threads, do the work here.
+    if (started == 0)
+    {
+        report_worker(queue);
+    }
+    
+    for (unsigned int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    
+    pthread_mutex_destroy(&queue->lock);
+    free(threads);
+}
+
+// A configuration is Pareto optimal when no other is at least as fast and
+// as small, and better in one of the two.
+void mark_pareto( report_config_type * configs, int config_count )
+{
+    for (int i = 0; i < config_count; i++)
+    {
+        configs[i].pareto = true;
+        
+        for (int j = 0; j < config_count; j++)
+        {
+            if ((j != i) &&
+                (configs[j].seconds <= configs[i].seconds) &&
+                (configs[j].archive_length <= configs[i].archive_length) &&
+                ((configs[j].seconds < configs[i].seconds) ||
+                 (configs[j].archive_length < configs[i].archive_length)))
+            {
+                configs[i].pareto = false;
+                break;
+            }
+        }
+    }
+}
+
+// Dictionary size and literal mode as LFGMake options.
+void config_options( const report_config_type * config,
+                     char * window,
+                     char * literals )
+{
+    if (config->optimization_level == 5)
+    {
+        strcpy(window, "auto");
+        strcpy(literals, "auto");
+        return;
+    }
+    
+    if (config->dictionary_size == LFG_DEFAULT)
+    {
+        strcpy(window, "auto");
+    }
+    else
+    {
+        sprintf(window, "%d", 1 << (config->dictionary_size - 4));
+    }
+    
+    strcpy(literals, config->literal_mode ? "ascii" : "binary");
+}
+
+double megabytes_per_second( unsigned long length, double seconds )
+{
+    return (seconds > 0) ? length / seconds / 1e6 : 0;
+}
+
+void print_report( const report_config_type * configs,
+                   int config_count,
+                   unsigned long total_length )
+{
+    int pareto_count = 0;
+    
+    printf("\n  Level  -w      Literals     CPU (s)      MB/s    ");
+    printf("Archive (B)    Ratio  Pareto\n");
+    printf("------------------------------------------------------------");
+    printf("------------------------\n");
+    
+    for (int i = 0; i < config_count; i++)
+    {
+        char window[8], literals[8];
+        
+        config_options(&configs[i], window, literals);
+        
+        printf("  %5u  %-6s  %-8s  %10.3f  %8.2f  %13lu  %6.2f%%  %s\n",
+               configs[i].optimization_level, window, literals,
+               configs[i].seconds,
+               megabytes_per_second(total_length, configs[i].seconds),
+               configs[i].archive_length,
+               100 - (float)(configs[i].archive_length * 100) / total_length,
+               configs[i].pareto ? "*" : "");
+        
+        pareto_count += configs[i].pareto;
+    }
+    
+    printf("------------------------------------------------------------");
+    printf("------------------------\n");
+    printf("%d of %d configurations are Pareto optimal (*).\n",
+           pareto_count, config_count);
+}
+
+int write_report_json( const char * json_path,
+                       const report_config_type * configs,
+                       int config_count,
+                       int file_count,
+                       unsigned long total_length )
+{
+    FILE* fp = fopen(json_path, "w");
+    
+    if (!fp)
+    {
+        printf("Error creating file %s for report.\n\n", json_path);
+        return -1;
+    }
+    
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"files\": %d,\n", file_count);
+    fprintf(fp, "  \"bytes\": %lu,\n", total_length);
+    fprintf(fp, "  \"configurations\": [\n");
+    
+    for (int i = 0; i < config_count; i++)
+    {
+        char window[8], literals[8];
+        
+        config_options(&configs[i], window, literals);
+        
+        fprintf(fp, "    { \"level\": %u, \"window\": \"%s\", "
+                    "\"literals\": \"%s\", ",
+                configs[i].optimization_level, window, literals);
+        fprintf(fp, "\"cpu_seconds\": %.6f, \"mb_per_second\": %.3f, ",
+                configs[i].seconds,
+                megabytes_per_second(total_length, configs[i].seconds));
+        fprintf(fp, "\"archive_bytes\": %lu, \"literal_count\": %ld, "
+                    "\"lookup_count\": %ld, \"pareto\": %s }%s\n",
+                configs[i].archive_length,
+                configs[i].stats.literal_count,
+                configs[i].stats.lookup_count,
+                configs[i].pareto ? "true" : "false",
+                (i + 1 < config_count) ? "," : "");
+    }
+    
+    fprintf(fp, "  ]\n");
+    fprintf(fp, "}\n");
+    fclose(fp);
+    
+    printf("Report written to %s.\n", json_path);
+    return 0;
+}
+
+int report_lfg(char** file_list,
+               int num_files,
+               const char* json_path,
+               unsigned int thread_count)
+{
+    report_file_type* files = calloc(num_files > 0 ? num_files : 1,
+                                     sizeof(report_file_type));
+    report_config_type configs[REPORT_LEVEL_COUNT * REPORT_WINDOW_COUNT * 2
+                               + 1] = {{0}};
+    report_queue_type queue = {0};
+    unsigned long total_length = 0;
+    int config_count = 0;
+    int result = 0;
+    
+    if (files == NULL)
+    {
+        printf("Error: out of memory.\n");
+        return -1;
+    }
+    
+    // Load every file once; all configurations share the data.
+    for (int i = 0; (i < num_files) && (result == 0); i++)
+    {
+        FILE* fp_in = fopen(file_list[i], "rb");
+        
+        if (fp_in == NULL)
+        {
+            printf("Error opening file %s.\n\n", file_list[i]);
+            result = -1;
+            break;
+        }
+        
+        fseek(fp_in, 0, SEEK_END);
+        files[i].length = ftell(fp_in);
+        fseek(fp_in, 0, SEEK_SET);
+        
+        files[i].data = read_file_data(fp_in, files[i].length);
+        fclose(fp_in);
+        
+        if (files[i].data == NULL)
+        {
+            result = -1;
+        }
+        
+        total_length += files[i].length;
+    }
+    
+    if ((result == 0) && (total_length == 0))
+    {
+        printf("Error: nothing to pack.\n");
+        result = -1;
+    }
+    
+    if (result == 0)
+    {
+        for (int level = 0; level < REPORT_LEVEL_COUNT; level++)
+        {
+            for (int window = 0; window < REPORT_WINDOW_COUNT; window++)
+            {
+                for (int literal_mode = 0; literal_mode < 2; literal_mode++)
+                {
+                    configs[config_count].optimization_level =
+                        report_levels[level];
+                    configs[config_count].dictionary_size =
+                        report_windows[window];
+                    configs[config_count].literal_mode = literal_mode;
+                    config_count++;
+                }
+            }
+        }
+        
+        printf("\nPacking %d file(s), %lu bytes, under %d configurations "
+               "on %u thread(s)...\n",
+               num_files, total_length, config_count + 1, thread_count);
+        
+        queue.files = files;
+        queue.file_count = num_files;
+        queue.configs = configs;
+        queue.config_count = config_count;
+        
+        run_report_configs(&queue, thread_count);
+        
+        configs[config_count].optimization_level = 5;
+        configs[config_count].dictionary_size = LFG_DEFAULT;
+        
+        if (!run_report_best(files, num_files, &configs[config_count]))
+        {
+            printf("Error: out of memory.\n");
+            result = -1;
+        }
+        config_count++;
+    }
+    
+    if (result == 0)
+    {
+        mark_pareto(configs, config_count);
+        print_report(configs, config_count, total_length);
+        
+        if (json_path)
+        {
+            result = write_report_json(json_path, configs, config_count,
+                                       num_files, total_length);
+        }
+    }
+    
+    for (int i = 0; i < num_files; i++)
+    {
+        free(files[i].data);
+    }
+    free(files);
+    
+    return result;
+}
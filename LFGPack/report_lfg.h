@@ -0,0 +1,24 @@
+//
+//  report_lfg.h
+//  LFGMake
+//
+
+#ifndef report_lfg_h
+#define report_lfg_h
+
+#include "pack_lfg.h"
+
+/* Pack the files under every configuration LFGMake offers (optimization
+   levels 0-3 with each dictionary size and literal mode, and level 5), in
+   memory, running configurations on up to thread_count threads.  Prints the
+   CPU time, throughput and archive size of each, marking those no other
+   configuration beats on both time and size (the Pareto optimal ones).  If
+   json_path is not NULL, the results are also written there as JSON.
+   Returns 0, or -1 on error.
+*/
+int report_lfg(char** file_list,
+               int num_files,
+               const char* json_path,
+               unsigned int thread_count);
+
+#endif /* report_lfg_h */
@@ -0,0 +1,187 @@
+//
+//  fuzz_explode.c
+//  LFGTest
+//
+//  libFuzzer target for the decoder. Each input is used twice:
+//
+//  As an imploded stream, decoded by explode_memory() and by
+//  extract_and_explode() on a file. Both may reject it, but whenever the
+//  memory decoder accepts it the file decoder must give the same bytes, and
+//  explode_parallel() and explode_pipelined() must either reject it or agree.
+//
+//  As data, imploded with settings taken from its first byte and exploded
+//  again, which must give it back.
+//
+//  Build with clang, for example:
+//      clang -g -O1 -fsanitize=fuzzer,address,undefined
+//            LFGTest/fuzz_explode.c LFGDump/explode.c LFGPack/implode.c
+//            -lpthread -o fuzz_explode
+//      ./fuzz_explode -close_fd_mask=1 corpus_dir
+//  (-close_fd_mask=1 hides the decoders' error messages.) Without libFuzzer,
+//  build with -DFUZZ_STANDALONE to run it over files named on the command
+//  line.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "../LFGDump/explode.h"
+#include "../LFGPack/implode.h"
+
+#define FUZZ_MAX_OUTPUT     0x10000
+    // Output limit for decoding inputs as streams.
+
+// Decoded bytes of a stream, from a file, as extract_and_explode() writes
+// them.
+long fuzz_explode_file( const uint8_t* data,
+                        size_t size,
+                        unsigned char* out_data,
+                        unsigned long out_length )
+{
+    FILE* in_fp = tmpfile();
+    FILE* out_fp = tmpfile();
+    long length = 0;
+    
+    if (!in_fp || !out_fp)
+    {
+        abort();
+    }
+    
+    fwrite(data, 1, size, in_fp);
+    rewind(in_fp);
+    
+    extract_and_explode(in_fp, out_fp, 0, NULL, NULL);
+    
+    fflush(out_fp);
+    length = ftell(out_fp);
+    rewind(out_fp);
+    
+    if (fread(out_data, 1,
+              (length < out_length) ? length : out_length, out_fp) == 0)
+    {
+        length = 0;
+    }
+    
+    fclose(in_fp);
+    fclose(out_fp);
+    
+    return length;
+}
+
+void fuzz_decode( const uint8_t* data, size_t size )
+{
+    unsigned char* memory_out = malloc(FUZZ_MAX_OUTPUT);
+    unsigned char* file_out = malloc(FUZZ_MAX_OUTPUT);
+    unsigned char* other_out = malloc(FUZZ_MAX_OUTPUT);
+    long memory_length, file_length, length;
+    
+    memory_length = explode_memory(data, size, 16, memory_out, 0,
+                                   FUZZ_MAX_OUTPUT, NULL);
+    file_length = fuzz_explode_file(data, size, file_out, FUZZ_MAX_OUTPUT);
+    
+    if (memory_length > 0)
+    {
+        if ((file_length < memory_length) ||
+            ((memory_length < FUZZ_MAX_OUTPUT) &&
+             (file_length != memory_length)) ||
+            memcmp(file_out, memory_out, memory_length))
+        {
+            abort();
+        }
+        
+        length = explode_parallel(data, size, other_out, memory_length,
+                                  4, NULL);
+        if ((length >= 0) &&
+            ((length != memory_length) ||
+             memcmp(other_out, memory_out, memory_length)))
+        {
+            abort();
+        }
+        
+        length = explode_pipelined(data, size, other_out, memory_length,
+                                   NULL);
+        if ((length >= 0) &&
+            ((length != memory_length) ||
+             memcmp(other_out, memory_out, memory_length)))
+        {
+            abort();
+        }
+    }
+    
+    free(other_out);
+    free(file_out);
+    free(memory_out);
+}
+
+void fuzz_round_trip( const uint8_t* data, size_t size )
+{
+    implode_buffer_type stream = {0};
+    unsigned char* out_data;
+    long length;
+    
+    if (size < 1)
+    {
+        return;
+    }
+    
+    // Settings from the first byte, the rest is the data.
+    implode_memory(data + 1, size - 1, &stream,
+                   data[0] & 0x1,
+                   IMPLODE_1K_DICTIONARY + ((data[0] >> 1) & 0x3) % 3,
+                   (data[0] >> 3) & 0x3,
+                   NULL, NULL);
+    
+    out_data = malloc(size);
+    length = explode_memory(stream.data, stream.length, 16, out_data, 0,
+                            size - 1, NULL);
+    
+    if ((length != size - 1) || memcmp(out_data, data + 1, size - 1))
+    {
+        abort();
+    }
+    
+    free(out_data);
+    implode_buffer_free(&stream);
+}
+
+int LLVMFuzzerTestOneInput( const uint8_t* data, size_t size )
+{
+    fuzz_decode(data, size);
+    fuzz_round_trip(data, size);
+    
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+int main( int argc, const char * argv[] )
+{
+    for (int i = 1; i < argc; i++)
+    {
+        FILE* fp = fopen(argv[i], "rb");
+        uint8_t* data;
+        long size;
+        
+        if (!fp)
+        {
+            printf("Error: Unable to open %s.\n", argv[i]);
+            return 1;
+        }
+        
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+        rewind(fp);
+        
+        data = malloc(size ? size : 1);
+        if (fread(data, 1, size, fp) != size)
+        {
+            size = 0;
+        }
+        fclose(fp);
+        
+        LLVMFuzzerTestOneInput(data, size);
+        free(data);
+    }
+    
+    return 0;
+}
+#endif
@@ -0,0 +1,293 @@
+//
+//  generate.c
+//  LFGTest
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "generate.h"
+
+#define BITMAP_WIDTH    320
+
+const char* generate_kind_names[GENERATE_KIND_COUNT] = {
+    "text", "bitmap", "audio", "runs", "noise"
+};
+
+const char* generate_words[] = {
+    "the", "you", "I", "a", "to", "it", "that", "is", "of", "and", "me",
+    "what", "this", "can", "look", "here", "there", "pick", "up", "use",
+    "open", "close", "give", "talk", "walk", "push", "pull", "key", "door",
+    "map", "ship", "island", "treasure", "grog", "monkey", "idol", "whip",
+    "temple", "stone", "rope", "chest", "pirate", "captain", "crew",
+    "sword", "fight", "insult", "answer", "never", "always", "maybe",
+    "think", "know", "want", "need", "find", "get", "have", "don't",
+    "won't", "really", "very", "quite", "nothing", "something", "wait"
+};
+
+const char* generate_speakers[] = {
+    "GUYBRUSH", "ELAINE", "LECHUCK", "STAN", "INDY", "SOPHIA", "BERNARD",
+    "HOAGIE", "LAVERNE", "BOBBIN"
+};
+
+#define WORD_COUNT      (sizeof(generate_words) / sizeof(generate_words[0]))
+#define SPEAKER_COUNT   (sizeof(generate_speakers) / \
+                         sizeof(generate_speakers[0]))
+
+const char* generate_kind_name( generate_kind_type kind )
+{
+    if (kind >= GENERATE_KIND_COUNT)
+    {
+        return "unknown";
+    }
+    return generate_kind_names[kind];
+}
+
+generate_kind_type generate_kind_from_name( const char* name )
+{
+    for (int i = 0; i < GENERATE_KIND_COUNT; i++)
+    {
+        if (strcmp(name, generate_kind_names[i]) == 0)
+        {
+            return i;
+        }
+    }
+    return GENERATE_KIND_COUNT;
+}
+
+uint32_t generate_random( uint32_t* state )
+{
+    uint32_t x = *state;
+    
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    
+    *state = x;
+    return x;
+}
+
+// Append a string, cut short at the end of the data.
+unsigned long append_text( unsigned char* data,
+                           unsigned long position,
+                           unsigned long length,
+                           const char* text )
+{
+    while (*text && (position < length))
+    {
+        data[position++] = *text++;
+    }
+    return position;
+}
+
+// Lines of dialog and script commands.
+void generate_text( unsigned char* data,
+                    unsigned long length,
+                    uint32_t* random )
+{
+    unsigned long position = 0;
+    char number[16];
+    
+    while (position < length)
+    {
+        uint32_t choice = generate_random(random) % 8;
+        
+        if (choice == 0)
+        {
+            // Script command.
+            position = append_text(data, position, length, "actor ");
+            snprintf(number, sizeof(number), "%u",
+                     generate_random(random) % 16);
+            position = append_text(data, position, length, number);
+            position = append_text(data, position, length, " walk-to ");
+            snprintf(number, sizeof(number), "%u,%u",
+                     generate_random(random) % 320,
+                     generate_random(random) % 200);
+            position = append_text(data, position, length, number);
+        }
+        else
+        {
+            int words = 3 + generate_random(random) % 12;
+            
+            position = append_text(data, position, length,
+                generate_speakers[generate_random(random) % SPEAKER_COUNT]);
+            position = append_text(data, position, length, ": ");
+            
+            for (int i = 0; i < words; i++)
+            {
+                if (i)
+                {
+                    position = append_text(data, position, length, " ");
+                }
+                position = append_text(data, position, length,
+                    generate_words[generate_random(random) % WORD_COUNT]);
+            }
+            
+            position = append_text(data, position, length,
+                                   (choice == 1) ? "?" : ".");
+        }
+        
+        position = append_text(data, position, length, "\r\n");
+    }
+}
+
+// Rows of runs from a small palette, each row usually a lightly changed
+// copy of the one above.
+void generate_bitmap( unsigned char* data,
+                      unsigned long length,
+                      uint32_t* random )
+{
+    unsigned char base_color = generate_random(random) & 0xF0;
+    
+    for (unsigned long row = 0; row < length; row += BITMAP_WIDTH)
+    {
+        unsigned long row_length = length - row;
+        
+        if (row_length > BITMAP_WIDTH)
+        {
+            row_length = BITMAP_WIDTH;
+        }
+        
+        if (row && (generate_random(random) % 4))
+        {
+            memcpy(&data[row], &data[row - BITMAP_WIDTH], row_length);
+            
+            // A few short changes.
+            for (int i = generate_random(random) % 4; i > 0; i--)
+            {
+                unsigned long start = generate_random(random) % row_length;
+                unsigned long run = 1 + generate_random(random) % 12;
+                unsigned char color = base_color |
+                                      (generate_random(random) & 0x0F);
+                
+                for (unsigned long j = start;
+                     (j < start + run) && (j < row_length); j++)
+                {
+                    data[row + j] = color;
+                }
+            }
+            continue;
+        }
+        
+        // New row of runs, mostly short with some long ones.
+        for (unsigned long j = 0; j < row_length; )
+        {
+            unsigned long run = (generate_random(random) % 4) ?
+                                1 + generate_random(random) % 8 :
+                                16 + generate_random(random) % 64;
+            unsigned char color = base_color |
+                                  (generate_random(random) & 0x0F);
+            
+            for (; run && (j < row_length); run--)
+            {
+                data[row + j++] = color;
+            }
+        }
+        
+        // Occasionally move to another part of the palette.
+        if ((generate_random(random) % 64) == 0)
+        {
+            base_color = generate_random(random) & 0xF0;
+        }
+    }
+}
+
+// A couple of tones with a slowly changing volume, and a little hiss.
+void generate_audio( unsigned char* data,
+                     unsigned long length,
+                     uint32_t* random )
+{
+    double step1 = 0.01 + (generate_random(random) % 100) * 0.001;
+    double step2 = 0.05 + (generate_random(random) % 100) * 0.002;
+    double volume = 40.0;
+    
+    for (unsigned long i = 0; i < length; i++)
+    {
+        double sample;
+        
+        if ((i % 2048) == 0)
+        {
+            volume = 10.0 + generate_random(random) % 60;
+        }
+        
+        sample = 128.0 +
+                 volume * sin(step1 * i) +
+                 volume * 0.4 * sin(step2 * i) +
+                 (int)(generate_random(random) % 5) - 2;
+        
+        if (sample < 0.0)
+        {
+            sample = 0.0;
+        }
+        if (sample > 255.0)
+        {
+            sample = 255.0;
+        }
+        
+        data[i] = (unsigned char) sample;
+    }
+}
+
+// Runs of one of four byte values.
+void generate_runs( unsigned char* data,
+                    unsigned long length,
+                    uint32_t* random )
+{
+    unsigned char values[4];
+    
+    for (int i = 0; i < 4; i++)
+    {
+        values[i] = generate_random(random);
+    }
+    
+    for (unsigned long i = 0; i < length; )
+    {
+        unsigned long run = 1 + generate_random(random) % 255;
+        unsigned char value = values[generate_random(random) % 4];
+        
+        for (; run && (i < length); run--)
+        {
+            data[i++] = value;
+        }
+    }
+}
+
+void generate_data( generate_kind_type kind,
+                    unsigned char* data,
+                    unsigned long length,
+                    uint32_t seed )
+{
+    // Mix the seed so nearby seeds give unrelated data.
+    uint32_t random = (seed * 2654435761u) ^ 0x5EED1F6Bu;
+    
+    if (random == 0)
+    {
+        random = 1;
+    }
+    
+    switch (kind)
+    {
+        case GENERATE_TEXT:
+            generate_text(data, length, &random);
+            break;
+        
+        case GENERATE_BITMAP:
+            generate_bitmap(data, length, &random);
+            break;
+        
+        case GENERATE_AUDIO:
+            generate_audio(data, length, &random);
+            break;
+        
+        case GENERATE_RUNS:
+            generate_runs(data, length, &random);
+            break;
+        
+        default:
+            for (unsigned long i = 0; i < length; i++)
+            {
+                data[i] = generate_random(&random);
+            }
+            break;
+    }
+}
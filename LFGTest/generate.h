@@ -0,0 +1,41 @@
+//
+//  generate.h
+//  LFGTest
+//
+//  Synthetic test data shaped like the files found in LFG archives: script
+//  text, palettized bitmaps, 8-bit audio, plus runs and noise.  The same
+//  kind, length and seed always give the same bytes, so test and benchmark
+//  results can be compared between runs and machines.
+
+#ifndef generate_h
+#define generate_h
+
+#include <stdint.h>
+
+typedef enum {
+    GENERATE_TEXT = 0,      // Script-like ASCII text
+    GENERATE_BITMAP = 1,    // 320 wide, 8-bit palettized, long runs
+    GENERATE_AUDIO = 2,     // 8-bit unsigned PCM
+    GENERATE_RUNS = 3,      // Runs of a few byte values
+    GENERATE_NOISE = 4,     // Random bytes
+    GENERATE_KIND_COUNT = 5
+} generate_kind_type;
+
+/* Short lower case name of a kind ("text", "bitmap", ...). */
+const char* generate_kind_name( generate_kind_type kind );
+
+/* Kind with the given name, or GENERATE_KIND_COUNT if there is none. */
+generate_kind_type generate_kind_from_name( const char* name );
+
+/* Next value of a small xorshift random number generator. *state must not
+   be 0.
+*/
+uint32_t generate_random( uint32_t* state );
+
+/* Fill data with length bytes of the given kind. */
+void generate_data( generate_kind_type kind,
+                    unsigned char* data,
+                    unsigned long length,
+                    uint32_t seed );
+
+#endif /* generate_h */
@@ -0,0 +1,992 @@
+//
+//  lfgbench.c
+//  LFGTest
+//
+//  Throughput of implode_memory() and explode_memory() on generated data,
+//  for every literal mode, dictionary size and optimization level.  Each
+//  measurement is repeated, and the median and spread are reported so
+//  configurations can be compared and regressions spotted.
+//
+//  With -c, LFGMake and LFGDump are also run end to end over a corpus
+//  written by LFGCorpus, timing them and taking their peak memory use.
+//
+//  Results can be saved as a baseline (-w) and later runs checked against
+//  it (-b): throughput, compressed size and peak memory may each get worse
+//  by no more than a set percentage, or the run fails.  Baseline files hold
+//  one metric per line, as "name value".
+//
+//  With -p, hardware counters are read around each measurement as well (see
+//  perf_counters.h), giving instructions per cycle, cycles per byte and per
+//  token, and cache and branch misses per kilobyte.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include "../LFGDump/explode.h"
+#include "../LFGPack/implode.h"
+#include "generate.h"
+#include "perf_counters.h"
+
+#define MAX_REPETITIONS     100
+#define MAX_PATH_LENGTH     256
+#define MAX_METRIC_NAME     64
+
+#define BENCH_ARCHIVE       "BENCH__A.XXX"
+#define BENCH_OUTPUT        "BENCHOUT"
+
+typedef struct {
+    double median;          // Seconds
+    double deviation;       // Standard deviation, in seconds
+} timing_type;
+
+typedef struct {
+    generate_kind_type kind;
+    implode_literal_type literal_mode;
+    implode_dictionary_size_type dictionary_size;
+    unsigned int optimization_level;
+    unsigned long length;
+    unsigned long imploded_length;
+    unsigned long token_count;          // Literals and copies
+    timing_type implode_time;
+    timing_type explode_time;
+    perf_sample_type implode_counters;  // Per run
+    perf_sample_type explode_counters;
+} bench_result_type;
+
+typedef enum {
+    METRIC_SPEED,           // MB/s, higher is better
+    METRIC_RATIO,           // Compressed size in %, lower is better
+    METRIC_MEMORY           // Peak resident size in k, lower is better
+} metric_type;
+
+typedef struct {
+    char name[MAX_METRIC_NAME];
+    double value;
+    metric_type type;
+} bench_metric_type;
+
+typedef struct {
+    bench_metric_type* metrics;
+    int count;
+    int capacity;
+} metric_list_type;
+
+// Percentage each type of metric may get worse before a check fails.
+typedef struct {
+    double speed;
+    double ratio;
+    double memory;
+} threshold_type;
+
+unsigned int optimization_levels[] = { 0, 1, 2, 3, 5 };
+
+#define LEVEL_COUNT (sizeof(optimization_levels) / \
+                     sizeof(optimization_levels[0]))
+
+void print_usage( void )
+{
+    printf("Usage: LFGBench [options]\n");
+    printf("Measures implode and explode throughput on generated data.\n\n");
+    printf("   -b file         Check results against baseline file\n");
+    printf("   -c dir          Also run LFGMake and LFGDump over corpus dir\n");
+    printf("   -k kind         Only data of this kind (text, bitmap, audio, runs, noise)\n");
+    printf("   -l N            Only optimization level N\n");
+    printf("   -m N            Allowed peak memory growth in %% (default 10)\n");
+    printf("   -n N            Repetitions of each measurement (default 5)\n");
+    printf("   -p              Show hardware counters (Linux perf_event_open)\n");
+    printf("   -q N            Allowed compressed size growth in %% (default 0)\n");
+    printf("   -r seed         Random seed for the data (default 1)\n");
+    printf("   -s N            Size of the data in k (default 64)\n");
+    printf("   -t N            Allowed throughput loss in %% (default 15)\n");
+    printf("   -w file         Write results to baseline file\n");
+    printf("   -x dir          Where LFGMake and LFGDump are (default: with LFGBench)\n\n");
+}
+
+double now_seconds( void )
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+int compare_doubles( const void* a, const void* b )
+{
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    
+    return (x > y) - (x < y);
+}
+
+// Median and standard deviation of count samples (which get sorted).
+timing_type summarize( double* samples, int count )
+{
+    timing_type timing = { 0, 0 };
+    double mean = 0, sum = 0;
+    
+    if (count == 0)
+    {
+        return timing;
+    }
+    
+    qsort(samples, count, sizeof(samples[0]), compare_doubles);
+    
+    timing.median = (count % 2) ? samples[count / 2] :
+                    (samples[count / 2 - 1] + samples[count / 2]) / 2;
+    
+    for (int i = 0; i < count; i++)
+    {
+        mean += samples[i];
+    }
+    mean /= count;
+    
+    for (int i = 0; i < count; i++)
+    {
+        sum += (samples[i] - mean) * (samples[i] - mean);
+    }
+    timing.deviation = sqrt(sum / count);
+    
+    return timing;
+}
+
+// Divide counts summed over several runs down to one run.
+void average_counters( perf_sample_type* sample, int repetitions )
+{
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+    {
+        sample->value[i] /= repetitions;
+    }
+}
+
+// Time implode and explode of data under one configuration, reading the
+// counters around each run if counters is not NULL. Returns false if the
+// round trip fails.
+bool bench_config( const unsigned char* data,
+                   unsigned char* out_data,
+                   int repetitions,
+                   perf_counters_type* counters,
+                   bench_result_type* result )
+{
+    double implode_samples[MAX_REPETITIONS];
+    double explode_samples[MAX_REPETITIONS];
+    implode_buffer_type stream = {0};
+    implode_stats_type stats = {0};
+    
+    for (int i = 0; i < repetitions; i++)
+    {
+        double start;
+        
+        stream.length = 0;
+        
+        if (counters)
+        {
+            perf_counters_start(counters);
+        }
+        
+        start = now_seconds();
+        implode_memory(data, result->length, &stream, result->literal_mode,
+                       result->dictionary_size, result->optimization_level,
+                       NULL, &stats);
+        implode_samples[i] = now_seconds() - start;
+        
+        if (counters)
+        {
+            perf_counters_stop(counters, &result->implode_counters);
+        }
+    }
+    
+    result->imploded_length = stream.length;
+    result->token_count = stats.literal_count + stats.lookup_count;
+    
+    // Check the round trip first, untimed, which also builds the decoder's
+    // tables.
+    if ((explode_memory(stream.data, stream.length, 16, out_data, 0,
+                        result->length, NULL) != result->length) ||
+        memcmp(out_data, data, result->length))
+    {
+        implode_buffer_free(&stream);
+        return false;
+    }
+    
+    for (int i = 0; i < repetitions; i++)
+    {
+        double start;
+        
+        if (counters)
+        {
+            perf_counters_start(counters);
+        }
+        
+        start = now_seconds();
+        explode_memory(stream.data, stream.length, 16, out_data, 0,
+                       result->length, NULL);
+        explode_samples[i] = now_seconds() - start;
+        
+        if (counters)
+        {
+            perf_counters_stop(counters, &result->explode_counters);
+        }
+    }
+    
+    result->implode_time = summarize(implode_samples, repetitions);
+    result->explode_time = summarize(explode_samples, repetitions);
+    average_counters(&result->implode_counters, repetitions);
+    average_counters(&result->explode_counters, repetitions);
+    
+    implode_buffer_free(&stream);
+    return true;
+}
+
+void print_header( void )
+{
+    printf("%-7s %-6s %4s %5s %7s   %9s %8s %6s   %9s %8s %6s\n",
+           "Data", "Mode", "Dict", "Level", "Ratio",
+           "Implode", "ns/byte", "sd", "Explode", "ns/byte", "sd");
+    printf("%-7s %-6s %4s %5s %7s   %9s %8s %6s   %9s %8s %6s\n",
+           "", "", "", "", "",
+           "MB/s", "", "", "MB/s", "", "");
+}
+
+// Throughput, time per byte and spread of one timing.
+void print_timing( const timing_type* timing, unsigned long length )
+{
+    if ((timing->median <= 0) || (length == 0))
+    {
+        printf("   %9s %8s %6s", "-", "-", "-");
+        return;
+    }
+    
+    printf("   %9.2f %8.2f %5.1f%%",
+           length / timing->median / 1e6,
+           timing->median * 1e9 / length,
+           100.0 * timing->deviation / timing->median);
+}
+
+void print_result( const bench_result_type* result )
+{
+    printf("%-7s %-6s %3dK %5u %6.2f%%",
+           generate_kind_name(result->kind),
+           (result->literal_mode == IMPLODE_ASCII) ? "ASCII" : "BINARY",
+           1 << (result->dictionary_size - 4),
+           result->optimization_level,
+           result->length ?
+               100.0 * result->imploded_length / result->length : 0.0);
+    
+    print_timing(&result->implode_time, result->length);
+    print_timing(&result->explode_time, result->length);
+    printf("\n");
+}
+
+// One counter ratio, or "-" if either count is missing.
+void print_counter_ratio( const char* label,
+                          const perf_sample_type* sample,
+                          perf_counter_id_type counter,
+                          double divisor,
+                          int width )
+{
+    if (!sample->valid[counter] || (divisor <= 0))
+    {
+        printf("  %s %*s", label, width, "-");
+        return;
+    }
+    
+    printf("  %s %*.2f", label, width, sample->value[counter] / divisor);
+}
+
+// Counters for one engine of a result, under its row.
+void print_counters( const char* engine,
+                     const perf_sample_type* sample,
+                     const bench_result_type* result )
+{
+    double kilobytes = result->length / 1024.0;
+    
+    printf("%28s %-7s", "", engine);
+    
+    print_counter_ratio("IPC", sample, PERF_INSTRUCTIONS,
+                        sample->valid[PERF_CYCLES] ?
+                            (double) sample->value[PERF_CYCLES] : 0, 5);
+    print_counter_ratio("cycles/byte", sample, PERF_CYCLES,
+                        result->length, 7);
+    print_counter_ratio("cycles/token", sample, PERF_CYCLES,
+                        result->token_count, 8);
+    printf("   misses/k:");
+    print_counter_ratio("branch", sample, PERF_BRANCH_MISSES, kilobytes, 7);
+    print_counter_ratio("L1D", sample, PERF_L1D_MISSES, kilobytes, 7);
+    print_counter_ratio("LLC", sample, PERF_LLC_MISSES, kilobytes, 6);
+    printf("\n");
+}
+
+bool add_metric( metric_list_type* list,
+                 const char* name,
+                 double value,
+                 metric_type type )
+{
+    if (list->count == list->capacity)
+    {
+        int capacity = list->capacity ? list->capacity * 2 : 256;
+        bench_metric_type* metrics = realloc(list->metrics,
+                                             capacity * sizeof(*metrics));
+        
+        if (!metrics)
+        {
+            printf("Error: out of memory.\n");
+            return false;
+        }
+        
+        list->metrics = metrics;
+        list->capacity = capacity;
+    }
+    
+    // Kept to the precision written to baseline files, so an unchanged
+    // ratio compares equal.
+    snprintf(list->metrics[list->count].name, MAX_METRIC_NAME, "%s", name);
+    list->metrics[list->count].value = round(value * 1e4) / 1e4;
+    list->metrics[list->count].type = type;
+    list->count++;
+    
+    return true;
+}
+
+bool add_result_metrics( metric_list_type* list,
+                         const bench_result_type* result )
+{
+    char prefix[MAX_METRIC_NAME - 16];
+    char name[MAX_METRIC_NAME];
+    bool ok = true;
+    
+    snprintf(prefix, sizeof(prefix), "%s.%s.%dk.level%u",
+             generate_kind_name(result->kind),
+             (result->literal_mode == IMPLODE_ASCII) ? "ascii" : "binary",
+             1 << (result->dictionary_size - 4),
+             result->optimization_level);
+    
+    if (result->length == 0)
+    {
+        return true;
+    }
+    
+    snprintf(name, sizeof(name), "%s.ratio", prefix);
+    ok = ok && add_metric(list, name,
+                          100.0 * result->imploded_length / result->length,
+                          METRIC_RATIO);
+    
+    if (result->implode_time.median > 0)
+    {
+        snprintf(name, sizeof(name), "%s.implode_mbps", prefix);
+        ok = ok && add_metric(list, name,
+                              result->length / result->implode_time.median / 1e6,
+                              METRIC_SPEED);
+    }
+    
+    if (result->explode_time.median > 0)
+    {
+        snprintf(name, sizeof(name), "%s.explode_mbps", prefix);
+        ok = ok && add_metric(list, name,
+                              result->length / result->explode_time.median / 1e6,
+                              METRIC_SPEED);
+    }
+    
+    return ok;
+}
+
+bench_metric_type* find_metric( metric_list_type* list, const char* name )
+{
+    for (int i = 0; i < list->count; i++)
+    {
+        if (strcmp(list->metrics[i].name, name) == 0)
+        {
+            return &list->metrics[i];
+        }
+    }
+    return NULL;
+}
+
+bool write_baseline( const char* path, const metric_list_type* list )
+{
+    FILE* fp = fopen(path, "w");
+    
+    if (!fp)
+    {
+        printf("Error: Unable to create baseline file %s.\n", path);
+        return false;
+    }
+    
+    for (int i = 0; i < list->count; i++)
+    {
+        fprintf(fp, "%s %.4f\n", list->metrics[i].name,
+                list->metrics[i].value);
+    }
+    
+    fclose(fp);
+    printf("\nWrote %d metrics to %s.\n", list->count, path);
+    return true;
+}
+
+// Compare with a baseline file. Metrics not measured in this run are
+// skipped. Returns the number of regressions, or -1 if the file can't be
+// read.
+int check_baseline( const char* path,
+                    metric_list_type* list,
+                    const threshold_type* thresholds )
+{
+    FILE* fp = fopen(path, "r");
+    char line[256];
+    char name[MAX_METRIC_NAME];
+    double baseline;
+    int checked = 0;
+    int regressions = 0;
+    
+    if (!fp)
+    {
+        printf("Error: Unable to open baseline file %s.\n", path);
+        return -1;
+    }
+    
+    printf("\n");
+    
+    while (fgets(line, sizeof(line), fp))
+    {
+        bench_metric_type* metric;
+        double change, allowed;
+        
+        if ((sscanf(line, "%63s %lf", name, &baseline) != 2) ||
+            (baseline <= 0))
+        {
+            continue;
+        }
+        
+        metric = find_metric(list, name);
+        
+        if (!metric)
+        {
+            continue;
+        }
+        
+        // Percentage worse than the baseline.
+        switch (metric->type)
+        {
+            case METRIC_SPEED:
+                change = 100.0 * (baseline - metric->value) / baseline;
+                allowed = thresholds->speed;
+                break;
+            
+            case METRIC_RATIO:
+                change = 100.0 * (metric->value - baseline) / baseline;
+                allowed = thresholds->ratio;
+                break;
+            
+            default:
+                change = 100.0 * (metric->value - baseline) / baseline;
+                allowed = thresholds->memory;
+                break;
+        }
+        
+        checked++;
+        
+        if (change > allowed)
+        {
+            printf("Regression: %-40s %12.2f -> %12.2f  (%.1f%% worse)\n",
+                   name, baseline, metric->value, change);
+            regressions++;
+        }
+    }
+    
+    fclose(fp);
+    
+    printf("Checked %d metrics against %s: %d regression%s.\n",
+           checked, path, regressions, (regressions == 1) ? "" : "s");
+    
+    return regressions;
+}
+
+long file_length( const char* path )
+{
+    struct stat info;
+    
+    if (stat(path, &info) != 0)
+    {
+        return -1;
+    }
+    return (long) info.st_size;
+}
+
+// Total size of the files in a corpus's FILES.LST. When output_dir is
+// given, the copies of them extracted there are removed instead.
+unsigned long corpus_files( const char* corpus_dir, const char* output_dir )
+{
+    char path[MAX_PATH_LENGTH];
+    char name[64];
+    unsigned long total = 0;
+    FILE* fp;
+    
+    snprintf(path, sizeof(path), "%s/FILES.LST", corpus_dir);
+    fp = fopen(path, "r");
+    
+    if (!fp)
+    {
+        return 0;
+    }
+    
+    while (fgets(name, sizeof(name), fp))
+    {
+        name[strcspn(name, "\r\n")] = 0;
+        
+        if (!name[0])
+        {
+            continue;
+        }
+        
+        if (output_dir)
+        {
+            snprintf(path, sizeof(path), "%s/%s/%s",
+                     corpus_dir, output_dir, name);
+            remove(path);
+        }
+        else
+        {
+            snprintf(path, sizeof(path), "%s/%s", corpus_dir, name);
+            if (file_length(path) > 0)
+            {
+                total += file_length(path);
+            }
+        }
+    }
+    
+    fclose(fp);
+    return total;
+}
+
+// Run a tool in the given directory, with its output discarded. Returns
+// the wall time in seconds, or a negative value if it didn't run or exit
+// cleanly. The peak resident size of the tool, in k, goes to peak_kb.
+double run_tool( const char* tool,
+                 const char* const* args,
+                 const char* directory,
+                 long* peak_kb )
+{
+    struct rusage usage;
+    double start = now_seconds();
+    int status;
+    pid_t pid;
+    
+    fflush(stdout);
+    pid = fork();
+    
+    if (pid < 0)
+    {
+        return -1;
+    }
+    
+    if (pid == 0)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        
+        if (null_fd >= 0)
+        {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        
+        if (chdir(directory) == 0)
+        {
+            execv(tool, (char* const*) args);
+        }
+        _exit(127);
+    }
+    
+    if ((wait4(pid, &status, 0, &usage) != pid) ||
+        !WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+    {
+        return -1;
+    }
+    
+#ifdef __APPLE__
+    *peak_kb = usage.ru_maxrss / 1024;      // Bytes on macOS
+#else
+    *peak_kb = usage.ru_maxrss;
+#endif
+    
+    return now_seconds() - start;
+}
+
+// Name of the first disk of the archive set in the corpus's multi
+// directory, as written by LFGCorpus.
+bool find_multi_disk_set( const char* corpus_dir, char* name )
+{
+    char path[MAX_PATH_LENGTH];
+    struct dirent* entry;
+    bool found = false;
+    DIR* dir;
+    
+    snprintf(path, sizeof(path), "%s/multi", corpus_dir);
+    dir = opendir(path);
+    
+    if (!dir)
+    {
+        return false;
+    }
+    
+    while (!found && ((entry = readdir(dir)) != NULL))
+    {
+        if ((strlen(entry->d_name) == 12) &&
+            (strcmp(&entry->d_name[7], "A.XXX") == 0))
+        {
+            strcpy(name, entry->d_name);
+            found = true;
+        }
+    }
+    
+    closedir(dir);
+    return found;
+}
+
+typedef struct {
+    const char* name;           // Metric name prefix
+    const char* tool;           // "LFGMake" or "LFGDump"
+    const char* directory;      // Relative to the corpus
+    const char* args[8];
+} end_to_end_run_type;
+
+// Time LFGMake and LFGDump over a corpus, adding their throughput, peak
+// memory and (for LFGMake) compressed size to the metrics.
+bool bench_end_to_end( const char* corpus_dir,
+                       const char* tool_dir,
+                       int repetitions,
+                       metric_list_type* list )
+{
+    char multi_name[16];
+    char path[MAX_PATH_LENGTH];
+    char tool[MAX_PATH_LENGTH];
+    char name[MAX_METRIC_NAME];
+    double samples[MAX_REPETITIONS];
+    unsigned long total = corpus_files(corpus_dir, NULL);
+    bool ok = true;
+    
+    end_to_end_run_type runs[] = {
+        { "lfgmake", "LFGMake", ".",
+          { "LFGMake", "-f", "FILES.LST", BENCH_ARCHIVE, NULL } },
+        { "lfgdump", "LFGDump", ".",
+          { "LFGDump", "-f", "-o", BENCH_OUTPUT, BENCH_ARCHIVE, NULL } },
+        { "lfgdump_multi", "LFGDump", "multi",
+          { "LFGDump", "-f", "-o", "../" BENCH_OUTPUT, multi_name, NULL } }
+    };
+    int run_count = sizeof(runs) / sizeof(runs[0]);
+    
+    if (total == 0)
+    {
+        printf("Error: No corpus in %s (see LFGCorpus).\n", corpus_dir);
+        return false;
+    }
+    
+    if (!find_multi_disk_set(corpus_dir, multi_name))
+    {
+        run_count--;
+    }
+    
+    snprintf(path, sizeof(path), "%s/%s", corpus_dir, BENCH_OUTPUT);
+    mkdir(path, 0755);
+    
+    printf("\n%lu bytes in %s, median of %d runs\n\n",
+           total, corpus_dir, repetitions);
+    printf("%-16s %9s %6s %10s %7s\n",
+           "End to end", "MB/s", "sd", "Peak (k)", "Ratio");
+    
+    for (int i = 0; ok && (i < run_count); i++)
+    {
+        timing_type timing;
+        long peak_kb = 0;
+        
+        snprintf(tool, sizeof(tool), "%s/%s", tool_dir, runs[i].tool);
+        snprintf(path, sizeof(path), "%s/%s", corpus_dir, runs[i].directory);
+        
+        for (int j = 0; j < repetitions; j++)
+        {
+            long run_peak_kb = 0;
+            
+            samples[j] = run_tool(tool, runs[i].args, path, &run_peak_kb);
+            
+            if (samples[j] < 0)
+            {
+                printf("Error: %s failed in %s.\n", tool, path);
+                ok = false;
+                break;
+            }
+            
+            if (run_peak_kb > peak_kb)
+            {
+                peak_kb = run_peak_kb;
+            }
+        }
+        
+        if (!ok)
+        {
+            break;
+        }
+        
+        timing = summarize(samples, repetitions);
+        
+        printf("%-16s %9.2f %5.1f%% %10ld",
+               runs[i].name, total / timing.median / 1e6,
+               100.0 * timing.deviation / timing.median, peak_kb);
+        
+        snprintf(name, sizeof(name), "end_to_end.%s.mbps", runs[i].name);
+        ok = ok && add_metric(list, name, total / timing.median / 1e6,
+                              METRIC_SPEED);
+        snprintf(name, sizeof(name), "end_to_end.%s.peak_kb", runs[i].name);
+        ok = ok && add_metric(list, name, peak_kb, METRIC_MEMORY);
+        
+        if (strcmp(runs[i].tool, "LFGMake") == 0)
+        {
+            double ratio;
+            
+            snprintf(path, sizeof(path), "%s/%s", corpus_dir, BENCH_ARCHIVE);
+            ratio = 100.0 * file_length(path) / total;
+            
+            printf(" %6.2f%%", ratio);
+            snprintf(name, sizeof(name), "end_to_end.%s.ratio", runs[i].name);
+            ok = ok && add_metric(list, name, ratio, METRIC_RATIO);
+        }
+        printf("\n");
+    }
+    
+    // Leave the corpus as it was.
+    corpus_files(corpus_dir, BENCH_OUTPUT);
+    snprintf(path, sizeof(path), "%s/%s", corpus_dir, BENCH_OUTPUT);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/%s", corpus_dir, BENCH_ARCHIVE);
+    remove(path);
+    
+    return ok;
+}
+
+int main( int argc, const char * argv[] )
+{
+    generate_kind_type only_kind = GENERATE_KIND_COUNT;
+    int only_level = -1;
+    int repetitions = 5;
+    uint32_t seed = 1;
+    unsigned long length = 64 * 1024;
+    unsigned char* data;
+    unsigned char* out_data;
+    bool failed = false;
+    const char* baseline_in = NULL;
+    const char* baseline_out = NULL;
+    const char* corpus_dir = NULL;
+    bool use_counters = false;
+    perf_counters_type counters;
+    perf_counters_type* active_counters = NULL;
+    char tool_dir[MAX_PATH_LENGTH] = ".";
+    threshold_type thresholds = { 15.0, 0.0, 10.0 };
+    metric_list_type metrics = {0};
+    struct rusage usage;
+    
+    // Look for the other tools next to this one.
+    if (strrchr(argv[0], '/'))
+    {
+        snprintf(tool_dir, sizeof(tool_dir), "%.*s",
+                 (int)(strrchr(argv[0], '/') - argv[0]), argv[0]);
+    }
+    
+    for (int j = 1; j < argc; j++)
+    {
+        if ((j + 1 < argc) && (strcmp(argv[j], "-b") == 0))
+        {
+            baseline_in = argv[++j];
+        }
+        else if ((j + 1 < argc) && (strcmp(argv[j], "-c") == 0))
+        {
+            corpus_dir = argv[++j];
+        }
+        else if ((j + 1 < argc) && (strcmp(argv[j], "-m") == 0))
+        {
+            thresholds.memory = atof(argv[++j]);
+        }
+        else if (strcmp(argv[j], "-p") == 0)
+        {
+            use_counters = true;
+        }
+        else if ((j + 1 < argc) && (strcmp(argv[j], "-q") == 0))
+        {
+            thresholds.ratio = atof(argv[++j]);
+        }
+        else if ((j + 1 < argc) && (strcmp(argv[j], "-t") == 0))
+        {
+            thresholds.speed = atof(argv[++j]);
+        }
+        else if ((j + 1 < argc) && (strcmp(argv[j], "-w") == 0))
+        {
+            baseline_out = argv[++j];
+        }
+        else if ((j + 1 < argc) && (strcmp(argv[j], "-x") == 0))
+        {
+            snprintf(tool_dir, sizeof(tool_dir), "%s", argv[++j]);
+        }
+        else if ((j + 1 < argc) && (strcmp(argv[j], "-k") == 0))
+        {
+            only_kind = generate_kind_from_name(argv[++j]);
+            
+            if (only_kind == GENERATE_KIND_COUNT)
+            {
+                printf("Error: Unknown kind of data %s.\n", argv[j]);
+                return 1;
+            }
+        }
+        else if ((j + 1 < argc) && (strcmp(argv[j], "-l") == 0))
+        {
+            only_level = atoi(argv[++j]);
+        }
+        else if ((j + 1 < argc) && (strcmp(argv[j], "-n") == 0))
+        {
+            repetitions = atoi(argv[++j]);
+            
+            if (repetitions < 1)
+            {
+                repetitions = 1;
+            }
+            if (repetitions > MAX_REPETITIONS)
+            {
+                repetitions = MAX_REPETITIONS;
+            }
+        }
+        else if ((j + 1 < argc) && (strcmp(argv[j], "-r") == 0))
+        {
+            seed = (uint32_t) strtoul(argv[++j], NULL, 10);
+        }
+        else if ((j + 1 < argc) && (strcmp(argv[j], "-s") == 0))
+        {
+            length = strtoul(argv[++j], NULL, 10) * 1024;
+        }
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+    
+    data = malloc(length + 1);
+    out_data = malloc(length + 1);
+    
+    if (!data || !out_data)
+    {
+        printf("Error: out of memory.\n");
+        return 1;
+    }
+    
+    if (use_counters)
+    {
+        const char* reason = NULL;
+        
+        if (perf_counters_open(&counters, &reason) > 0)
+        {
+            active_counters = &counters;
+        }
+        else
+        {
+            printf("Hardware counters unavailable (%s), "
+                   "showing throughput only.\n\n", reason);
+        }
+    }
+    
+    printf("%lu bytes, median of %d runs\n\n", length, repetitions);
+    print_header();
+    
+    for (int kind = 0; kind < GENERATE_KIND_COUNT; kind++)
+    {
+        if ((only_kind != GENERATE_KIND_COUNT) && (kind != only_kind))
+        {
+            continue;
+        }
+        
+        generate_data(kind, data, length, seed);
+        
+        for (int mode = IMPLODE_BINARY; mode <= IMPLODE_ASCII; mode++)
+        {
+            for (int size = IMPLODE_1K_DICTIONARY;
+                 size <= IMPLODE_4K_DICTIONARY; size++)
+            {
+                for (int level = 0; level < LEVEL_COUNT; level++)
+                {
+                    bench_result_type result = {
+                        kind, mode, size, optimization_levels[level], length
+                    };
+                    
+                    if ((only_level >= 0) &&
+                        (optimization_levels[level] != only_level))
+                    {
+                        continue;
+                    }
+                    
+                    if (!bench_config(data, out_data, repetitions,
+                                      active_counters, &result))
+                    {
+                        printf("Error: Round trip failed for %s data.\n",
+                               generate_kind_name(kind));
+                        failed = true;
+                        continue;
+                    }
+                    
+                    print_result(&result);
+                    
+                    if (active_counters)
+                    {
+                        print_counters("implode", &result.implode_counters,
+                                       &result);
+                        print_counters("explode", &result.explode_counters,
+                                       &result);
+                    }
+                    
+                    if (!add_result_metrics(&metrics, &result))
+                    {
+                        failed = true;
+                    }
+                }
+            }
+        }
+    }
+    
+    free(out_data);
+    free(data);
+    
+    if (active_counters)
+    {
+        perf_counters_close(active_counters);
+    }
+    
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    add_metric(&metrics, "bench.peak_kb", usage.ru_maxrss / 1024,
+               METRIC_MEMORY);
+#else
+    add_metric(&metrics, "bench.peak_kb", usage.ru_maxrss, METRIC_MEMORY);
+#endif
+    
+    if (corpus_dir &&
+        !bench_end_to_end(corpus_dir, tool_dir, repetitions, &metrics))
+    {
+        failed = true;
+    }
+    
+    if (!failed && baseline_out && !write_baseline(baseline_out, &metrics))
+    {
+        failed = true;
+    }
+    
+    if (!failed && baseline_in &&
+        (check_baseline(baseline_in, &metrics, &thresholds) != 0))
+    {
+        failed = true;
+    }
+    
+    free(metrics.metrics);
+    
+    return failed ? 1 : 0;
+}
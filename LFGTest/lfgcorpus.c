@@ -0,0 +1,398 @@
+//
+//  lfgcorpus.c
+//  LFGTest
+//
+//  Writes a synthetic test corpus: generated script text, bitmaps, audio,
+//  runs and noise, packed by LFGMake's pack_lfg() into a single archive and
+//  into a multi-disk archive set.  The same options always give the same
+//  files, so benchmarks and regression runs on different machines see the
+//  same inputs.
+//
+//  [directory]/               Generated files, and FILES.LST (for LFGMake -f)
+//  [directory]/single/        GAME___A.XXX
+//  [directory]/multi/         GAME___A.XXX ... GAME___D.XXX
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../LFGPack/pack_lfg.h"
+#include "generate.h"
+
+#define MAX_CORPUS_FILES    64
+#define MAX_PATH_LENGTH     256
+#define MIN_DISK_SIZE       1024
+
+// Member names (8.3) for each kind of data.
+const char* corpus_prefixes[GENERATE_KIND_COUNT] = {
+    "SCRIPT", "ROOM", "SOUND", "COSTUM", "NOISE"
+};
+
+const char* corpus_extensions[GENERATE_KIND_COUNT] = {
+    "TXT", "BIN", "RAW", "BIN", "BIN"
+};
+
+typedef struct {
+    const char* directory;
+    char game[8];                   // Padded with '_' to 7 characters
+    int files_per_kind;
+    unsigned long file_length;
+    int disk_count;
+    unsigned int optimize_level;
+    uint32_t seed;
+} corpus_options_type;
+
+void print_usage( void )
+{
+    printf("Usage: LFGCorpus [options] directory\n");
+    printf("Writes generated test files and packs them into archives.\n\n");
+    printf("   -d N            Disks in the multi-disk archive set (default 4)\n");
+    printf("   -g name         Game name for the archives (default GAME)\n");
+    printf("   -n N            Files of each kind (default 2)\n");
+    printf("   -o N            LFGMake optimization level (default 3)\n");
+    printf("   -r seed         Random seed (default 1)\n");
+    printf("   -s N            Size of each file in k (default 128)\n\n");
+}
+
+bool make_directory( const char* path )
+{
+    struct stat info;
+    
+    if ((stat(path, &info) == 0) && S_ISDIR(info.st_mode))
+    {
+        return true;
+    }
+    
+    if (mkdir(path, 0755) != 0)
+    {
+        printf("Error: Unable to create directory %s.\n", path);
+        return false;
+    }
+    return true;
+}
+
+long file_length( const char* path )
+{
+    struct stat info;
+    
+    if (stat(path, &info) != 0)
+    {
+        return -1;
+    }
+    return (long) info.st_size;
+}
+
+// Path of the archive file for the given disk (0 for A), relative to the
+// corpus directory.
+void archive_path( char* path,
+                   const corpus_options_type* options,
+                   const char* set,
+                   int disk )
+{
+    snprintf(path, MAX_PATH_LENGTH, "%s/%s%c.XXX",
+             set, options->game, 'A' + disk);
+}
+
+// Number of disks recorded in the header of a first archive file, or 0.
+int archive_disk_count( const char* path )
+{
+    FILE* fp = fopen(path, "rb");
+    unsigned char header[0x1C];
+    int count = 0;
+    
+    if (!fp)
+    {
+        return 0;
+    }
+    
+    if ((fread(header, 1, sizeof(header), fp) == sizeof(header)) &&
+        (memcmp(header, "LFG!", 4) == 0))
+    {
+        count = header[0x16];
+    }
+    
+    fclose(fp);
+    return count;
+}
+
+// Generate the files and the list of them (names only, as pack_lfg() stores
+// member names as given). Returns the number of files written, or -1.
+int write_corpus_files( const corpus_options_type* options,
+                        char** file_list )
+{
+    unsigned char* data = malloc(options->file_length + 1);
+    char path[MAX_PATH_LENGTH];
+    char name[16];
+    FILE* fp_list;
+    int count = 0;
+    
+    if (!data)
+    {
+        printf("Error: out of memory.\n");
+        return -1;
+    }
+    
+    snprintf(path, sizeof(path), "%s/FILES.LST", options->directory);
+    fp_list = fopen(path, "w");
+    
+    if (!fp_list)
+    {
+        printf("Error: Unable to create %s.\n", path);
+        free(data);
+        return -1;
+    }
+    
+    for (int kind = 0; kind < GENERATE_KIND_COUNT; kind++)
+    {
+        for (int i = 0; i < options->files_per_kind; i++)
+        {
+            FILE* fp;
+            
+            // Each file gets its own seed, so no two are alike.
+            generate_data(kind, data, options->file_length,
+                          options->seed * MAX_CORPUS_FILES + count);
+            
+            snprintf(name, sizeof(name), "%s%02d.%s",
+                     corpus_prefixes[kind], i + 1, corpus_extensions[kind]);
+            snprintf(path, sizeof(path), "%s/%s", options->directory, name);
+            
+            fp = fopen(path, "wb");
+            
+            if (!fp || (fwrite(data, 1, options->file_length, fp) !=
+                        options->file_length))
+            {
+                printf("Error: Unable to write %s.\n", path);
+                if (fp)
+                {
+                    fclose(fp);
+                }
+                fclose(fp_list);
+                free(data);
+                return -1;
+            }
+            
+            fclose(fp);
+            fprintf(fp_list, "%s\n", name);
+            
+            file_list[count] = malloc(strlen(name) + 1);
+            strcpy(file_list[count], name);
+            count++;
+        }
+    }
+    
+    fclose(fp_list);
+    free(data);
+    
+    return count;
+}
+
+// Pack into the multi-disk set. Disk sizes start from an even split of the
+// single archive and grow until the set fits on the requested number of
+// disks (members don't always break exactly at a disk boundary).
+bool pack_multi_disk( const corpus_options_type* options,
+                      char** file_list,
+                      int file_count,
+                      long single_length )
+{
+    char path[MAX_PATH_LENGTH];
+    unsigned long disk_size;
+    int count = 0;
+    
+    // Every disk after the first repeats the 8 byte header.
+    disk_size = (single_length + 8 * (options->disk_count - 1) +
+                 options->disk_count - 1) / options->disk_count;
+    
+    if (disk_size < MIN_DISK_SIZE)
+    {
+        printf("Error: Corpus too small to span %d disks.\n",
+               options->disk_count);
+        return false;
+    }
+    
+    while (true)
+    {
+        // Clear out any later disks from an earlier run.
+        for (int disk = 1; disk < 26; disk++)
+        {
+            archive_path(path, options, "multi", disk);
+            remove(path);
+        }
+        
+        archive_path(path, options, "multi", 0);
+        
+        if (pack_lfg(LFG_DEFAULT, 0, path, file_list, file_count,
+                     disk_size, disk_size, options->optimize_level,
+                     1, 0, false, false) != 0)
+        {
+            return false;
+        }
+        
+        count = archive_disk_count(path);
+        
+        if ((count == 0) || (count > 26))
+        {
+            printf("Error: Unable to read back %s.\n", path);
+            return false;
+        }
+        
+        if (count <= options->disk_count)
+        {
+            break;
+        }
+        
+        disk_size += disk_size / 64 + 32;
+    }
+    
+    printf("\nMulti-disk set: %d disks of up to %lu bytes.\n",
+           count, disk_size);
+    return true;
+}
+
+bool parse_game_name( corpus_options_type* options, const char* name )
+{
+    int length = (int) strlen(name);
+    
+    if ((length == 0) || (length > 7))
+    {
+        printf("Error: Game name must be 1 to 7 characters.\n");
+        return false;
+    }
+    
+    for (int i = 0; i < 7; i++)
+    {
+        options->game[i] = (i < length) ? toupper((unsigned char) name[i]) :
+                                          '_';
+    }
+    options->game[7] = 0;
+    
+    return true;
+}
+
+int main( int argc, const char * argv[] )
+{
+    corpus_options_type options = {
+        NULL, "GAME___", 2, 128 * 1024, 4, 3, 1
+    };
+    char* file_list[MAX_CORPUS_FILES];
+    char path[MAX_PATH_LENGTH];
+    int file_count;
+    long single_length;
+    bool ok;
+    
+    for (int j = 1; j < argc; j++)
+    {
+        if ((j + 1 < argc) && (strcmp(argv[j], "-d") == 0))
+        {
+            options.disk_count = atoi(argv[++j]);
+        }
+        else if ((j + 1 < argc) && (strcmp(argv[j], "-g") == 0))
+        {
+            if (!parse_game_name(&options, argv[++j]))
+            {
+                return 1;
+            }
+        }
+        else if ((j + 1 < argc) && (strcmp(argv[j], "-n") == 0))
+        {
+            options.files_per_kind = atoi(argv[++j]);
+        }
+        else if ((j + 1 < argc) && (strcmp(argv[j], "-o") == 0))
+        {
+            options.optimize_level = atoi(argv[++j]);
+        }
+        else if ((j + 1 < argc) && (strcmp(argv[j], "-r") == 0))
+        {
+            options.seed = (uint32_t) strtoul(argv[++j], NULL, 10);
+        }
+        else if ((j + 1 < argc) && (strcmp(argv[j], "-s") == 0))
+        {
+            options.file_length = strtoul(argv[++j], NULL, 10) * 1024;
+        }
+        else if ((argv[j][0] != '-') && !options.directory)
+        {
+            options.directory = argv[j];
+        }
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+    
+    if (!options.directory)
+    {
+        print_usage();
+        return 1;
+    }
+    
+    if ((options.disk_count < 2) || (options.disk_count > 26))
+    {
+        printf("Error: Disk count must be 2 to 26.\n");
+        return 1;
+    }
+    
+    if ((options.files_per_kind < 1) ||
+        (options.files_per_kind * GENERATE_KIND_COUNT > MAX_CORPUS_FILES))
+    {
+        printf("Error: Files of each kind must be 1 to %d.\n",
+               MAX_CORPUS_FILES / GENERATE_KIND_COUNT);
+        return 1;
+    }
+    
+    if (options.file_length == 0)
+    {
+        printf("Error: File size must be at least 1k.\n");
+        return 1;
+    }
+    
+    snprintf(path, sizeof(path), "%s/single", options.directory);
+    ok = make_directory(options.directory) && make_directory(path);
+    snprintf(path, sizeof(path), "%s/multi", options.directory);
+    ok = ok && make_directory(path);
+    
+    if (!ok)
+    {
+        return 1;
+    }
+    
+    file_count = write_corpus_files(&options, file_list);
+    
+    if (file_count < 0)
+    {
+        return 1;
+    }
+    
+    // Pack from inside the directory, as LFGMake is run.
+    if (chdir(options.directory) != 0)
+    {
+        printf("Error: Unable to enter directory %s.\n", options.directory);
+        return 1;
+    }
+    
+    archive_path(path, &options, "single", 0);
+    
+    ok = (pack_lfg(LFG_DEFAULT, 0, path, file_list, file_count,
+                   0xFFFFFFFF, 0xFFFFFFFF, options.optimize_level,
+                   1, 0, false, false) == 0);
+    
+    single_length = file_length(path);
+    
+    if (ok && (single_length <= 0))
+    {
+        printf("Error: Unable to read back %s.\n", path);
+        ok = false;
+    }
+    
+    ok = ok && pack_multi_disk(&options, file_list, file_count,
+                               single_length);
+    
+    for (int i = 0; i < file_count; i++)
+    {
+        free(file_list[i]);
+    }
+    
+    return ok ? 0 : 1;
+}
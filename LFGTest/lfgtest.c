@@ -0,0 +1,953 @@
+//
+//  lfgtest.c
+//  LFGTest
+//
+//  Differential test of the implode and explode engines.  implode() and
+//  extract_and_explode(), working on files, are the reference; every other
+//  engine must give the same bytes:
+//
+//      implode() itself must write what the encoder wrote before any of
+//      these engines were added, checked against stored hashes.
+//
+//      implode_memory(), with and without a shared match table, and
+//      implode() with its output split over several files (disk spans)
+//      must write exactly what implode() writes.
+//
+//      explode_memory(), explode_parallel(), explode_pipelined(),
+//      explode_read_range() and extract_and_explode() reading a stream
+//      split over several files must give back the original input.
+//
+//  This is done for generated inputs under every literal mode, dictionary
+//  size and optimization level, and for fuzzed inputs under random
+//  settings.  Corrupted streams are fed to the decoders as well, which must
+//  agree with each other whenever they accept one.  Relative throughput of
+//  the engines is reported at the end.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "../LFGDump/explode.h"
+#include "../LFGPack/implode.h"
+#include "generate.h"
+
+#define MAX_SPAN_FILES  64
+
+#define STREAM_START    16
+    // Bit offset of the first token (after the two header bytes).
+
+typedef enum {
+    ENGINE_IMPLODE = 0,         // Reference
+    ENGINE_IMPLODE_MEMORY,
+    ENGINE_FIND_MATCHES,        // Building the table, once per input
+    ENGINE_IMPLODE_MATCHES,     // Given the table
+    ENGINE_IMPLODE_SPAN,
+    ENGINE_EXPLODE,             // Reference
+    ENGINE_EXPLODE_MEMORY,
+    ENGINE_EXPLODE_PARALLEL,
+    ENGINE_EXPLODE_PIPELINED,
+    ENGINE_EXPLODE_RANGE,
+    ENGINE_EXPLODE_SPAN,
+    ENGINE_COUNT
+} engine_type;
+
+const char* engine_names[ENGINE_COUNT] = {
+    "implode", "implode_memory", "implode_find_matches",
+    "implode_memory given table", "implode span",
+    "extract_and_explode", "explode_memory", "explode_parallel",
+    "explode_pipelined", "explode_read_range", "extract_and_explode span"
+};
+
+typedef struct {
+    double seconds;
+    unsigned long bytes;        // Uncompressed bytes handled
+} engine_time_type;
+
+typedef struct {
+    implode_literal_type literal_mode;
+    implode_dictionary_size_type dictionary_size;
+    unsigned int optimization_level;
+} codec_config_type;
+
+unsigned int optimization_levels[] = { 0, 1, 2, 3, 5 };
+
+#define LEVEL_COUNT (sizeof(optimization_levels) / \
+                     sizeof(optimization_levels[0]))
+
+// Hashes of what the original encoder wrote, with only its lookahead
+// stopped at the end of the input (before, it read stale bytes past the
+// end, so its output depended on what was imploded before).  Each hash
+// covers inputs of every known_good_lengths size made with seed 1, imploded
+// with each dictionary size and levels 0-3, in that order.  Binary mode
+// noise has none: it is now written as literals without searching.
+typedef struct {
+    generate_kind_type kind;
+    implode_literal_type literal_mode;
+    uint64_t hash;
+} known_good_type;
+
+const known_good_type known_good[] = {
+    { GENERATE_TEXT,    IMPLODE_BINARY, 0xbe5697fb81338dddULL },
+    { GENERATE_TEXT,    IMPLODE_ASCII,  0x97ef2cfcc81dc330ULL },
+    { GENERATE_BITMAP,  IMPLODE_BINARY, 0x3422990f9e79793eULL },
+    { GENERATE_BITMAP,  IMPLODE_ASCII,  0xee785afee3136412ULL },
+    { GENERATE_AUDIO,   IMPLODE_BINARY, 0x27bef6821d86b659ULL },
+    { GENERATE_AUDIO,   IMPLODE_ASCII,  0xc4bd68551da5e73dULL },
+    { GENERATE_RUNS,    IMPLODE_BINARY, 0x75c032fde81b6924ULL },
+    { GENERATE_RUNS,    IMPLODE_ASCII,  0xec763b6cfa21ff6fULL },
+    { GENERATE_NOISE,   IMPLODE_ASCII,  0xfa17d8ef32047139ULL }
+};
+
+const unsigned long known_good_lengths[] = {
+    0, 1, 2, 3, 100, 4097, 4099 + 518, 16384
+};
+
+engine_time_type engine_times[ENGINE_COUNT];
+unsigned long check_count = 0;
+unsigned long failure_count = 0;
+unsigned int thread_count = 4;
+bool verbose = false;
+
+// Files an imploded stream is split over, for the span checks.
+FILE* span_files[MAX_SPAN_FILES];
+int span_count = 0;
+int span_next = 0;
+unsigned long span_size = 0;
+
+void print_usage( void )
+{
+    printf("Usage: LFGTest [options]\n");
+    printf("Checks that every implode and explode engine gives the same\n");
+    printf("result as the file based ones.\n\n");
+    printf("   -f N            Fuzzed inputs to check (default 200)\n");
+    printf("   -j N            Threads for the parallel engines (default 4)\n");
+    printf("   -n N            Generated inputs of each kind (default 1)\n");
+    printf("   -r seed         Random seed (default 1)\n");
+    printf("   -s N            Size of generated inputs in k (default 64)\n");
+    printf("   -v              List every input checked\n\n");
+}
+
+double now_seconds( void )
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+void engine_time_add( engine_type engine, double start, unsigned long bytes )
+{
+    engine_times[engine].seconds += now_seconds() - start;
+    engine_times[engine].bytes += bytes;
+}
+
+// Record the result of one check.
+void check( bool passed,
+            const char* what,
+            const char* input_name,
+            const codec_config_type* config )
+{
+    check_count++;
+    
+    if (passed)
+    {
+        return;
+    }
+    
+    failure_count++;
+    
+    if (config)
+    {
+        printf("FAIL %s: %s (mode %d, dictionary %d, level %u)\n",
+               input_name, what, config->literal_mode,
+               config->dictionary_size, config->optimization_level);
+    }
+    else
+    {
+        printf("FAIL %s: %s\n", input_name, what);
+    }
+}
+
+// Send stdout to /dev/null while set, to hide the decoders' messages about
+// corrupted data.
+void silence_output( bool silence )
+{
+    static int saved = -1;
+    
+    fflush(stdout);
+    
+    if (silence && (saved < 0))
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        
+        if (null_fd >= 0)
+        {
+            saved = dup(STDOUT_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+    }
+    else if (!silence && (saved >= 0))
+    {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+        saved = -1;
+    }
+}
+
+// A temporary file holding the given bytes, positioned at its start.
+FILE* file_from_memory( const unsigned char* data, unsigned long length )
+{
+    FILE* fp = tmpfile();
+    
+    if (!fp)
+    {
+        printf("Error: Unable to create temporary file.\n");
+        exit(1);
+    }
+    
+    if (length)
+    {
+        fwrite(data, 1, length, fp);
+    }
+    rewind(fp);
+    
+    return fp;
+}
+
+// Append the whole of a file to buffer. Returns false if out of memory.
+bool append_file( FILE* fp, implode_buffer_type* buffer )
+{
+    long length;
+    
+    fflush(fp);
+    fseek(fp, 0, SEEK_END);
+    length = ftell(fp);
+    rewind(fp);
+    
+    if (length <= 0)
+    {
+        return true;
+    }
+    
+    if (buffer->length + length > buffer->size)
+    {
+        unsigned char* data = realloc(buffer->data, buffer->length + length);
+        
+        if (!data)
+        {
+            return false;
+        }
+        buffer->data = data;
+        buffer->size = buffer->length + length;
+    }
+    
+    if (fread(&buffer->data[buffer->length], 1, length, fp) != length)
+    {
+        return false;
+    }
+    buffer->length += length;
+    
+    return true;
+}
+
+bool buffer_equal( const implode_buffer_type* buffer,
+                   const unsigned char* data,
+                   unsigned long length )
+{
+    return (buffer->length == length) &&
+           ((length == 0) || !memcmp(buffer->data, data, length));
+}
+
+void span_files_close( void )
+{
+    for (int i = 0; i < span_count; i++)
+    {
+        fclose(span_files[i]);
+    }
+    span_count = 0;
+    span_next = 0;
+}
+
+// implode() callback: start the next file of a span.
+FILE* span_max_reached( FILE* current_file, unsigned long* max_length )
+{
+    if (span_count >= MAX_SPAN_FILES)
+    {
+        return NULL;
+    }
+    
+    *max_length = span_size;
+    span_files[span_count] = tmpfile();
+    
+    return span_files[span_count++];
+}
+
+// extract_and_explode() callback: move on to the next file of a span.
+FILE* span_eof_reached( void )
+{
+    if (span_next >= span_count)
+    {
+        return NULL;
+    }
+    
+    rewind(span_files[span_next]);
+    return span_files[span_next++];
+}
+
+// Split data over span files: first_size bytes, then size bytes each.
+void span_split( const unsigned char* data,
+                 unsigned long length,
+                 unsigned long first_size,
+                 unsigned long size )
+{
+    unsigned long position = 0;
+    
+    span_files_close();
+    
+    while ((position < length) && (span_count < MAX_SPAN_FILES))
+    {
+        unsigned long piece = span_count ? size : first_size;
+        
+        if ((piece > length - position) || (span_count == MAX_SPAN_FILES - 1))
+        {
+            piece = length - position;
+        }
+        
+        span_files[span_count++] = file_from_memory(&data[position], piece);
+        position += piece;
+    }
+}
+
+// Implode with the reference engine. Returns false on failure.
+bool implode_reference( const unsigned char* data,
+                        unsigned long length,
+                        const codec_config_type* config,
+                        implode_buffer_type* out )
+{
+    FILE* in_fp = file_from_memory(data, length);
+    FILE* out_fp = tmpfile();
+    double start = now_seconds();
+    bool result;
+    
+    implode(in_fp, out_fp, length, config->literal_mode,
+            config->dictionary_size, config->optimization_level,
+            NULL, NULL, NULL);
+    
+    engine_time_add(ENGINE_IMPLODE, start, length);
+    
+    result = append_file(out_fp, out);
+    
+    fclose(in_fp);
+    fclose(out_fp);
+    
+    return result;
+}
+
+// Implode with implode() writing over several files, and join them up.
+void implode_span( const unsigned char* data,
+                   unsigned long length,
+                   const codec_config_type* config,
+                   unsigned long first_size,
+                   unsigned long size,
+                   implode_buffer_type* out )
+{
+    FILE* in_fp = file_from_memory(data, length);
+    unsigned long max_length = first_size;
+    double start;
+    
+    span_files_close();
+    span_size = size;
+    span_files[span_count++] = tmpfile();
+    
+    start = now_seconds();
+    
+    implode(in_fp, span_files[0], length, config->literal_mode,
+            config->dictionary_size, config->optimization_level,
+            NULL, &max_length, span_max_reached);
+    
+    engine_time_add(ENGINE_IMPLODE_SPAN, start, length);
+    
+    for (int i = 0; i < span_count; i++)
+    {
+        append_file(span_files[i], out);
+    }
+    
+    span_files_close();
+    fclose(in_fp);
+}
+
+// Explode a stream from files (the first of which is in_fp), into out.
+long explode_files( FILE* in_fp,
+                    FILE* (*eof_reached)(void),
+                    unsigned long expected_length,
+                    implode_buffer_type* out )
+{
+    FILE* out_fp = tmpfile();
+    int result = extract_and_explode(in_fp, out_fp, (int) expected_length,
+                                     NULL, eof_reached);
+    
+    append_file(out_fp, out);
+    fclose(out_fp);
+    
+    return result;
+}
+
+// Check every explode engine on an imploded stream of data.
+void check_explode( const unsigned char* data,
+                    unsigned long length,
+                    const implode_buffer_type* stream,
+                    const char* input_name,
+                    const codec_config_type* config )
+{
+    implode_buffer_type out = {0};
+    explode_checkpoints_type checkpoints = {0};
+    unsigned char* out_data = malloc(length + 1);
+    FILE* in_fp;
+    double start;
+    long result;
+    
+    // Reference.
+    in_fp = file_from_memory(stream->data, stream->length);
+    start = now_seconds();
+    explode_files(in_fp, NULL, length, &out);
+    engine_time_add(ENGINE_EXPLODE, start, length);
+    fclose(in_fp);
+    check(buffer_equal(&out, data, length), "extract_and_explode output",
+          input_name, config);
+    out.length = 0;
+    
+    start = now_seconds();
+    result = explode_memory(stream->data, stream->length, STREAM_START,
+                            out_data, 0, length, NULL);
+    engine_time_add(ENGINE_EXPLODE_MEMORY, start, length);
+    check((result == length) && !memcmp(out_data, data, length),
+          "explode_memory output", input_name, config);
+    
+    memset(out_data, 0, length);
+    start = now_seconds();
+    result = explode_parallel(stream->data, stream->length, out_data, length,
+                              thread_count, NULL);
+    engine_time_add(ENGINE_EXPLODE_PARALLEL, start, length);
+    check((result == length) && !memcmp(out_data, data, length),
+          "explode_parallel output", input_name, config);
+    
+    memset(out_data, 0, length);
+    start = now_seconds();
+    result = explode_pipelined(stream->data, stream->length, out_data,
+                               length, NULL);
+    engine_time_add(ENGINE_EXPLODE_PIPELINED, start, length);
+    check((result == length) && !memcmp(out_data, data, length),
+          "explode_pipelined output", input_name, config);
+    
+    // Checkpoints about every 4K, then ranges around and between them.
+    start = now_seconds();
+    result = explode_build_checkpoints(stream->data, stream->length, 0x1000,
+                                       &checkpoints);
+    check(result == length, "explode_build_checkpoints length",
+          input_name, config);
+    
+    if (result == length)
+    {
+        unsigned long offsets[4] = { 0, length / 3, length / 2 + 4095,
+                                     length > 100 ? length - 100 : 0 };
+        
+        for (int i = 0; i < 4; i++)
+        {
+            unsigned long offset = (offsets[i] < length) ? offsets[i] : 0;
+            unsigned long range = 5000;
+            
+            if (range > length - offset)
+            {
+                range = length - offset;
+            }
+            
+            result = explode_read_range(stream->data, stream->length,
+                                        &checkpoints, offset, 5000, out_data);
+            check((result == range) &&
+                  !memcmp(out_data, &data[offset], range),
+                  "explode_read_range output", input_name, config);
+        }
+    }
+    explode_checkpoints_free(&checkpoints);
+    engine_time_add(ENGINE_EXPLODE_RANGE, start, length);
+    
+    // Split over files: after the header, then in small pieces.
+    if (stream->length > 2)
+    {
+        unsigned long splits[2][2] = {
+            { 2, stream->length / 3 + 1 },
+            { stream->length / 40 + 2, stream->length / 40 + 1 }
+        };
+        
+        for (int i = 0; i < 2; i++)
+        {
+            span_split(stream->data, stream->length,
+                       splits[i][0], splits[i][1]);
+            span_next = 1;
+            
+            start = now_seconds();
+            explode_files(span_files[0], span_eof_reached, length, &out);
+            engine_time_add(ENGINE_EXPLODE_SPAN, start, length);
+            check(buffer_equal(&out, data, length),
+                  "extract_and_explode output over split files",
+                  input_name, config);
+            out.length = 0;
+            
+            span_files_close();
+        }
+    }
+    
+    implode_buffer_free(&out);
+    free(out_data);
+}
+
+// Check every implode engine against implode(), then the explode engines
+// on its output.
+void check_codec( const unsigned char* data,
+                  unsigned long length,
+                  const char* input_name,
+                  const codec_config_type* config,
+                  const implode_match_table_type* matches )
+{
+    implode_buffer_type reference = {0};
+    implode_buffer_type out = {0};
+    double start;
+    
+    if (!implode_reference(data, length, config, &reference))
+    {
+        check(false, "implode ran out of memory", input_name, config);
+        return;
+    }
+    
+    start = now_seconds();
+    implode_memory(data, length, &out, config->literal_mode,
+                   config->dictionary_size, config->optimization_level,
+                   NULL, NULL);
+    engine_time_add(ENGINE_IMPLODE_MEMORY, start, length);
+    check(buffer_equal(&out, reference.data, reference.length),
+          "implode_memory output", input_name, config);
+    out.length = 0;
+    
+    if (matches)
+    {
+        start = now_seconds();
+        implode_memory(data, length, &out, config->literal_mode,
+                       config->dictionary_size, config->optimization_level,
+                       matches, NULL);
+        engine_time_add(ENGINE_IMPLODE_MATCHES, start, length);
+        check(buffer_equal(&out, reference.data, reference.length),
+              "implode_memory output with match table", input_name, config);
+        out.length = 0;
+    }
+    
+    // Spans: first file of one byte, then the rest in a few files; and a
+    // split part way through, then many small files.
+    implode_span(data, length, config, 1, reference.length / 4 + 1, &out);
+    check(buffer_equal(&out, reference.data, reference.length),
+          "implode output split after 1 byte", input_name, config);
+    out.length = 0;
+    
+    implode_span(data, length, config, reference.length / 2 + 1,
+                 reference.length / 40 + 1, &out);
+    check(buffer_equal(&out, reference.data, reference.length),
+          "implode output split in small pieces", input_name, config);
+    out.length = 0;
+    
+    check_explode(data, length, &reference, input_name, config);
+    
+    implode_buffer_free(&out);
+    implode_buffer_free(&reference);
+}
+
+// Check one input under every configuration.
+void check_all_configs( const unsigned char* data,
+                        unsigned long length,
+                        const char* input_name )
+{
+    implode_match_table_type matches = {0};
+    double start = now_seconds();
+    bool have_matches = implode_find_matches(data, length, &matches,
+                                             thread_count);
+    
+    engine_time_add(ENGINE_FIND_MATCHES, start, length);
+    
+    if (verbose)
+    {
+        printf("%s (%lu bytes)\n", input_name, length);
+    }
+    
+    for (int mode = IMPLODE_BINARY; mode <= IMPLODE_ASCII; mode++)
+    {
+        for (int size = IMPLODE_1K_DICTIONARY; size <= IMPLODE_4K_DICTIONARY;
+             size++)
+        {
+            for (int level = 0; level < LEVEL_COUNT; level++)
+            {
+                codec_config_type config = {
+                    mode, size, optimization_levels[level]
+                };
+                
+                check_codec(data, length, input_name, &config,
+                            have_matches ? &matches : NULL);
+            }
+        }
+    }
+    
+    if (have_matches)
+    {
+        implode_match_table_free(&matches);
+    }
+}
+
+// FNV-1a hash of length bytes, continuing from hash.
+uint64_t hash_bytes( uint64_t hash,
+                     const unsigned char* data,
+                     unsigned long length )
+{
+    for (unsigned long i = 0; i < length; i++)
+    {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    
+    return hash;
+}
+
+// Check implode() against the original encoder's output.
+void check_known_good( void )
+{
+    char input_name[64];
+    
+    for (int i = 0; i < sizeof(known_good) / sizeof(known_good[0]); i++)
+    {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        bool completed = true;
+        
+        for (int j = 0; j < sizeof(known_good_lengths) /
+                            sizeof(known_good_lengths[0]); j++)
+        {
+            unsigned long length = known_good_lengths[j];
+            unsigned char* data = malloc(length + 1);
+            
+            generate_data(known_good[i].kind, data, length, 1);
+            
+            for (int size = IMPLODE_1K_DICTIONARY;
+                 size <= IMPLODE_4K_DICTIONARY; size++)
+            {
+                for (unsigned int level = 0; level <= 3; level++)
+                {
+                    codec_config_type config = {
+                        known_good[i].literal_mode, size, level
+                    };
+                    implode_buffer_type out = {0};
+                    
+                    completed &= implode_reference(data, length, &config,
+                                                   &out);
+                    hash = hash_bytes(hash, out.data, out.length);
+                    implode_buffer_free(&out);
+                }
+            }
+            free(data);
+        }
+        
+        snprintf(input_name, sizeof(input_name), "known good %s",
+                 generate_kind_name(known_good[i].kind));
+        check(completed && (hash == known_good[i].hash),
+              (known_good[i].literal_mode == IMPLODE_ASCII) ?
+                  "implode output differs from the original (ascii)" :
+                  "implode output differs from the original (binary)",
+              input_name, NULL);
+    }
+}
+
+// Change a few bytes of data: overwrite, insert a copy of nearby bytes, or
+// cut the end off.
+unsigned long mutate( unsigned char* data,
+                      unsigned long length,
+                      unsigned long size,
+                      uint32_t* random )
+{
+    int edits = 1 + generate_random(random) % 8;
+    
+    for (int i = 0; (i < edits) && length; i++)
+    {
+        unsigned long position = generate_random(random) % length;
+        
+        switch (generate_random(random) % 4)
+        {
+            case 0:
+                // Flip a bit.
+                data[position] ^= 1 << (generate_random(random) % 8);
+                break;
+            
+            case 1:
+                data[position] = generate_random(random);
+                break;
+            
+            case 2:
+            {
+                // Repeat some bytes in place.
+                unsigned long count = 1 + generate_random(random) % 32;
+                
+                if (length + count > size)
+                {
+                    count = size - length;
+                }
+                if (count > position)
+                {
+                    count = position;
+                }
+                memmove(&data[position + count], &data[position],
+                        length - position);
+                memcpy(&data[position], &data[position - count], count);
+                length += count;
+                break;
+            }
+            
+            default:
+                length = position;
+                break;
+        }
+    }
+    
+    return length;
+}
+
+// Decode a corrupted stream with the memory, file, parallel and pipelined
+// decoders. They may reject it, but must not crash, and any that accept it
+// must agree with each other.
+void check_corrupt_stream( const unsigned char* stream,
+                           unsigned long stream_length,
+                           unsigned long length,
+                           const char* input_name )
+{
+    unsigned char* memory_out = malloc(length + 1);
+    unsigned char* out_data = malloc(length + 1);
+    implode_buffer_type file_out = {0};
+    FILE* in_fp = file_from_memory(stream, stream_length);
+    long memory_result, result;
+    
+    silence_output(true);
+    
+    memory_result = explode_memory(stream, stream_length, STREAM_START,
+                                   memory_out, 0, length, NULL);
+    explode_files(in_fp, NULL, 0, &file_out);
+    
+    silence_output(false);
+    
+    // The file decoder doesn't stop at the expected length, and takes
+    // copies from before the start of the output from its buffer where the
+    // memory decoder fails, so only compare when the memory decoder
+    // succeeds.
+    if (memory_result >= 0)
+    {
+        check((file_out.length >= memory_result) &&
+              ((memory_result == 0) ||
+               !memcmp(file_out.data, memory_out, memory_result)) &&
+              ((memory_result == length) ||
+               (file_out.length == memory_result)),
+              "corrupted stream decoded differently from file",
+              input_name, NULL);
+    }
+    
+    silence_output(true);
+    result = explode_parallel(stream, stream_length, out_data, length,
+                              thread_count, NULL);
+    silence_output(false);
+    
+    if (result >= 0)
+    {
+        check((memory_result == length) &&
+              !memcmp(out_data, memory_out, length),
+              "corrupted stream decoded differently by explode_parallel",
+              input_name, NULL);
+    }
+    
+    silence_output(true);
+    result = explode_pipelined(stream, stream_length, out_data, length,
+                               NULL);
+    silence_output(false);
+    
+    if (result >= 0)
+    {
+        check((memory_result == length) &&
+              !memcmp(out_data, memory_out, length),
+              "corrupted stream decoded differently by explode_pipelined",
+              input_name, NULL);
+    }
+    
+    fclose(in_fp);
+    implode_buffer_free(&file_out);
+    free(out_data);
+    free(memory_out);
+}
+
+// Generated inputs, mutated, under one random configuration each. The
+// stream of each is then corrupted and decoded.
+void check_fuzzed( unsigned long count, uint32_t seed )
+{
+    uint32_t random = seed ? seed : 1;
+    char input_name[64];
+    
+    for (unsigned long i = 0; i < count; i++)
+    {
+        generate_kind_type kind = generate_random(&random) %
+                                  GENERATE_KIND_COUNT;
+        unsigned long size = 1 + generate_random(&random) % 0x4000;
+        unsigned char* data = malloc(size * 2);
+        unsigned long length;
+        codec_config_type config = {
+            generate_random(&random) % 2,
+            IMPLODE_1K_DICTIONARY + generate_random(&random) % 3,
+            optimization_levels[generate_random(&random) % LEVEL_COUNT]
+        };
+        implode_buffer_type stream = {0};
+        
+        generate_data(kind, data, size, generate_random(&random));
+        length = mutate(data, size, size * 2, &random);
+        
+        snprintf(input_name, sizeof(input_name), "fuzz %lu (%s)",
+                 i, generate_kind_name(kind));
+        
+        if (verbose)
+        {
+            printf("%s (%lu bytes)\n", input_name, length);
+        }
+        
+        check_codec(data, length, input_name, &config, NULL);
+        
+        // Corrupt the stream a few times, keeping the header most times.
+        implode_memory(data, length, &stream, config.literal_mode,
+                       config.dictionary_size, config.optimization_level,
+                       NULL, NULL);
+        
+        for (int j = 0; (j < 4) && (stream.length > 2); j++)
+        {
+            unsigned char* corrupt = malloc(stream.length);
+            unsigned long corrupt_length;
+            
+            memcpy(corrupt, stream.data, stream.length);
+            corrupt_length = mutate(corrupt, stream.length, stream.length,
+                                    &random);
+            if (j)
+            {
+                corrupt[0] = stream.data[0];
+                corrupt[1] = stream.data[1];
+            }
+            
+            check_corrupt_stream(corrupt, corrupt_length, length, input_name);
+            free(corrupt);
+        }
+        
+        implode_buffer_free(&stream);
+        free(data);
+    }
+}
+
+void print_throughput( void )
+{
+    printf("\n%-26s %10s %10s\n", "Engine", "MB/s", "Relative");
+    
+    for (int i = 0; i < ENGINE_COUNT; i++)
+    {
+        engine_type reference = (i < ENGINE_EXPLODE) ?
+                                ENGINE_IMPLODE : ENGINE_EXPLODE;
+        double rate, reference_rate;
+        
+        if ((engine_times[i].seconds <= 0) ||
+            (engine_times[reference].seconds <= 0))
+        {
+            continue;
+        }
+        
+        rate = engine_times[i].bytes / engine_times[i].seconds;
+        reference_rate = engine_times[reference].bytes /
+                         engine_times[reference].seconds;
+        
+        printf("%-26s %10.2f %9.2fx\n", engine_names[i], rate / 1e6,
+               rate / reference_rate);
+    }
+}
+
+int main( int argc, const char * argv[] )
+{
+    unsigned long fuzz_count = 200;
+    unsigned long input_count = 1;
+    unsigned long input_size = 64 * 1024;
+    uint32_t seed = 1;
+    char input_name[64];
+    
+    // Edge cases: empty, single bytes, and just over a window.
+    const unsigned long edge_sizes[] = { 0, 1, 2, 3, 4097, 4099 + 518 };
+    
+    for (int j = 1; j < argc; j++)
+    {
+        if (strcmp(argv[j], "-v") == 0)
+        {
+            verbose = true;
+        }
+        else if ((j + 1 < argc) && (strcmp(argv[j], "-f") == 0))
+        {
+            fuzz_count = strtoul(argv[++j], NULL, 10);
+        }
+        else if ((j + 1 < argc) && (strcmp(argv[j], "-j") == 0))
+        {
+            int value = atoi(argv[++j]);
+            thread_count = (value > 1) ? value : 1;
+        }
+        else if ((j + 1 < argc) && (strcmp(argv[j], "-n") == 0))
+        {
+            input_count = strtoul(argv[++j], NULL, 10);
+        }
+        else if ((j + 1 < argc) && (strcmp(argv[j], "-r") == 0))
+        {
+            seed = (uint32_t) strtoul(argv[++j], NULL, 10);
+        }
+        else if ((j + 1 < argc) && (strcmp(argv[j], "-s") == 0))
+        {
+            input_size = strtoul(argv[++j], NULL, 10) * 1024;
+        }
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+    
+    check_known_good();
+    
+    for (int i = 0; i < sizeof(edge_sizes) / sizeof(edge_sizes[0]); i++)
+    {
+        unsigned char* data = malloc(edge_sizes[i] + 1);
+        
+        generate_data(GENERATE_TEXT, data, edge_sizes[i], seed + i);
+        snprintf(input_name, sizeof(input_name), "edge %lu", edge_sizes[i]);
+        check_all_configs(data, edge_sizes[i], input_name);
+        free(data);
+    }
+    
+    for (unsigned long n = 0; n < input_count; n++)
+    {
+        unsigned char* data = malloc(input_size + 1);
+        
+        for (int kind = 0; kind < GENERATE_KIND_COUNT; kind++)
+        {
+            generate_data(kind, data, input_size, seed + n);
+            snprintf(input_name, sizeof(input_name), "%s %lu",
+                     generate_kind_name(kind), n);
+            check_all_configs(data, input_size, input_name);
+        }
+        free(data);
+    }
+    
+    check_fuzzed(fuzz_count, seed);
+    
+    print_throughput();
+    
+    printf("\n%lu checks, %lu failed.\n", check_count, failure_count);
+    
+    return failure_count ? 1 : 0;
+}
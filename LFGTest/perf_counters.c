@@ -0,0 +1,202 @@
+//
+//  perf_counters.c
+//  LFGTest
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "perf_counters.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+const char* perf_counter_names[PERF_COUNTER_COUNT] = {
+    "cycles", "instructions", "branch misses", "L1D misses", "LLC misses"
+};
+
+const char* perf_counter_name( perf_counter_id_type id )
+{
+    if (id >= PERF_COUNTER_COUNT)
+    {
+        return "unknown";
+    }
+    return perf_counter_names[id];
+}
+
+#ifdef __linux__
+
+// Values read from a counter opened with the read_format below.
+typedef struct {
+    uint64_t value;
+    uint64_t time_enabled;
+    uint64_t time_running;
+} perf_read_type;
+
+int perf_counter_open( perf_counter_id_type id )
+{
+    struct perf_event_attr attr;
+    
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;        // Allowed at perf_event_paranoid 2
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    
+    switch (id)
+    {
+        case PERF_CYCLES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        
+        case PERF_INSTRUCTIONS:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        
+        case PERF_BRANCH_MISSES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+        
+        case PERF_L1D_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_L1D |
+                          (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        
+        default:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            break;
+    }
+    
+    // This thread, on any processor.
+    return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int perf_counters_open( perf_counters_type* counters, const char** reason )
+{
+    int count = 0;
+    int error = 0;
+    
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+    {
+        counters->fd[i] = perf_counter_open(i);
+        
+        if (counters->fd[i] >= 0)
+        {
+            count++;
+        }
+        else if (!error)
+        {
+            error = errno;
+        }
+    }
+    
+    if (!count && reason)
+    {
+        *reason = strerror(error);
+    }
+    
+    return count;
+}
+
+void perf_counters_start( perf_counters_type* counters )
+{
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+    {
+        if (counters->fd[i] >= 0)
+        {
+            ioctl(counters->fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+void perf_counters_stop( perf_counters_type* counters,
+                         perf_sample_type* sample )
+{
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+    {
+        if (counters->fd[i] >= 0)
+        {
+            ioctl(counters->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+    {
+        perf_read_type values;
+        
+        if ((counters->fd[i] < 0) ||
+            (read(counters->fd[i], &values, sizeof(values)) !=
+             sizeof(values)))
+        {
+            continue;
+        }
+        
+        // Multiplexed counters only ran part of the time.
+        if ((values.time_running > 0) &&
+            (values.time_running < values.time_enabled))
+        {
+            values.value = (uint64_t)((double) values.value *
+                                      values.time_enabled /
+                                      values.time_running);
+        }
+        
+        sample->value[i] += values.value;
+        sample->valid[i] = true;
+    }
+}
+
+void perf_counters_close( perf_counters_type* counters )
+{
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+    {
+        if (counters->fd[i] >= 0)
+        {
+            close(counters->fd[i]);
+            counters->fd[i] = -1;
+        }
+    }
+}
+
+#else
+
+int perf_counters_open( perf_counters_type* counters, const char** reason )
+{
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+    {
+        counters->fd[i] = -1;
+    }
+    
+    if (reason)
+    {
+        *reason = "perf_event_open() is Linux only";
+    }
+    return 0;
+}
+
+void perf_counters_start( perf_counters_type* counters )
+{
+}
+
+void perf_counters_stop( perf_counters_type* counters,
+                         perf_sample_type* sample )
+{
+}
+
+void perf_counters_close( perf_counters_type* counters )
+{
+}
+
+#endif
@@ -0,0 +1,53 @@
+//
+//  perf_counters.h
+//  LFGTest
+//
+//  Hardware performance counters for the benchmarks, read through Linux
+//  perf_event_open().  Each counter is opened on its own, so any that the
+//  processor, kernel or permissions (perf_event_paranoid) don't allow are
+//  simply marked invalid.  On other systems no counter is ever available.
+
+#ifndef perf_counters_h
+#define perf_counters_h
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+    PERF_CYCLES = 0,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCH_MISSES,
+    PERF_L1D_MISSES,            // Level 1 data cache read misses
+    PERF_LLC_MISSES,            // Last level cache misses
+    PERF_COUNTER_COUNT
+} perf_counter_id_type;
+
+typedef struct {
+    int fd[PERF_COUNTER_COUNT];             // -1 if not available
+} perf_counters_type;
+
+typedef struct {
+    uint64_t value[PERF_COUNTER_COUNT];
+    bool valid[PERF_COUNTER_COUNT];
+} perf_sample_type;
+
+/* Short name of a counter ("cycles", ...). */
+const char* perf_counter_name( perf_counter_id_type id );
+
+/* Open the counters for the calling thread. Returns the number available;
+   if none are, reason (if not NULL) says why.
+*/
+int perf_counters_open( perf_counters_type* counters, const char** reason );
+
+/* Zero and start every available counter. */
+void perf_counters_start( perf_counters_type* counters );
+
+/* Stop the counters and add what they counted to sample. Counts are scaled
+   up if the kernel had to share the hardware between counters.
+*/
+void perf_counters_stop( perf_counters_type* counters,
+                         perf_sample_type* sample );
+
+void perf_counters_close( perf_counters_type* counters );
+
+#endif /* perf_counters_h */